@@ -0,0 +1,12 @@
+# Plots a CSV of bench/scaling.sh, called with csv, png and sweep variables
+set datafile separator ','
+set terminal pngcairo size 900,600
+set output png
+set title sprintf('Phases against program size, sweep of %s', sweep)
+set xlabel 'program size, bytes'
+set ylabel 'time, us'
+set logscale xy
+set key top left
+plot csv using 1:3 skip 1 with linespoints title 'load', \
+     csv using 1:4 skip 1 with linespoints title 'analysis', \
+     csv using 1:5 skip 1 with linespoints title 'execution'
@@ -0,0 +1,101 @@
+#!/usr/bin/env bash
+#
+# Scaling benchmark: generates programs of growing size with lama-gen, runs them
+# with --time-phases and checks that the time of every phase grows linearly.
+#
+#   SWEEP=functions|body|loops|patterns  parameter to grow (functions by default)
+#   SIZES="16 64 256 ..."                its values
+#   REPEAT=N                             runs per size, the fastest one is kept
+#   THRESHOLD=K                          fail if time per byte grows more than K times
+#
+# Results are written to bench/out/scaling-$SWEEP.csv and, with gnuplot, to a png
+
+if command -v readlink > /dev/null; then
+  SCRIPT_DIR=$(dirname "$(readlink -f "$0")")
+else
+  SCRIPT_DIR=$(dirname "$(cd "$(dirname "$0")" && pwd)")
+fi
+
+BUILD="${BUILD:-$SCRIPT_DIR/../build}"
+LAMA_INTERPRETER="$BUILD/LamaInterpreter"
+LAMA_GEN="$BUILD/lama-gen"
+
+SWEEP=${SWEEP:-functions}
+REPEAT=${REPEAT:-3}
+THRESHOLD=${THRESHOLD:-4}
+case "$SWEEP" in
+  functions) SIZES=${SIZES:-"16 64 256 1024 4096"} ;;
+  body)      SIZES=${SIZES:-"4 16 64 256 1024"} ;;
+  loops)     SIZES=${SIZES:-"1 2 3 4"} ;;
+  patterns)  SIZES=${SIZES:-"1 4 16 64 256"} ;;
+  *)
+    echo "Error: unknown SWEEP=$SWEEP, expected functions, body, loops or patterns" >&2
+    exit 1
+    ;;
+esac
+
+for tool in "$LAMA_INTERPRETER" "$LAMA_GEN"; do
+  if [ ! -x "$tool" ]; then
+    echo "Error: $tool is not built" >&2
+    exit 1
+  fi
+done
+
+OUT="$SCRIPT_DIR/out"
+mkdir -p "$OUT"
+CSV="$OUT/scaling-$SWEEP.csv"
+echo "size_bytes,$SWEEP,load_us,analysis_us,execution_us" > "$CSV"
+
+for size in $SIZES; do
+  program="$OUT/$SWEEP-$size.bc"
+  # Deep loops multiply the work, so keep iterations low when they are swept
+  extra=""
+  if [ "$SWEEP" = loops ]; then extra="--iterations=2"; fi
+  "$LAMA_GEN" "--$SWEEP=$size" $extra "$program" || exit 1
+  bytes=$(stat -c %s "$program")
+
+  best=""
+  for _ in $(seq "$REPEAT"); do
+    phases=$("$LAMA_INTERPRETER" --time-phases "$program" 2>&1 > /dev/null | grep '^load_us=')
+    if [ -z "$phases" ]; then
+      echo "Error: $program has failed" >&2
+      exit 1
+    fi
+    load=$(echo "$phases" | sed 's/.*load_us=\([0-9]*\).*/\1/')
+    analysis=$(echo "$phases" | sed 's/.*analysis_us=\([0-9]*\).*/\1/')
+    execution=$(echo "$phases" | sed 's/.*execution_us=\([0-9]*\).*/\1/')
+    total=$((load + analysis + execution))
+    if [ -z "$best" ] || [ "$total" -lt "$best" ]; then
+      best=$total
+      row="$bytes,$size,$load,$analysis,$execution"
+    fi
+  done
+  echo "$row" | tee -a "$CSV"
+done
+
+if command -v gnuplot > /dev/null; then
+  gnuplot -e "csv='$CSV'; png='$OUT/scaling-$SWEEP.png'; sweep='$SWEEP'" "$SCRIPT_DIR/scaling.gp"
+  echo "Plot: $OUT/scaling-$SWEEP.png"
+fi
+
+# Time per byte of the largest program against the smallest one. Tiny programs
+# are dominated by the startup, so 1 microsecond is the floor of every phase.
+# Execution of nested loops is exponential in their depth by design, it is not checked then
+lastPhase=5
+if [ "$SWEEP" = loops ]; then lastPhase=4; fi
+awk -F, -v threshold="$THRESHOLD" -v lastPhase="$lastPhase" '
+  NR == 1 { for (i = 3; i <= lastPhase; ++i) name[i] = $i }
+  NR == 2 { for (i = 3; i <= lastPhase; ++i) first[i] = ($i > 1 ? $i : 1) / $1 }
+  NR > 2  { for (i = 3; i <= lastPhase; ++i) last[i] = ($i > 1 ? $i : 1) / $1 }
+  END {
+    status = 0
+    for (i = 3; i <= lastPhase; ++i) {
+      if (!(i in last)) continue
+      ratio = last[i] / first[i]
+      if (ratio > threshold) {
+        printf "W %s per byte has grown %.1f times, more than linear\n", name[i], ratio
+        status = 1
+      }
+    }
+    exit status
+  }' "$CSV"
@@ -0,0 +1,36 @@
+#!/usr/bin/env bash
+#
+# Startup benchmark: time from execve to the first executed instruction of a
+# program that does almost nothing, so only the fixed costs are left.
+#
+#   RUNS=N  runs of the interpreter (100 by default)
+#
+# Compare a regular build with -DLAMA_MINIMAL_STARTUP=ON one to see what static linking gives
+
+if command -v readlink > /dev/null; then
+  SCRIPT_DIR=$(dirname "$(readlink -f "$0")")
+else
+  SCRIPT_DIR=$(dirname "$(cd "$(dirname "$0")" && pwd)")
+fi
+
+BUILD="${BUILD:-$SCRIPT_DIR/../build}"
+LAMA_INTERPRETER="$BUILD/LamaInterpreter"
+LAMA_GEN="$BUILD/lama-gen"
+LAMA_STARTUP="$BUILD/lama-startup"
+RUNS=${RUNS:-100}
+
+for tool in "$LAMA_INTERPRETER" "$LAMA_GEN" "$LAMA_STARTUP"; do
+  if [ ! -x "$tool" ]; then
+    echo "Error: $tool is not built" >&2
+    exit 1
+  fi
+done
+
+OUT="$SCRIPT_DIR/out"
+mkdir -p "$OUT"
+program="$OUT/startup.bc"
+# A single function that allocates nothing: startup is all there is to measure
+"$LAMA_GEN" --functions=1 --body=1 --loops=0 --patterns=0 --arith=1 --sexp=0 --array=0 --string=0 --closure=0 \
+  "$program" || exit 1
+
+"$LAMA_STARTUP" "--runs=$RUNS" "$LAMA_INTERPRETER" "$program"
@@ -17,6 +17,7 @@ mkdir -p tests
 pushd tests 2>&1 1>/dev/null || exit
 
 LAMA_INTERPRETER="../build/LamaInterpreter"
+LAMA_CONVERT="../build/lama-convert"
 LAMA_PATHS=(
     "../Lama/regression"
     "../Lama/regression/deep-expressions"
@@ -27,6 +28,20 @@ BLACKLIST=(
     "../Lama/regression/test111.lama"
 )
 
+# Flags of lama-convert, the optimized program must print the same as v1
+OPTIMIZER_FLAGS=(
+    "--unroll=4"
+    "--reuse-values"
+    "--promote-globals"
+    "--promote-globals --unroll=4 --reuse-values"
+)
+
+# Flags of the interpreter, every function is compiled at its first call and must print the same as v1
+TIER_FLAGS=(
+    "--compile-threshold=1"
+    "--compile-threshold=1 --background-compile"
+)
+
 declare -A failed_tests
 
 for LAMA_PATH in "${LAMA_PATHS[@]}"; do
@@ -55,9 +70,107 @@ for LAMA_PATH in "${LAMA_PATHS[@]}"; do
             cat "$file"
             failed_tests["$file"]="$output"
         fi
+
+        # The same program converted ahead of time must behave the same
+        $LAMA_CONVERT "$baseName.bc" "$baseName.v2.bc"
+        outputV2=$($LAMA_INTERPRETER "$baseName.v2.bc" < "$LAMA_PATH/$baseName.input")
+        if [ "$outputV2" != "$output" ]; then
+            echo "Output of v2 for $baseName differs from v1!"
+            failed_tests["$file (v2)"]="$outputV2"
+        fi
+
+        $LAMA_CONVERT --compress "$baseName.bc" "$baseName.bcz"
+        outputCompressed=$($LAMA_INTERPRETER "$baseName.bcz" < "$LAMA_PATH/$baseName.input")
+        if [ "$outputCompressed" != "$output" ]; then
+            echo "Output of compressed $baseName differs from v1!"
+            failed_tests["$file (compressed)"]="$outputCompressed"
+        fi
+
+        # Replay feeds the recorded input and checks the output against the recorded digest
+        $LAMA_INTERPRETER --record="$baseName.rec" "$baseName.bc" < "$LAMA_PATH/$baseName.input" > /dev/null
+        if ! $LAMA_INTERPRETER --replay="$baseName.rec" "$baseName.bc"; then
+            echo "Replay of $baseName has failed!"
+            failed_tests["$file (replay)"]="replay exited with an error"
+        fi
+        # Flip a bit of the output digest, it is at offset 24 of `RecordingHeader`
+        digestByte=$(od -An -tu1 -j24 -N1 "$baseName.rec" | tr -d ' ')
+        printf "\\x$(printf %02x $((digestByte ^ 1)))" | dd of="$baseName.rec" bs=1 seek=24 conv=notrunc 2> /dev/null
+        replayErrors=$($LAMA_INTERPRETER --replay="$baseName.rec" "$baseName.bc" 2>&1 > /dev/null)
+        if [ $? -eq 0 ] || [[ "$replayErrors" != *"output differs from the recording"* ]]; then
+            echo "Replay of $baseName with a broken digest has not noticed it!"
+            failed_tests["$file (broken replay)"]="$replayErrors"
+        fi
+
+        for flags in "${OPTIMIZER_FLAGS[@]}"; do
+            # Not quoted, a line may hold several flags
+            $LAMA_CONVERT --verbose $flags "$baseName.bc" "$baseName.opt.bc"
+            outputOptimized=$($LAMA_INTERPRETER "$baseName.opt.bc" < "$LAMA_PATH/$baseName.input")
+            if [ "$outputOptimized" != "$output" ]; then
+                echo "Output of $baseName converted with $flags differs from v1!"
+                failed_tests["$file ($flags)"]="$outputOptimized"
+            fi
+        done
+
+        for flags in "${TIER_FLAGS[@]}"; do
+            outputTier=$($LAMA_INTERPRETER $flags "$baseName.bc" < "$LAMA_PATH/$baseName.input")
+            if [ "$outputTier" != "$output" ]; then
+                echo "Output of $baseName with $flags differs from v1!"
+                failed_tests["$file ($flags)"]="$outputTier"
+            fi
+        done
     done
 done
 
+# Live data of this program only grows, so --heap-max must stop it
+cat > heap-grow.lama << 'EOF'
+var list, i;
+list := {};
+i := 0;
+while i < 10000000 do
+  list := i : list;
+  i := i + 1
+od;
+write (i)
+EOF
+lamac -b heap-grow.lama
+heapErrors=$($LAMA_INTERPRETER --heap-max=16M heap-grow.bc 2>&1 > /dev/null)
+if [ $? -eq 0 ] || [[ "$heapErrors" != *"exceeds the limit"* ]]; then
+    echo "--heap-max has not stopped a growing program!"
+    failed_tests["heap-grow.lama (--heap-max)"]="$heapErrors"
+fi
+
+# A breakpoint on a function entry stops the call, and the call goes on after `continue`
+cat > debug-call.lama << 'EOF'
+public fun inc (x) {
+  x + 1
+}
+
+fun run (x) {
+  var y = x + 1;
+  inc (y)
+}
+
+write (run (40))
+EOF
+lamac -b debug-call.lama
+rm -f debug-call.sock
+$LAMA_INTERPRETER --debug=debug-call.sock debug-call.bc > debug-call.out &
+debuggee=$!
+for _ in $(seq 50); do
+    [ -S debug-call.sock ] && break
+    sleep 0.1
+done
+# The caller's frame is current at the breakpoint, so `local 0` is `y` of `run`
+session=$(printf 'break inc\ncontinue\nwhere\nlocal 0\ncontinue\n' | socat -t 10 - UNIX-CONNECT:debug-call.sock)
+wait $debuggee
+debuggeeStatus=$?
+if [ $debuggeeStatus -ne 0 ] || [ "$(cat debug-call.out)" != "42" ] \
+    || [[ "$session" != *"stopped breakpoint"* ]] || [[ "$session" != *$'\n41\nok\n'* ]] \
+    || [[ "$session" != *$'\nexited' ]]; then
+    echo "Debugger session has failed!"
+    failed_tests["debug-call.lama (--debug)"]="$session"
+fi
+
 LAMA_PERF_PATH="../Lama/performance"
 for file in "$LAMA_PERF_PATH"/*.lama; do
     baseName=$(basename "$file" .lama)
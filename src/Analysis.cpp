@@ -0,0 +1,199 @@
+#include "Analysis.hpp"
+
+#include "Interpreter.hpp"
+#include "Opcodes.hpp"
+#include "Types.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <span>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr usize WORD   = sizeof(u32);
+
+auto readWord(std::span<const u8> code, usize offset) noexcept -> u32 {
+    u32 result;
+    copyValues(&result, code.data() + offset);
+    return result;
+}
+
+auto hex(usize value) -> std::string {
+    std::stringstream ss;
+    ss << "0x" << std::hex << value;
+    return ss.str();
+}
+
+/**
+ * @brief Checks instructions from `begin` till `end` or the end of the code marker
+ *
+ * @return where the check has stopped
+ */
+auto verifyRange(std::span<const u8> code, usize begin, usize end, std::span<const FunctionEntry> functions, bool lazy,
+                 DiagnosticsBag& errors) -> usize {
+    auto isFunction = [&](u32 address) {
+        auto function = std::ranges::lower_bound(functions, address, {}, &FunctionEntry::entry);
+        return function != functions.end() && function->entry == address;
+    };
+
+    auto                               bounded = code.first(end);
+    std::vector<bool>                  starts((end - begin) / WORD, false);
+    std::vector<std::pair<usize, u32>> jumps; // instruction and its target
+
+    usize offset = begin;
+    while (offset < end && !isEndOfCode(code[offset])) {
+        auto length = instructionLength(bounded, offset);
+        if (!length.has_value()) {
+            errors.emplace_back("unknown or truncated instruction " + std::to_string(code[offset]) + " at "
+                                + hex(offset));
+            return offset;
+        }
+        starts[(offset - begin) / WORD] = true;
+
+        u8          opcode = code[offset];
+        const auto& info   = opcodeInfo(opcode);
+        if (readWord(code, offset) >> 8 != 0) {
+            errors.emplace_back("reserved bytes of instruction at " + hex(offset) + " are not zero");
+        }
+        if (opcode == to_underlying(Opcodes::LAZY)) {
+            if (!lazy || !isFunction(static_cast<u32>(offset))) {
+                errors.emplace_back("LAZY at " + hex(offset) + " is not a compressed function");
+            }
+        } else if (isPrivateOpcode(opcode)) {
+            errors.emplace_back("opcode " + std::string(info.name) + " at " + hex(offset)
+                                + " is private to the interpreter");
+        }
+        if (info.has(OP_TARGET)) {
+            u32 target = readWord(code, offset + WORD);
+            if (info.has(OP_BRANCHES)) {
+                jumps.emplace_back(offset, target);
+            } else if (!isFunction(target)) {
+                errors.emplace_back("target " + hex(target) + " of instruction at " + hex(offset)
+                                    + " is not a function");
+            }
+        }
+        if (opcode == to_underlying(Opcodes::CLOSURE)) {
+            usize argsEnd = offset + length.value();
+            for (usize arg = offset + info.length(); arg < argsEnd; arg += sizeof(Bytefile::ClosureArg)) {
+                if (readWord(code, arg) > to_underlying(VariableType::Captured)) {
+                    errors.emplace_back("closure at " + hex(offset) + " captures a variable of unknown kind");
+                }
+            }
+        }
+        offset += length.value();
+    }
+
+    auto isStart = [&](usize address) {
+        return address >= begin && address < offset && address % WORD == 0 && starts[(address - begin) / WORD];
+    };
+    for (auto [at, target] : jumps) {
+        if (!isStart(target)) {
+            errors.emplace_back("target " + hex(target) + " of instruction at " + hex(at)
+                                + " is not the beginning of an instruction");
+        }
+    }
+    for (auto& function : functions) {
+        if (function.entry >= begin && function.entry < end && !isStart(function.entry)) {
+            errors.emplace_back("function at " + hex(function.entry) + " is not the beginning of an instruction");
+        }
+    }
+    return offset;
+}
+
+} // namespace
+
+auto verifyCode(std::span<const u8> code, std::span<const FunctionEntry> functions, bool lazy) -> DiagnosticsBag {
+    DiagnosticsBag errors;
+    auto           stop = verifyRange(code, 0, code.size(), functions, lazy, errors);
+    if (errors.empty() && stop == code.size()) { errors.emplace_back("no end of the code marker"); }
+    return errors;
+}
+
+auto verifyFunction(std::span<const u8> code, const FunctionEntry& function, std::span<const FunctionEntry> functions)
+    -> DiagnosticsBag {
+    DiagnosticsBag errors;
+    auto           stop = verifyRange(code, function.entry, function.end, functions, false, errors);
+    if (errors.empty() && stop != function.end) {
+        errors.emplace_back("function at " + hex(function.entry) + " has the end of the code marker inside");
+    }
+    return errors;
+}
+
+auto operandWords(u8 opcode) noexcept -> std::optional<usize> {
+    const auto& info = opcodeInfo(opcode);
+    if (!info.known) { return std::nullopt; }
+    return info.operands;
+}
+
+auto instructionLength(std::span<const u8> code, usize offset) noexcept -> std::optional<usize> {
+    if (offset >= code.size() || offset % WORD != 0) { return std::nullopt; }
+
+    const auto& info = opcodeInfo(code[offset]);
+    if (!info.known) { return std::nullopt; }
+
+    usize length = info.length();
+    if (code.size() - offset < length) { return std::nullopt; }
+    if (!info.has(OP_VARIABLE_LENGTH)) [[likely]] { return length; }
+
+    if (code[offset] == to_underlying(Opcodes::CLOSURE)) {
+        u32 n = readWord(code, offset + 2 * WORD);
+        if ((code.size() - offset - length) / sizeof(Bytefile::ClosureArg) < n) { return std::nullopt; }
+        length += static_cast<usize>(n) * sizeof(Bytefile::ClosureArg);
+    }
+    if (code[offset] == to_underlying(Opcodes::LAZY)) {
+        // not decompressed function takes its whole code range
+        u32 range = readWord(code, offset + 2 * WORD);
+        if (range < length || range % WORD != 0 || code.size() - offset < range) { return std::nullopt; }
+        length = range;
+    }
+    return length;
+}
+
+auto insertSafepoints(Bytefile& bytefile) -> DiagnosticsBag {
+    std::span<const u8> code = bytefile.bytecode;
+
+    auto errors = forEachInstruction(code, [&](usize offset, usize /*length*/) {
+        u8&         opcode = bytefile.bytecode[offset];
+        const auto& info   = opcodeInfo(opcode);
+        if (info.polling == 0) { return; }
+        // Only back edges are able to make a loop, forward jumps are left as is
+        if (info.has(OP_BRANCHES) && readWord(code, offset + WORD) > offset) { return; }
+        opcode = info.polling;
+    });
+
+    for (auto& e : errors) { e = "cannot place safepoints: " + e; }
+    return errors;
+}
+
+auto describeInstruction(std::span<const u8> code, usize offset) -> std::string {
+    std::stringstream ss;
+    auto              length = instructionLength(code, offset);
+    if (!length.has_value()) {
+        ss << (offset < code.size() ? toString(static_cast<Opcodes>(code[offset])) : "END_OF_CODE");
+        return ss.str();
+    }
+
+    const auto& info = opcodeInfo(code[offset]);
+    ss << info.name;
+    for (usize i = 0; i < info.operands; ++i) {
+        ss << ' ';
+        u32 operand = readWord(code, offset + (1 + i) * WORD);
+        // Addresses are easier to match with the error messages in hex
+        if (i == 0 && info.has(OP_TARGET)) {
+            ss << "0x" << std::hex << operand << std::dec;
+        } else {
+            ss << static_cast<i32>(operand);
+        }
+    }
+    if (code[offset] == to_underlying(Opcodes::CLOSURE)) {
+        for (usize arg = offset + info.length(); arg < offset + length.value(); arg += sizeof(Bytefile::ClosureArg)) {
+            ss << ' ' << "GLAC"[code[arg] & 0x3] << '(' << readWord(code, arg + WORD) << ')';
+        }
+    }
+    return ss.str();
+}
@@ -0,0 +1,95 @@
+/**
+ * @file Analysis.hpp
+ * @brief This file contains static passes over the bytecode, that are done
+ * before the interpretation starts
+ *
+ */
+#pragma once
+
+#include "Interpreter.hpp"
+#include "Types.hpp"
+
+#include <optional>
+#include <span>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Returns the number of operand words that follow the opcode, closure
+ * arguments are not counted. It is the same for v1 and v2
+ *
+ * @return std::nullopt if the opcode is unknown
+ */
+auto operandWords(u8 opcode) noexcept -> std::optional<usize>;
+
+/**
+ * @brief Returns the length of v2 instruction that starts at `offset`
+ *
+ * @return std::nullopt if the opcode is unknown or instruction is cut by the end of bytecode
+ */
+auto instructionLength(std::span<const u8> code, usize offset) noexcept -> std::optional<usize>;
+
+/**
+ * @brief Disassembles the instruction that starts at `offset`: its name and
+ * operands, code addresses in hex
+ */
+auto describeInstruction(std::span<const u8> code, usize offset) -> std::string;
+
+/**
+ * @brief checks whether an instruction is the end of the code marker
+ * (every opcode with the high nibble of 0xF)
+ */
+constexpr auto isEndOfCode(u8 code) noexcept -> bool { return (code & 0xF0) == 0xF0; }
+
+/**
+ * @brief Calls `visit(offset, length)` for every instruction in the order of
+ * addresses, till the end of the code marker
+ *
+ * @return errors if an instruction could not be decoded, everything before it is visited
+ */
+template<typename Visitor>
+auto forEachInstruction(std::span<const u8> code, Visitor&& visit) -> DiagnosticsBag {
+    DiagnosticsBag errors;
+
+    usize offset = 0;
+    while (offset < code.size() && !isEndOfCode(code[offset])) {
+        auto length = instructionLength(code, offset);
+        if (!length.has_value()) {
+            std::stringstream ss;
+            ss << "unknown or truncated instruction " << static_cast<u32>(code[offset]) << " at 0x" << std::hex
+               << offset;
+            errors.emplace_back(ss.str());
+            break;
+        }
+        visit(offset, length.value());
+        offset += length.value();
+    }
+    return errors;
+}
+
+/**
+ * @brief Checks the code of v2 image before anything executes it: every opcode
+ * is known and public, reserved bytes are zero, jumps land on the beginnings of
+ * instructions, calls and closures on the functions of the table, and the code
+ * ends with the end of the code marker. Functions of a compressed image are
+ * `LAZY` (`lazy` is set), they are checked by `verifyFunction` when they are decompressed
+ *
+ * @param functions the function table, sorted by entry address
+ */
+auto verifyCode(std::span<const u8> code, std::span<const FunctionEntry> functions, bool lazy) -> DiagnosticsBag;
+
+/**
+ * @brief Same as `verifyCode`, but for the code of a single function. Jumps
+ * must stay inside of it
+ */
+auto verifyFunction(std::span<const u8> code, const FunctionEntry& function, std::span<const FunctionEntry> functions)
+    -> DiagnosticsBag;
+
+/**
+ * @brief Rewrites backward jumps and call sites into their `_safe` variants.
+ * Only they will poll execution limits, everything else stays untouched
+ *
+ * @return errors if the bytecode could not be scanned till the end
+ */
+auto insertSafepoints(Bytefile& bytefile) -> DiagnosticsBag;
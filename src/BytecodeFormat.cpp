@@ -0,0 +1,402 @@
+#include "BytecodeFormat.hpp"
+
+#include "Analysis.hpp"
+#include "LamaRuntime.hpp"
+#include "Lz4.hpp"
+#include "Opcodes.hpp"
+#include "Types.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace {
+
+constexpr usize OPCODE          = sizeof(u8);
+constexpr usize WORD            = sizeof(u32);
+constexpr usize CLOSURE_ARG_V1  = sizeof(u8) + sizeof(u32);
+constexpr usize HEADER_V1_WORDS = 3;
+constexpr u32   NO_INSTRUCTION  = std::numeric_limits<u32>::max();
+constexpr usize LAZY_STUB_SIZE  = 3 * WORD;
+
+auto readWord(std::span<const u8> code, usize offset) noexcept -> u32 {
+    u32 result;
+    copyValues(&result, code.data() + offset);
+    return result;
+}
+
+auto instructionLengthV1(std::span<const u8> code, usize offset) noexcept -> std::optional<usize> {
+    auto words = operandWords(code[offset]);
+    if (!words.has_value()) { return std::nullopt; }
+
+    usize length = OPCODE + words.value() * WORD;
+    if (code.size() - offset < length) { return std::nullopt; }
+
+    if (code[offset] == to_underlying(Opcodes::CLOSURE)) {
+        u32 n = readWord(code, offset + OPCODE + WORD);
+        if ((code.size() - offset - length) / CLOSURE_ARG_V1 < n) { return std::nullopt; }
+        length += static_cast<usize>(n) * CLOSURE_ARG_V1;
+    }
+    return length;
+}
+
+auto lengthV2(std::span<const u8> code, usize offset, usize lengthV1) noexcept -> usize {
+    if (code[offset] == to_underlying(Opcodes::CLOSURE)) {
+        usize n = readWord(code, offset + OPCODE + WORD);
+        return WORD * (3 + 2 * n);
+    }
+    return WORD * (1 + (lengthV1 - OPCODE) / WORD);
+}
+
+auto hex(usize value) -> std::string {
+    std::stringstream ss;
+    ss << "0x" << std::hex << value;
+    return ss.str();
+}
+
+/**
+ * @brief Everything learned about v1 code in the first pass
+ */
+struct Layout {
+    std::vector<u32>           newAddress; // v1 address -> v2 address, `NO_INSTRUCTION` inside instructions
+    std::vector<usize>         instructions;
+    std::vector<FunctionEntry> functions;
+    std::vector<TagEntry>      tags;
+    std::unordered_map<u32, u32> tagIndex; // string pool offset -> tag table index
+    usize                      endV1 = 0;  // the end of the code marker
+    u32                        codeSize = 0;
+};
+
+auto layoutV2(const BytefileV1& bytefile) -> std::variant<DiagnosticsBag, Layout> {
+    auto   code = bytefile.bytecode;
+    Layout layout;
+    layout.newAddress.assign(code.size() + 1, NO_INSTRUCTION);
+
+    DiagnosticsBag errors;
+    usize          offset  = 0;
+    usize          address = 0;
+    while (offset < code.size() && !isEndOfCode(code[offset])) {
+        auto length = instructionLengthV1(code, offset);
+        if (!length.has_value()) {
+            errors.emplace_back("unknown or truncated instruction " + std::to_string(code[offset]) + " at "
+                                + hex(offset));
+            return errors;
+        }
+
+        layout.newAddress[offset] = static_cast<u32>(address);
+        layout.instructions.push_back(offset);
+
+        auto opcode = static_cast<Opcodes>(code[offset]);
+        if (opcode == Opcodes::BEGIN || opcode == Opcodes::CBEGIN) {
+            if (!layout.functions.empty()) { layout.functions.back().end = static_cast<u32>(address); }
+            layout.functions.push_back({static_cast<u32>(address), readWord(code, offset + OPCODE),
+                                        readWord(code, offset + OPCODE + WORD), 0});
+        }
+        if (opcode == Opcodes::SEXP || opcode == Opcodes::TAG) {
+            u32 name = readWord(code, offset + OPCODE);
+            if (name >= bytefile.strPool.size()) {
+                errors.emplace_back("tag of " + std::string(toString(opcode)) + " at " + hex(offset)
+                                    + " is outside of the string pool");
+            } else if (!layout.tagIndex.contains(name)) {
+                // SAFETY: see `Interpreter::onSexp`, `LtagHash` does not change the string
+                auto* text = const_cast<char*>(reinterpret_cast<const char*>(bytefile.strPool.data() + name));
+                layout.tagIndex.emplace(name, static_cast<u32>(layout.tags.size()));
+                layout.tags.push_back({name, LtagHash(text)});
+            }
+        }
+
+        address += lengthV2(code, offset, length.value());
+        offset  += length.value();
+    }
+    if (offset >= code.size()) {
+        errors.emplace_back("no end of the code marker");
+        return errors;
+    }
+
+    layout.endV1              = offset;
+    layout.newAddress[offset] = static_cast<u32>(address);
+    layout.codeSize           = static_cast<u32>(address + WORD);
+    if (!layout.functions.empty()) { layout.functions.back().end = static_cast<u32>(address); }
+
+    if (!errors.empty()) { return errors; }
+    return layout;
+}
+
+} // namespace
+
+auto isBytecodeV2(std::span<const u8> file) noexcept -> bool {
+    if (file.size() < sizeof(BytecodeHeaderV2)) { return false; }
+    return readWord(file, 0) == BYTECODE_V2_MAGIC;
+}
+
+// v1 header looks like this
+// ┌────────────┬────────────┬───────────┬────────────────┬─────────────┬────────────────┐
+// │            │            │           │                │             │                │
+// │strPool size│globals size│pubSym size│ public Symbols │ string pool │ bytecode       │
+// │    (bytes) │   (words)  │           │                │             │                │
+// └────────────┴────────────┴───────────┴────────────────┴─────────────┴────────────────┘
+//   4 bytes      4 bytes      4 bytes     pubSym * 2     strPool size   rest of the file
+//                                         * sizeof(i32)
+
+auto parseBytecodeV1(std::span<const u8> file) -> std::variant<DiagnosticsBag, BytefileV1> {
+    usize fileSize   = file.size();
+    usize headerSize = HEADER_V1_WORDS * WORD;
+    if (fileSize < headerSize) { return DiagnosticsBag {"file is too short: " + std::to_string(fileSize) + " bytes"}; }
+
+    BytefileV1 result {};
+    u32        strPoolSize         = readWord(file, 0);
+    u32        publicSymbolsNumber = readWord(file, 2 * WORD);
+    result.globalAreaSize          = readWord(file, WORD);
+
+    usize publicSymbolsSize = static_cast<usize>(publicSymbolsNumber) * 2 * WORD;
+    if (publicSymbolsSize + headerSize >= fileSize) {
+        std::stringstream ss;
+        ss << "public symbols size is " << publicSymbolsSize << " bytes, while file size is " << fileSize << " bytes";
+        return DiagnosticsBag {ss.str()};
+    }
+    // NOTE: the file is read into words, so symbols are aligned
+    result.publicSymbols = {reinterpret_cast<const u32*>(file.data() + headerSize), // NOLINT(*-reinterpret-cast)
+                            static_cast<usize>(publicSymbolsNumber) * 2};
+
+    if (strPoolSize + publicSymbolsSize + headerSize >= fileSize) {
+        std::stringstream ss;
+        ss << "string pool size is " << strPoolSize << " bytes, while remaining file size is "
+           << (fileSize - publicSymbolsSize - headerSize) << " bytes";
+        return DiagnosticsBag {ss.str()};
+    }
+    result.strPool  = file.subspan(headerSize + publicSymbolsSize, strPoolSize);
+    result.bytecode = file.subspan(headerSize + publicSymbolsSize + strPoolSize);
+
+    return result;
+}
+
+auto convertToV2(const BytefileV1& bytefile) -> std::variant<DiagnosticsBag, std::vector<u32>> {
+    auto possibleLayout = layoutV2(bytefile);
+    if (std::holds_alternative<DiagnosticsBag>(possibleLayout)) {
+        return std::get<DiagnosticsBag>(std::move(possibleLayout));
+    }
+    auto  layout = std::get<Layout>(std::move(possibleLayout));
+    auto  code   = bytefile.bytecode;
+    DiagnosticsBag errors;
+
+    auto isInstruction = [&](u32 target) {
+        return target < layout.newAddress.size() && layout.newAddress[target] != NO_INSTRUCTION;
+    };
+    auto relocate = [&](u32 target, usize at) -> u32 {
+        if (!isInstruction(target)) {
+            errors.emplace_back("target " + hex(target) + " of instruction at " + hex(at)
+                                + " is not the beginning of an instruction");
+            return 0;
+        }
+        return layout.newAddress[target];
+    };
+
+    std::vector<u32> image;
+    usize            strPoolWords = (bytefile.strPool.size() + WORD - 1) / WORD;
+    image.reserve(sizeof(BytecodeHeaderV2) / WORD + bytefile.publicSymbols.size() + layout.functions.size() * 4
+                  + layout.tags.size() * 2 + strPoolWords + layout.codeSize / WORD);
+
+    BytecodeHeaderV2 header {
+        BYTECODE_V2_MAGIC,
+        BYTECODE_V2_VERSION,
+        static_cast<u32>(bytefile.strPool.size()),
+        bytefile.globalAreaSize,
+        static_cast<u32>(bytefile.publicSymbols.size() / 2),
+        static_cast<u32>(layout.functions.size()),
+        static_cast<u32>(layout.tags.size()),
+        layout.codeSize,
+    };
+    image.resize(sizeof(header) / WORD);
+    std::memcpy(image.data(), &header, sizeof(header));
+
+    for (usize i = 0; i + 1 < bytefile.publicSymbols.size(); i += 2) {
+        u32 address = bytefile.publicSymbols[i + 1];
+        if (!isInstruction(address)) {
+            errors.emplace_back("public symbol " + std::to_string(i / 2) + " points to " + hex(address)
+                                + ", it is not the beginning of an instruction");
+        }
+        image.push_back(bytefile.publicSymbols[i]);
+        image.push_back(isInstruction(address) ? layout.newAddress[address] : 0);
+    }
+    for (auto& [entry, nArgs, nLocals, end] : layout.functions) {
+        image.insert(image.end(), {entry, nArgs, nLocals, end});
+    }
+    for (auto& [name, hash] : layout.tags) { image.insert(image.end(), {name, static_cast<u32>(hash)}); }
+
+    auto poolStart = image.size();
+    image.resize(poolStart + strPoolWords, 0);
+    std::memcpy(image.data() + poolStart, bytefile.strPool.data(), bytefile.strPool.size());
+
+    for (auto offset : layout.instructions) {
+        auto        opcode = static_cast<Opcodes>(code[offset]);
+        const auto& info   = opcodeInfo(code[offset]);
+        image.push_back(code[offset]);
+
+        auto operand = [&](usize i) { return readWord(code, offset + OPCODE + i * WORD); };
+        switch (opcode) {
+        case Opcodes::SEXP:
+        case Opcodes::TAG: {
+            auto tag = layout.tagIndex.find(operand(0));
+            image.insert(image.end(), {tag == layout.tagIndex.end() ? 0 : tag->second, operand(1)});
+            break;
+        }
+        case Opcodes::CLOSURE: {
+            u32 n = operand(1);
+            image.insert(image.end(), {relocate(operand(0), offset), n});
+            usize args = offset + OPCODE + 2 * WORD;
+            for (u32 i = 0; i < n; ++i, args += CLOSURE_ARG_V1) {
+                image.insert(image.end(), {code[args], readWord(code, args + OPCODE)});
+            }
+            break;
+        }
+        default: {
+            // Jumps and calls have their target first
+            for (usize i = 0; i < info.operands; ++i) {
+                image.push_back(i == 0 && info.has(OP_TARGET) ? relocate(operand(i), offset) : operand(i));
+            }
+            break;
+        }
+        }
+    }
+    image.push_back(code[layout.endV1]);
+
+    if (!errors.empty()) { return errors; }
+    return image;
+}
+
+auto sectionsOf(const BytecodeHeaderV2& header) noexcept -> SectionsV2 {
+    auto       words = [](u64 bytes) { return (bytes + WORD - 1) / WORD; };
+    SectionsV2 sections {};
+    sections.publicSymbols = sizeof(BytecodeHeaderV2) / WORD;
+    sections.functions     = sections.publicSymbols + u64 {header.publicSymbolsNumber} * 2;
+    sections.tags          = sections.functions + u64 {header.functionsNumber} * (sizeof(FunctionEntry) / WORD);
+    sections.strPool       = sections.tags + u64 {header.tagsNumber} * (sizeof(TagEntry) / WORD);
+    sections.code          = sections.strPool + words(header.strPoolSize);
+    sections.end           = sections.code + words(header.codeSize);
+    return sections;
+}
+
+auto isCompressedContainer(std::span<const u8> file) noexcept -> bool {
+    if (file.size() < sizeof(ContainerHeader)) { return false; }
+    return readWord(file, 0) == CONTAINER_MAGIC;
+}
+
+auto compressImage(std::span<const u32> image) -> std::variant<DiagnosticsBag, std::vector<u8>> {
+    BytecodeHeaderV2 header;
+    if (image.size() * WORD < sizeof(header)) { return DiagnosticsBag {"v2 header is truncated"}; }
+    std::memcpy(&header, image.data(), sizeof(header));
+
+    auto sections = sectionsOf(header);
+    if (sections.end > image.size()) { return DiagnosticsBag {"v2 image is truncated"}; }
+
+    std::vector<u32>    metadata(image.begin(), image.end());
+    std::span<const u8> code {reinterpret_cast<const u8*>(image.data() + sections.code), header.codeSize}; // NOLINT
+    auto*               lazyCode = metadata.data() + sections.code;
+
+    DiagnosticsBag               errors;
+    std::vector<std::vector<u8>> frames;
+    for (u32 i = 0; i < header.functionsNumber; ++i) {
+        FunctionEntry function;
+        std::memcpy(&function, image.data() + sections.functions + i * (sizeof(FunctionEntry) / WORD),
+                    sizeof(function));
+        if (function.end > header.codeSize || function.end < function.entry || function.entry % WORD != 0
+            || function.end - function.entry < LAZY_STUB_SIZE) {
+            errors.emplace_back("function at " + hex(function.entry) + " has wrong code range or is too short");
+            continue;
+        }
+
+        frames.push_back(lz4Compress(code.subspan(function.entry, function.end - function.entry)));
+        auto* stub = lazyCode + function.entry / WORD;
+        std::fill(stub, lazyCode + function.end / WORD, 0);
+        stub[0] = to_underlying(Opcodes::LAZY);
+        stub[1] = i;
+        stub[2] = function.end - function.entry;
+    }
+    if (!errors.empty()) { return errors; }
+
+    auto compressedMetadata = lz4Compress(
+        {reinterpret_cast<const u8*>(metadata.data()), metadata.size() * WORD}); // NOLINT(*-reinterpret-cast)
+
+    ContainerHeader containerHeader {
+        CONTAINER_MAGIC,
+        CONTAINER_VERSION,
+        static_cast<u32>(frames.size()),
+        {},
+    };
+    usize offset            = sizeof(ContainerHeader) + frames.size() * sizeof(CompressedFrame);
+    containerHeader.metadata = {static_cast<u32>(offset), static_cast<u32>(compressedMetadata.size()),
+                                static_cast<u32>(metadata.size() * WORD)};
+    offset                 += compressedMetadata.size();
+
+    std::vector<CompressedFrame> table;
+    for (u32 i = 0; i < header.functionsNumber; ++i) {
+        FunctionEntry function;
+        std::memcpy(&function, image.data() + sections.functions + i * (sizeof(FunctionEntry) / WORD),
+                    sizeof(function));
+        table.push_back({static_cast<u32>(offset), static_cast<u32>(frames[i].size()), function.end - function.entry});
+        offset += frames[i].size();
+    }
+
+    std::vector<u8> container(sizeof(ContainerHeader) + table.size() * sizeof(CompressedFrame));
+    std::memcpy(container.data(), &containerHeader, sizeof(containerHeader));
+    std::memcpy(container.data() + sizeof(containerHeader), table.data(), table.size() * sizeof(CompressedFrame));
+    container.insert(container.end(), compressedMetadata.begin(), compressedMetadata.end());
+    for (auto& frame : frames) { container.insert(container.end(), frame.begin(), frame.end()); }
+    return container;
+}
+
+auto inflateMetadata(std::span<const u8> container)
+    -> std::variant<DiagnosticsBag, std::pair<std::vector<u32>, std::span<const CompressedFrame>>> {
+    ContainerHeader header;
+    if (container.size() < sizeof(header)) { return DiagnosticsBag {"container header is truncated"}; }
+    std::memcpy(&header, container.data(), sizeof(header));
+    if (header.version != CONTAINER_VERSION) {
+        return DiagnosticsBag {"unsupported container version " + std::to_string(header.version)};
+    }
+
+    auto tableSize = u64 {header.framesNumber} * sizeof(CompressedFrame);
+    if (sizeof(header) + tableSize > container.size()) {
+        return DiagnosticsBag {"frame table takes " + std::to_string(tableSize) + " bytes, while the whole file size is "
+                               + std::to_string(container.size()) + " bytes"};
+    }
+    // NOTE: the file is read into words, so the table is aligned
+    std::span<const CompressedFrame> frames {
+        reinterpret_cast<const CompressedFrame*>(container.data() + sizeof(header)), // NOLINT(*-reinterpret-cast)
+        header.framesNumber};
+
+    DiagnosticsBag errors;
+    auto           isInside = [&](const CompressedFrame& frame) {
+        return u64 {frame.offset} + frame.size <= container.size();
+    };
+    auto couldInflate = [](const CompressedFrame& frame) { return lz4CouldInflate(frame.size, frame.rawSize); };
+    if (!isInside(header.metadata) || header.metadata.rawSize % WORD != 0) {
+        errors.emplace_back("metadata frame is outside of the container");
+    } else if (!couldInflate(header.metadata)) {
+        errors.emplace_back("metadata frame of " + std::to_string(header.metadata.size)
+                            + " bytes could not inflate to " + std::to_string(header.metadata.rawSize) + " bytes");
+    }
+    for (usize i = 0; i < frames.size(); ++i) {
+        if (!isInside(frames[i])) { errors.emplace_back("frame " + std::to_string(i) + " is outside of the container"); }
+        if (!couldInflate(frames[i])) {
+            errors.emplace_back("frame " + std::to_string(i) + " of " + std::to_string(frames[i].size)
+                                + " bytes could not inflate to " + std::to_string(frames[i].rawSize) + " bytes");
+        }
+    }
+    if (!errors.empty()) { return errors; }
+
+    std::vector<u32> image(header.metadata.rawSize / WORD);
+    auto             inflated = lz4Decompress(container.subspan(header.metadata.offset, header.metadata.size),
+                                              {reinterpret_cast<u8*>(image.data()), header.metadata.rawSize}); // NOLINT
+    if (inflated != header.metadata.rawSize) { return DiagnosticsBag {"metadata frame is broken"}; }
+
+    return std::pair {std::move(image), frames};
+}
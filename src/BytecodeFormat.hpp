@@ -0,0 +1,160 @@
+/**
+ * @file BytecodeFormat.hpp
+ * @brief This file contains on-disk formats of the bytecode: v1 as it is
+ * emitted by `lamac` and aligned v2, and conversion from the former to the latter.
+ * The interpreter executes only v2, v1 files are converted on load
+ *
+ */
+#pragma once
+
+#include "Types.hpp"
+
+#include <span>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// v2 file layout, every field and every table entry is a 32-bit word
+// ┌────────┬────────────────┬────────────────┬───────────┬──────────┬─────────────────────┬───────────┐
+// │        │                │                │           │          │                     │           │
+// │ header │ public symbols │ function table │ tag table │ string   │ padding to the word │ code      │
+// │        │ (name, addr)   │                │           │ pool     │                     │           │
+// └────────┴────────────────┴────────────────┴───────────┴──────────┴─────────────────────┴───────────┘
+//   8 words  pubSym * 2      functions * 4    tags * 2   strPool    0..3 bytes            codeSize
+//
+// Every instruction starts with a word which lowest byte is the opcode and the
+// others are reserved (zero). Operands follow, a word each. Closure arguments
+// take two words: variable type and index. Operands of `SEXP` and `TAG` are
+// indices in the tag table instead of the string pool. Addresses are byte
+// offsets in the code, as in v1
+
+constexpr u32 BYTECODE_V2_MAGIC   = 0x3243424C; // "LBC2"
+constexpr u32 BYTECODE_V2_VERSION = 2;
+
+struct BytecodeHeaderV2 {
+    u32 magic;
+    u32 version;
+    u32 strPoolSize;    // bytes, without padding
+    u32 globalAreaSize; // words
+    u32 publicSymbolsNumber;
+    u32 functionsNumber;
+    u32 tagsNumber;
+    u32 codeSize; // bytes
+};
+
+/**
+ * @brief Function table entry, the code of function is [entry, end)
+ */
+struct FunctionEntry {
+    u32 entry; // address of `BEGIN` or `CBEGIN`
+    u32 nArgs;
+    u32 nLocals;
+    u32 end;
+};
+
+/**
+ * @brief Tag table entry. Hash is what `LtagHash` returns for the name,
+ * so neither `SEXP` nor `TAG` computes it at run time
+ */
+struct TagEntry {
+    u32 name; // offset in the string pool
+    i32 hash;
+};
+
+/**
+ * @brief Offsets of v2 parts in words, they follow from the header alone
+ */
+struct SectionsV2 {
+    u64 publicSymbols;
+    u64 functions;
+    u64 tags;
+    u64 strPool;
+    u64 code;
+    u64 end;
+};
+
+auto sectionsOf(const BytecodeHeaderV2& header) noexcept -> SectionsV2;
+
+static_assert(sizeof(BytecodeHeaderV2) == 8 * sizeof(u32));
+static_assert(sizeof(FunctionEntry) == 4 * sizeof(u32));
+static_assert(sizeof(TagEntry) == 2 * sizeof(u32));
+
+/**
+ * @brief v1 file as it is emitted by `lamac`, spans point into the file
+ */
+struct BytefileV1 {
+    std::span<const u8>  strPool;
+    std::span<const u32> publicSymbols;
+    std::span<const u8>  bytecode;
+    u32                  globalAreaSize;
+};
+
+/**
+ * @brief checks the magic of v2. The first word of v1 is the size of its
+ * string pool, so it could be confused only with a v1 file of ~800 MiB of strings
+ */
+auto isBytecodeV2(std::span<const u8> file) noexcept -> bool;
+
+/**
+ * @brief Splits v1 file into its parts
+ */
+auto parseBytecodeV1(std::span<const u8> file) -> std::variant<DiagnosticsBag, BytefileV1>;
+
+/**
+ * @brief Converts v1 file to v2 image: instructions are widened to words, jump,
+ * call and closure targets and public symbols are relocated, the function and
+ * tag tables are built
+ *
+ * @return errors if some instruction could not be decoded or some target is not
+ * at the beginning of an instruction
+ */
+auto convertToV2(const BytefileV1& bytefile) -> std::variant<DiagnosticsBag, std::vector<u32>>;
+
+// Compressed container layout, frames are LZ4 blocks (see `Lz4.hpp`)
+// ┌────────┬─────────────┬────────────────┬──────────────┬─────┬──────────────┐
+// │        │             │                │              │     │              │
+// │ header │ frame table │ metadata frame │ function 0   │ ... │ function N-1 │
+// │        │             │                │ frame        │     │ frame        │
+// └────────┴─────────────┴────────────────┴──────────────┴─────┴──────────────┘
+//   6 words  N * 3 words
+//
+// Metadata frame is the whole v2 image, where the code of every function is
+// replaced by `LAZY, frame, length` and zeroes. Function frames are the code
+// ranges of the function table, so the i-th frame is the i-th function. The
+// loader decompresses only metadata, functions are decompressed on the first call
+
+constexpr u32 CONTAINER_MAGIC   = 0x5A43424C; // "LBCZ"
+constexpr u32 CONTAINER_VERSION = 1;
+
+struct CompressedFrame {
+    u32 offset; // from the beginning of the container
+    u32 size;
+    u32 rawSize;
+};
+
+struct ContainerHeader {
+    u32             magic;
+    u32             version;
+    u32             framesNumber;
+    CompressedFrame metadata;
+};
+
+static_assert(sizeof(CompressedFrame) == 3 * sizeof(u32));
+static_assert(sizeof(ContainerHeader) == 6 * sizeof(u32));
+
+auto isCompressedContainer(std::span<const u8> file) noexcept -> bool;
+
+/**
+ * @brief Compresses v2 image into the container, a frame per function
+ *
+ * @return errors if the image is inconsistent or some function is too short for `LAZY` stub
+ */
+auto compressImage(std::span<const u32> image) -> std::variant<DiagnosticsBag, std::vector<u8>>;
+
+/**
+ * @brief Checks that every frame is inside the container and decompresses metadata
+ *
+ * @return v2 image with lazy functions and the frame table of the container
+ */
+auto inflateMetadata(std::span<const u8> container)
+    -> std::variant<DiagnosticsBag, std::pair<std::vector<u32>, std::span<const CompressedFrame>>>;
@@ -0,0 +1,239 @@
+#include "Debugger.hpp"
+
+#include "Analysis.hpp"
+#include "Interpreter.hpp"
+#include "Opcodes.hpp"
+#include "Types.hpp"
+#include "Utils.hpp"
+
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <variant>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "LamaRuntime.hpp"
+
+namespace {
+
+constexpr usize DEFAULT_STACK_SHOWN = 8;
+
+auto parseAddress(std::string_view text) -> std::optional<u32> {
+    int base = 10;
+    if (text.starts_with("0x")) {
+        text.remove_prefix(2);
+        base = 16;
+    }
+    u32  value {};
+    auto end       = text.data() + text.size();
+    auto [ptr, ec] = std::from_chars(text.data(), end, value, base);
+    if (text.empty() || ec != std::errc {} || ptr != end) { return std::nullopt; }
+    return value;
+}
+
+auto describeValue(usize value) -> std::string {
+    std::stringstream ss;
+    if (UNBOXED(value)) {
+        ss << UNBOX(value);
+    } else {
+        ss << "ref 0x" << std::hex << value;
+    }
+    return ss.str();
+}
+
+auto variableType(std::string_view name) -> std::optional<VariableType> {
+    if (name == "global") { return VariableType::Global; }
+    if (name == "local") { return VariableType::Local; }
+    if (name == "arg") { return VariableType::Argument; }
+    if (name == "captured") { return VariableType::Captured; }
+    return std::nullopt;
+}
+
+} // namespace
+
+auto Debugger::attach(const std::string& path) -> std::variant<DiagnosticsBag, Debugger> {
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) { return DiagnosticsBag {"socket path is too long: " + path}; }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) { return DiagnosticsBag {std::string("cannot create socket: ") + std::strerror(errno)}; }
+    // NOLINTNEXTLINE(*-reinterpret-cast): that's how sockets API is
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 1) != 0) {
+        auto error = std::string("cannot listen on ") + path + ": " + std::strerror(errno);
+        close(listener);
+        return DiagnosticsBag {error};
+    }
+
+    Debugger result;
+    do {
+        result.client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    } while (result.client < 0 && errno == EINTR);
+    auto error = errno;
+    // Nobody else could connect, so the path is not needed anymore
+    close(listener);
+    unlink(path.c_str());
+    if (result.client < 0) { return DiagnosticsBag {std::string("cannot accept debugger: ") + std::strerror(error)}; }
+    return result;
+}
+
+auto Debugger::stop(Bytefile& bytefile, Interpreter& interpreter, std::string_view reason) -> Resume {
+    if (client < 0) { return Resume::Continue; }
+    if (instructionStarts.empty()) {
+        instructionStarts.resize(bytefile.bytecode.size());
+        // Errors are found by the analysis already, and the interpreter would stop at them anyway
+        forEachInstruction(bytefile.bytecode, [&](usize offset, usize) { instructionStarts[offset] = true; });
+    }
+
+    send("stopped " + std::string(reason) + " " + where(bytefile) + "\n");
+    while (auto line = readLine()) {
+        std::string_view command = *line;
+        std::string_view argument;
+        if (auto space = command.find(' '); space != std::string_view::npos) {
+            argument = command.substr(space + 1);
+            command  = command.substr(0, space);
+        }
+
+        if (command == "continue") { return Resume::Continue; }
+        if (command == "step") { return Resume::Step; }
+        if (command == "kill") { return Resume::Kill; }
+        send(answer(bytefile, interpreter, command, argument));
+    }
+
+    detach(bytefile);
+    return Resume::Continue;
+}
+
+auto Debugger::answer(Bytefile& bytefile, Interpreter& interpreter, std::string_view command,
+                      std::string_view argument) -> std::string {
+    std::stringstream reply;
+    if (command == "break") { return setBreakpoint(bytefile, argument); }
+    if (command == "delete") {
+        auto address    = parseAddress(argument);
+        auto breakpoint = address ? breakpoints.find(*address) : breakpoints.end();
+        if (breakpoint == breakpoints.end()) { return "error no breakpoint at " + std::string(argument) + "\n"; }
+        bytefile.bytecode[breakpoint->first] = breakpoint->second;
+        breakpoints.erase(breakpoint);
+        return "ok\n";
+    }
+    if (command == "breakpoints") {
+        for (auto& [address, code] : breakpoints) { reply << "0x" << std::hex << address << '\n'; }
+        reply << "ok\n";
+        return reply.str();
+    }
+    if (command == "where") { return where(bytefile) + "\nok\n"; }
+    if (command == "stack") {
+        auto values = interpreter.stackValues();
+        auto shown  = argument.empty() ? std::optional<u32> {DEFAULT_STACK_SHOWN} : parseAddress(argument);
+        if (!shown) { return "error expected a number of values\n"; }
+        reply << "depth " << values.size() << '\n';
+        for (usize i = 0; i < values.size() && i < *shown; ++i) { reply << describeValue(values[i]) << '\n'; }
+        reply << "ok\n";
+        return reply.str();
+    }
+    if (auto type = variableType(command)) {
+        auto index = parseAddress(argument);
+        auto value = index ? interpreter.variable(*index, *type) : std::nullopt;
+        if (!value) { return "error no " + std::string(command) + " " + std::string(argument) + "\n"; }
+        return describeValue(*value) + "\nok\n";
+    }
+    return "error unknown command " + std::string(command) + "\n";
+}
+
+auto Debugger::where(Bytefile& bytefile) -> std::string {
+    auto address = static_cast<u32>(bytefile.address());
+    // Instruction is described with its own opcode, not with the trap
+    auto breakpoint = breakpoints.find(address);
+    if (breakpoint != breakpoints.end()) { bytefile.bytecode[address] = breakpoint->second; }
+    std::stringstream ss;
+    ss << "0x" << std::hex << address << std::dec << ' ' << describeInstruction(bytefile.bytecode, address);
+    if (breakpoint != breakpoints.end()) { bytefile.bytecode[address] = to_underlying(Opcodes::TRAP); }
+    if (bytefile.fileLine) { ss << " line " << bytefile.fileLine; }
+    return ss.str();
+}
+
+auto Debugger::setBreakpoint(Bytefile& bytefile, std::string_view location) -> std::string {
+    auto address = parseAddress(location);
+    if (!address) {
+        // Not a number, so let it be a public function
+        for (usize i = 0; i + 1 < bytefile.publicSymbols.size(); i += 2) {
+            if (bytefile.getString(bytefile.publicSymbols[i]) == location) { address = bytefile.publicSymbols[i + 1]; }
+        }
+        if (!address) { return "error no function " + std::string(location) + "\n"; }
+    }
+    if (*address >= instructionStarts.size() || !instructionStarts[*address]) {
+        return "error " + std::string(location) + " is not the beginning of an instruction\n";
+    }
+
+    if (breakpoints.emplace(*address, bytefile.bytecode[*address]).second) {
+        bytefile.bytecode[*address] = to_underlying(Opcodes::TRAP);
+    }
+    std::stringstream reply;
+    reply << "breakpoint 0x" << std::hex << *address << "\nok\n";
+    return reply.str();
+}
+
+void Debugger::exited(InterpretResult result) {
+    if (client < 0) { return; }
+    send(result == InterpretResult::STOP ? "exited\n" : "exited with error\n");
+}
+
+auto Debugger::readLine() -> std::optional<std::string> {
+    std::array<char, 256> chunk {};
+    while (true) {
+        if (auto newline = input.find('\n'); newline != std::string::npos) {
+            auto line = input.substr(0, newline);
+            input.erase(0, newline + 1);
+            if (!line.empty() && line.back() == '\r') { line.pop_back(); }
+            return line;
+        }
+        auto got = read(client, chunk.data(), chunk.size());
+        if (got < 0 && errno == EINTR) { continue; }
+        if (got <= 0) { return std::nullopt; }
+        input.append(chunk.data(), static_cast<usize>(got));
+    }
+}
+
+void Debugger::send(std::string_view text) {
+    while (!text.empty() && client >= 0) {
+        auto sent = ::send(client, text.data(), text.size(), MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) { continue; }
+        if (sent <= 0) { return; } // the client is gone, reading will tell so
+        text.remove_prefix(static_cast<usize>(sent));
+    }
+}
+
+void Debugger::detach(Bytefile& bytefile) {
+    for (auto& [address, code] : breakpoints) { bytefile.bytecode[address] = code; }
+    breakpoints.clear();
+    close(client);
+    client = -1;
+}
+
+Debugger::Debugger(Debugger&& other) noexcept
+    : client(std::exchange(other.client, -1)),
+      input(std::move(other.input)),
+      breakpoints(std::move(other.breakpoints)),
+      instructionStarts(std::move(other.instructionStarts)) {}
+
+auto Debugger::operator=(Debugger&& other) noexcept -> Debugger& {
+    std::swap(client, other.client);
+    std::swap(input, other.input);
+    std::swap(breakpoints, other.breakpoints);
+    std::swap(instructionStarts, other.instructionStarts);
+    return *this;
+}
+
+Debugger::~Debugger() {
+    if (client >= 0) { close(client); }
+}
@@ -0,0 +1,98 @@
+/**
+ * @file Debugger.hpp
+ * @brief This file contains the debugger. Breakpoints are private `TRAP` opcodes
+ * patched into the bytecode, so the dispatch loop checks nothing: it runs as
+ * usual till some breakpoint makes `interpretOne` return `TRAP`
+ *
+ * Client talks to the debugger with text lines over a UNIX socket. Every
+ * command is answered by some lines and `ok` or `error <why>`:
+ *
+ *   break ADDRESS|FUNCTION   delete ADDRESS   breakpoints
+ *   continue                 step             kill
+ *   where                    stack [N]        global|local|arg|captured N
+ *
+ * The program is stopped before the first instruction, on every breakpoint
+ * and after every step, which is told by `stopped <why> <address> <instruction>`.
+ * When the program ends, `exited` is sent. Closing the connection removes
+ * every breakpoint and lets the program run
+ *
+ */
+#pragma once
+
+#include "Interpreter.hpp"
+#include "Types.hpp"
+
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+class Debugger {
+public:
+    enum class Resume : u8 {
+        Continue,
+        Step,
+        Kill,
+    };
+
+    /**
+     * @brief Listens on `path` and waits for the client to connect
+     */
+    static auto attach(const std::string& path) -> std::variant<DiagnosticsBag, Debugger>;
+
+    /**
+     * @brief Serves the client while the program is stopped, ip is on the next instruction
+     *
+     * @return how the program goes on
+     */
+    auto stop(Bytefile& bytefile, Interpreter& interpreter, std::string_view reason) -> Resume;
+
+    /**
+     * @brief Executes the next instruction, a breakpoint on it is lifted for that time
+     */
+    template<typename Execute>
+    auto executeOne(Bytefile& bytefile, Execute&& execute) -> InterpretResult {
+        auto address    = static_cast<u32>(bytefile.address());
+        auto breakpoint = breakpoints.find(address);
+        if (breakpoint == breakpoints.end()) { return execute(); }
+
+        bytefile.bytecode[address] = breakpoint->second;
+        auto result                = execute();
+        // The instruction may have quickened itself, it's the new opcode that the trap hides then
+        breakpoint->second         = bytefile.bytecode[address];
+        bytefile.bytecode[address] = to_underlying(Opcodes::TRAP);
+        return result;
+    }
+
+    void exited(InterpretResult result);
+
+    Debugger(const Debugger&)                    = delete;
+    auto operator=(const Debugger&) -> Debugger& = delete;
+    Debugger(Debugger&& other) noexcept;
+    auto operator=(Debugger&& other) noexcept -> Debugger&;
+    ~Debugger();
+
+private:
+    Debugger() = default;
+
+    auto readLine() -> std::optional<std::string>;
+    void send(std::string_view text);
+    /**
+     * @brief Answers a command that does not resume the program
+     */
+    auto answer(Bytefile& bytefile, Interpreter& interpreter, std::string_view command, std::string_view argument)
+        -> std::string;
+    /**
+     * @brief Address and instruction under ip, and the source line if it is known
+     */
+    auto where(Bytefile& bytefile) -> std::string;
+    auto setBreakpoint(Bytefile& bytefile, std::string_view location) -> std::string;
+    void detach(Bytefile& bytefile);
+
+    int               client = -1;
+    std::string       input; // received, but not read as a line yet
+    std::map<u32, u8> breakpoints; // address and the opcode the trap hides
+    std::vector<bool> instructionStarts; // found by the first stop, before anything is patched
+};
@@ -0,0 +1,55 @@
+#include "GcHooks.hpp"
+
+#include "LamaRuntime.hpp"
+#include "Limits.hpp"
+#include "Probes.hpp"
+#include "Types.hpp"
+
+#include <cstdarg>
+#include <ctime>
+#include <sys/mman.h>
+
+GcCounters gcCounters;
+bool       heapReady = false;
+
+void initHeap() {
+    __init();
+    heapReady = true;
+}
+
+auto monotonicNanos() noexcept -> u64 {
+    timespec now {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<u64>(now.tv_sec) * 1'000'000'000 + static_cast<u64>(now.tv_nsec);
+}
+
+// NOLINTBEGIN(readability-identifier-naming)
+extern "C" {
+
+void* __real_mremap(void* oldAddress, size_t oldSize, size_t newSize, int flags, ...);
+
+// `gc.c` grows the heap with `MREMAP_MAYMOVE` when compaction starts, and shrinks
+// it in place when it is done. So the first one counts the collection and the last
+// one tells the final heap size
+__attribute__((used, externally_visible)) void*
+__wrap_mremap(void* oldAddress, size_t oldSize, size_t newSize, int flags, ...) {
+    void* result;
+    if (flags & MREMAP_FIXED) {
+        va_list args;
+        va_start(args, flags);
+        void* newAddress = va_arg(args, void*);
+        va_end(args);
+        result = __real_mremap(oldAddress, oldSize, newSize, flags, newAddress);
+    } else {
+        result = __real_mremap(oldAddress, oldSize, newSize, flags);
+    }
+
+    if (flags & MREMAP_MAYMOVE) { ++gcCounters.collections; }
+    gcCounters.heapBytes = newSize;
+    // Nothing can be allocated in the middle of a collection, the heap is resized later
+    if (gcCounters.notify && !(flags & MREMAP_MAYMOVE)) { interruptPending = 1; }
+    LAMA_PROBE2(gc__resize, oldSize, newSize);
+    return result;
+}
+}
+// NOLINTEND(readability-identifier-naming)
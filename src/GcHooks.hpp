@@ -0,0 +1,63 @@
+/**
+ * @file GcHooks.hpp
+ * @brief This file contains observation of the Lama garbage collector from
+ * the runtime linkage
+ *
+ * Collector in `Lama/runtime/gc.c` has no hooks of its own. The only thing of it
+ * that is visible from outside is the heap resize with `mremap`, which is done
+ * in the compaction of every collection. So the link wraps `mremap` (see `CMakeLists.txt`)
+ * and every allocating runtime call of the interpreter goes through `gcAware`
+ *
+ */
+#pragma once
+
+#include "Probes.hpp"
+#include "Types.hpp"
+#include "Utils.hpp"
+
+struct GcCounters {
+    u64   allocations = 0;     // allocating runtime calls done by the interpreter, only when timed
+    u32   collections = 0;     // collections noticed by `mremap` wrapper
+    usize heapBytes   = 0;     // heap size after the last collection
+    u64   pauseNanos  = 0;     // time spent in allocations that have collected, only when timed
+    bool  timed       = false; // measure pauses even when no tracer is attached
+    bool  notify      = false; // poke the next safepoint after every collection, see `HeapPolicy`
+};
+
+extern GcCounters gcCounters;
+
+auto monotonicNanos() noexcept -> u64;
+
+/**
+ * @brief Whether the runtime heap is set up. It is done by the first allocation
+ * instead of startup, so programs that allocate nothing skip it altogether
+ */
+extern bool heapReady;
+
+void initHeap();
+
+LI_ALWAYS_INLINE void ensureHeap() {
+    if (!heapReady) [[unlikely]] { initHeap(); }
+}
+
+/**
+ * @brief Calls a runtime function that may start a collection. Allocations are
+ * counted and pause is measured only when someone is listening, otherwise it's just a call
+ */
+template<typename Allocate>
+LI_ALWAYS_INLINE auto gcAware(Allocate&& allocate) -> decltype(allocate()) {
+    ensureHeap();
+    if (!gcCounters.timed && !LAMA_PROBE_ENABLED(gc__done)) [[likely]] { return allocate(); }
+
+    ++gcCounters.allocations;
+
+    u32  collections = gcCounters.collections;
+    u64  start       = monotonicNanos();
+    auto result      = allocate();
+    if (collections != gcCounters.collections) {
+        u64 pause = monotonicNanos() - start;
+        gcCounters.pauseNanos += pause;
+        LAMA_PROBE3(gc__done, gcCounters.collections, pause, gcCounters.heapBytes);
+    }
+    return result;
+}
@@ -0,0 +1,210 @@
+#include "HeapCensus.hpp"
+
+#include "GcHooks.hpp"
+#include "Interpreter.hpp"
+#include "LamaRuntime.hpp"
+#include "Types.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <iomanip>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+constexpr usize TOP_ROOTS = 10;
+
+struct HeapObject {
+    usize value; // pointer to this object as it is stored in fields and on stack
+    data* header;
+};
+
+struct Usage {
+    usize count = 0;
+    usize bytes = 0;
+};
+
+auto objectSize(const HeapObject& object) -> usize {
+    auto header = static_cast<u32>(object.header->data_header);
+    auto length = static_cast<usize>(LEN(header));
+    switch (TAG(header)) {
+    case STRING_TAG: return sizeof(data) + length + 1;
+    case SEXP_TAG: return sizeof(sexp) + length * sizeof(i32);
+    default: return sizeof(data) + length * sizeof(i32);
+    }
+}
+
+/**
+ * @brief Pointer fields of the object, closure code address is skipped
+ */
+auto objectFields(const HeapObject& object) -> std::span<const i32> {
+    auto header = static_cast<u32>(object.header->data_header);
+    auto length = static_cast<usize>(LEN(header));
+    // NOLINTBEGIN(*-reinterpret-cast): layout of objects is defined by the runtime
+    switch (TAG(header)) {
+    case ARRAY_TAG: return {reinterpret_cast<const i32*>(object.header->contents), length};
+    case SEXP_TAG: return {reinterpret_cast<const sexp*>(object.header)->contents, length};
+    case CLOSURE_TAG: {
+        if (length == 0) { return {}; }
+        return {reinterpret_cast<const i32*>(object.header->contents) + 1, length - 1};
+    }
+    default: return {};
+    }
+    // NOLINTEND(*-reinterpret-cast)
+}
+
+auto collectHeap() -> std::vector<HeapObject> {
+    std::vector<HeapObject> objects;
+    if (!heapReady) { return objects; } // nothing is allocated yet
+    for (auto it = heap_begin_iterator(); !heap_is_done_iterator(&it); heap_next_obj_iterator(&it)) {
+        auto* header = reinterpret_cast<data*>(it.current); // NOLINT(*-reinterpret-cast)
+        // S-expression is referenced by its tag, everything else by its contents
+        auto value = TAG(static_cast<u32>(header->data_header)) == SEXP_TAG
+                       ? std::bit_cast<usize>(&reinterpret_cast<sexp*>(header)->tag) // NOLINT(*-reinterpret-cast)
+                       : std::bit_cast<usize>(&header->contents[0]);
+        objects.push_back({value, header});
+    }
+    // Heap is walked in the order of addresses already, but let's not rely on it
+    std::sort(objects.begin(), objects.end(), [](auto& lhs, auto& rhs) { return lhs.value < rhs.value; });
+    return objects;
+}
+
+auto findObject(const std::vector<HeapObject>& objects, usize value) -> std::optional<usize> {
+    if (UNBOXED(value)) { return std::nullopt; }
+    auto it = std::lower_bound(objects.begin(), objects.end(), value,
+                               [](const HeapObject& object, usize v) { return object.value < v; });
+    if (it == objects.end() || it->value != value) { return std::nullopt; }
+    return static_cast<usize>(it - objects.begin());
+}
+
+} // namespace
+
+HeapCensus::HeapCensus(Bytefile& bytefile) {
+    for (auto& [name, hash] : bytefile.tags) {
+        if (auto text = bytefile.getString(name)) { constructors.emplace(UNBOX(hash), text.value()); }
+    }
+
+    for (usize i = 0; i + 1 < bytefile.publicSymbols.size(); i += 2) {
+        if (auto name = bytefile.getString(bytefile.publicSymbols[i])) {
+            functions.emplace(bytefile.publicSymbols[i + 1], name.value());
+        }
+    }
+}
+
+void HeapCensus::report(std::ostream& out, std::string_view reason, std::span<usize> globals,
+                        std::span<usize> stack) const {
+    auto objects = collectHeap();
+
+    constexpr usize NO_OWNER = ~usize {0};
+    std::vector<usize> owner(objects.size(), NO_OWNER);
+    std::vector<usize> work;
+
+    // Globals go first, then the stack from the bottom, i.e. from the oldest frame
+    std::vector<usize> roots(globals.begin(), globals.end());
+    roots.insert(roots.end(), stack.rbegin(), stack.rend());
+
+    for (usize root = 0; root < roots.size(); ++root) {
+        auto start = findObject(objects, roots[root]);
+        if (!start || owner[*start] != NO_OWNER) { continue; }
+
+        owner[*start] = root;
+        work.push_back(*start);
+        while (!work.empty()) {
+            auto object = work.back();
+            work.pop_back();
+            for (auto field : objectFields(objects[object])) {
+                auto child = findObject(objects, static_cast<usize>(static_cast<u32>(field)));
+                if (!child || owner[*child] != NO_OWNER) { continue; }
+                owner[*child] = root;
+                work.push_back(*child);
+            }
+        }
+    }
+
+    std::unordered_map<std::string, Usage> byKind;
+    std::vector<Usage>                     byRoot(roots.size());
+    Usage                                  total;
+    for (usize i = 0; i < objects.size(); ++i) {
+        if (owner[i] == NO_OWNER) { continue; }
+
+        auto&             object = objects[i];
+        auto              header = static_cast<u32>(object.header->data_header);
+        std::stringstream kind;
+        switch (TAG(header)) {
+        case STRING_TAG: kind << "string"; break;
+        case ARRAY_TAG: kind << "array"; break;
+        case SEXP_TAG: {
+            auto tag = reinterpret_cast<sexp*>(object.header)->tag; // NOLINT(*-reinterpret-cast)
+            if (auto name = constructors.find(tag); name != constructors.end()) {
+                kind << "sexp " << name->second;
+            } else {
+                kind << "sexp #" << tag;
+            }
+            break;
+        }
+        case CLOSURE_TAG: {
+            u32 address;
+            copyValues(&address, object.header->contents);
+            if (auto name = functions.find(address); name != functions.end()) {
+                kind << "closure " << name->second;
+            } else {
+                kind << "closure 0x" << std::hex << address;
+            }
+            break;
+        }
+        default: kind << "unknown"; break;
+        }
+
+        auto size  = objectSize(object);
+        auto& usage = byKind[kind.str()];
+        usage.count += 1;
+        usage.bytes += size;
+        byRoot[owner[i]].count += 1;
+        byRoot[owner[i]].bytes += size;
+        total.count += 1;
+        total.bytes += size;
+    }
+
+    std::vector<std::pair<std::string, Usage>> kinds(byKind.begin(), byKind.end());
+    std::sort(kinds.begin(), kinds.end(), [](auto& lhs, auto& rhs) { return lhs.second.bytes > rhs.second.bytes; });
+
+    out << "Heap census (" << reason << "): " << total.count << " live objects, " << total.bytes << " bytes of "
+        << objects.size() << " objects in heap\n";
+    out << std::left << std::setw(40) << "kind" << std::right << std::setw(12) << "count" << std::setw(14) << "bytes"
+        << '\n';
+    for (auto& [kind, usage] : kinds) {
+        out << std::left << std::setw(40) << kind << std::right << std::setw(12) << usage.count << std::setw(14)
+            << usage.bytes << '\n';
+    }
+
+    std::vector<usize> topRoots;
+    for (usize root = 0; root < roots.size(); ++root) {
+        if (byRoot[root].count) { topRoots.push_back(root); }
+    }
+    auto shown = std::min(TOP_ROOTS, topRoots.size());
+    std::partial_sort(topRoots.begin(), topRoots.begin() + static_cast<std::ptrdiff_t>(shown), topRoots.end(),
+                      [&](usize lhs, usize rhs) { return byRoot[lhs].bytes > byRoot[rhs].bytes; });
+
+    out << "Top retaining roots:\n";
+    for (usize i = 0; i < shown; ++i) {
+        auto root = topRoots[i];
+        // stack slots are counted from the bottom, it's stable while the frame is alive
+        std::stringstream name;
+        if (root < globals.size()) {
+            name << "global " << root;
+        } else {
+            name << "stack " << root - globals.size();
+        }
+        out << std::left << std::setw(40) << name.str() << std::right << std::setw(12) << byRoot[root].count
+            << std::setw(14) << byRoot[root].bytes << '\n';
+    }
+    out.flush();
+}
@@ -0,0 +1,35 @@
+/**
+ * @file HeapCensus.hpp
+ * @brief This file contains heap census: live objects grouped by their kind,
+ * constructor or closure code, and the roots that keep the most of them alive
+ *
+ */
+#pragma once
+
+#include "Interpreter.hpp"
+#include "Types.hpp"
+
+#include <ostream>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+
+class HeapCensus {
+public:
+    /**
+     * @brief Collects names of constructors (by tag hash) and public functions
+     * (by address) to print objects in a human way
+     */
+    explicit HeapCensus(Bytefile& bytefile);
+
+    /**
+     * @brief Marks everything that is reachable from the roots and prints the census.
+     * Objects are attributed to the first root that reaches them, so the roots
+     * partition the live heap between each other
+     */
+    void report(std::ostream& out, std::string_view reason, std::span<usize> globals, std::span<usize> stack) const;
+
+private:
+    std::unordered_map<i32, std::string_view> constructors;
+    std::unordered_map<u32, std::string_view> functions;
+};
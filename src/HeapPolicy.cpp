@@ -0,0 +1,61 @@
+#include "HeapPolicy.hpp"
+
+#include "GcHooks.hpp"
+#include "LamaRuntime.hpp"
+#include "Types.hpp"
+
+#include <algorithm>
+#include <bit>
+
+HeapPolicy::HeapPolicy(const HeapSizing& heapSizing) : sizing(heapSizing) {}
+
+void HeapPolicy::start() {
+    ensureHeap();
+    push_extra_root(reinterpret_cast<void**>(&ballast)); // NOLINT(*-reinterpret-cast)
+    gcCounters.notify = true;
+    // Pauses are measured only when somebody needs them
+    if (sizing.gcTarget) { gcCounters.timed = true; }
+
+    lastNanos = monotonicNanos();
+    resizeBallast(sizing.minBytes / 2);
+    collections = gcCounters.collections;
+}
+
+auto HeapPolicy::adjust() -> bool {
+    if (collections == gcCounters.collections) { return true; }
+    collections = gcCounters.collections;
+    if (sizing.maxBytes && gcCounters.heapBytes > *sizing.maxBytes) { return false; }
+
+    if (sizing.gcTarget) {
+        u64  now   = monotonicNanos();
+        auto share = static_cast<double>(gcCounters.pauseNanos - lastPause) / static_cast<double>(now - lastNanos + 1);
+        if (share > *sizing.gcTarget) {
+            boost *= BOOST_STEP;
+        } else if (share < *sizing.gcTarget / 2) {
+            boost = std::max(1.0, boost / BOOST_STEP);
+        }
+        lastNanos = now;
+        lastPause = gcCounters.pauseNanos;
+    }
+
+    // The heap is twice the live data with the ballast, that's all we know of the live data
+    auto live   = gcCounters.heapBytes / 2 - std::min(gcCounters.heapBytes / 2, ballastBytes);
+    auto wanted = std::max(static_cast<double>(sizing.minBytes), sizing.growth * boost * static_cast<double>(live));
+    if (sizing.maxBytes) { wanted = std::min(wanted, static_cast<double>(*sizing.maxBytes)); }
+    auto bytes = static_cast<usize>(wanted / 2) - std::min(static_cast<usize>(wanted / 2), live);
+
+    // Every new ballast is an allocation and a copy in each compaction, so small changes are ignored
+    auto change = bytes > ballastBytes ? bytes - ballastBytes : ballastBytes - bytes;
+    if (change > std::max(ballastBytes / 2, MIN_RESIZE)) { resizeBallast(bytes); }
+    return true;
+}
+
+void HeapPolicy::resizeBallast(usize bytes) {
+    bytes        = std::min(bytes, MAX_BALLAST);
+    ballastBytes = bytes;
+    // The old ballast is garbage before the new one is allocated, so a collection
+    // in this allocation frees it and the heap does not hold both
+    ballast = 1;
+    if (bytes == 0) { return; }
+    ballast = std::bit_cast<usize>(gcAware([&] { return LmakeString(BOX(static_cast<i32>(bytes))); }));
+}
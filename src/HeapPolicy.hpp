@@ -0,0 +1,64 @@
+/**
+ * @file HeapPolicy.hpp
+ * @brief This file contains heap sizing on top of the Lama collector. `gc.c`
+ * has no knobs: after every collection the heap is twice the live data. The only
+ * thing the interpreter can change is the live data itself, so the policy keeps
+ * a ballast -- a string that is never read, held by an extra root. The heap stays
+ * twice the live data and the ballast, i.e. as big as the policy wants it
+ *
+ */
+#pragma once
+
+#include "Types.hpp"
+
+#include <optional>
+
+/**
+ * @brief Biggest `minBytes`, the ballast is a single string and a string header
+ * could describe up to 2^29 bytes
+ */
+constexpr usize MAX_HEAP_MIN = usize {1} << 29;
+
+/**
+ * @brief Sizes in bytes, they are all optional and come from the options
+ */
+struct HeapSizing {
+    usize                 minBytes = 0;   // heap after a collection is never smaller
+    std::optional<usize>  maxBytes;       // the program is stopped when the heap outgrows it
+    double                growth   = 2.0; // heap size to live data after a collection, `gc.c` does 2
+    std::optional<double> gcTarget;       // share of time in collections that makes the heap grow further
+};
+
+class HeapPolicy {
+public:
+    explicit HeapPolicy(const HeapSizing& heapSizing);
+
+    /**
+     * @brief Sets up the heap and the initial ballast, and asks the `mremap`
+     * wrapper to call in on every collection
+     */
+    void start();
+
+    /**
+     * @brief Resizes the ballast for the live data of the last collection. Is
+     * called from safepoints, so every value of the program is in a root
+     *
+     * @return false if the heap is over `maxBytes`
+     */
+    auto adjust() -> bool;
+
+private:
+    static constexpr usize  MAX_BALLAST = MAX_HEAP_MIN / 2; // the heap is twice the live data with the ballast
+    static constexpr usize  MIN_RESIZE  = usize {1} << 20;  // smaller changes of the ballast are not worth a copy
+    static constexpr double BOOST_STEP  = 1.5;              // adaptive growth is changed by this factor
+
+    void resizeBallast(usize bytes);
+
+    HeapSizing sizing;
+    usize      ballast      = 1; // boxed zero is not a pointer, so the collector skips it
+    usize      ballastBytes = 0;
+    u32        collections  = 0; // `gcCounters.collections` seen by the last `adjust`
+    double     boost        = 1.0;
+    u64        lastNanos    = 0;
+    u64        lastPause    = 0;
+};
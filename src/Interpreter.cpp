@@ -1,6 +1,15 @@
 #include "Interpreter.hpp"
 
+#include "Analysis.hpp"
+#include "GcHooks.hpp"
+#include "HeapCensus.hpp"
+#include "HeapPolicy.hpp"
+#include "Lz4.hpp"
+#include "Limits.hpp"
 #include "Opcodes.hpp"
+#include "Output.hpp"
+#include "Probes.hpp"
+#include "ProgramIo.hpp"
 #include "Types.hpp"
 #include "Utils.hpp"
 
@@ -9,8 +18,6 @@
 #include <cassert>
 #include <cerrno>
 #include <cstring>
-#include <fstream>
-#include <ios>
 #include <iostream>
 #include <memory>
 #include <new>
@@ -20,6 +27,9 @@
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 extern "C" {
 #include "LamaRuntime.hpp"
@@ -30,90 +40,110 @@ extern "C" {
 constexpr std::string_view NOT_ENOUGH_POP  = "Cannot allocate enough memory on stack: underflow";
 constexpr std::string_view NOT_ENOUGH_PUSH = "Cannot allocate enough memory on stack: overflow";
 
-// bytecode header looks like this
-// ┌────────────┬────────────┬───────────┬────────────────┬─────────────┬────────────────┐
-// │            │            │           │                │             │                │
-// │strPool size│globals size│pubSym size│ public Symbols │ string pool │ bytecode       │
-// │    (bytes) │   (words)  │           │                │             │                │
-// └────────────┴────────────┴───────────┴────────────────┴─────────────┴────────────────┘
-//   4 bytes      4 bytes      4 bytes     pubSym * 2     strPool size   rest of the file
-//                                         * sizeof(i32)
-//                                              ???
-
 auto Bytefile::readBytefile(const char* filename) -> std::variant<DiagnosticsBag, Bytefile> {
-    std::ifstream  file(filename, std::ios::binary | std::ios::ate);
+    // Plain syscalls, a stream would cost more than the whole run of a small program
+    int file = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (file < 0) { throw std::runtime_error("Error opening file: " + std::string(std::strerror(errno))); }
+
+    struct stat status {};
+    if (::fstat(file, &status) < 0) {
+        auto error = errno;
+        ::close(file);
+        throw std::runtime_error("Error determining file size: " + std::string(std::strerror(error)));
+    }
+    auto fileSize = static_cast<usize>(status.st_size);
+
+    // Words keep public symbols of v1 and everything of v2 aligned
+    std::vector<u32> content((fileSize + sizeof(u32) - 1) / sizeof(u32));
+    auto*            destination = reinterpret_cast<char*>(content.data()); // NOLINT
+    for (usize done = 0; done < fileSize;) {
+        auto result = ::read(file, destination + done, fileSize - done);
+        if (result < 0 && errno == EINTR) { continue; }
+        if (result <= 0) {
+            auto error = result == 0 ? EIO : errno;
+            ::close(file);
+            throw std::runtime_error("Error reading file: " + std::string(std::strerror(error)));
+        }
+        done += static_cast<usize>(result);
+    }
+    ::close(file);
+
+    std::span<const u8> bytes {reinterpret_cast<const u8*>(content.data()), fileSize}; // NOLINT
+    if (isBytecodeV2(bytes)) { return fromImage(std::move(content)); }
+    if (isCompressedContainer(bytes)) { return fromContainer(std::move(content), bytes.size()); }
+
+    auto possibleV1 = parseBytecodeV1(bytes);
+    if (std::holds_alternative<DiagnosticsBag>(possibleV1)) { return std::get<DiagnosticsBag>(std::move(possibleV1)); }
+
+    auto possibleImage = convertToV2(std::get<BytefileV1>(possibleV1));
+    if (std::holds_alternative<DiagnosticsBag>(possibleImage)) {
+        return std::get<DiagnosticsBag>(std::move(possibleImage));
+    }
+    return fromImage(std::get<std::vector<u32>>(std::move(possibleImage)));
+}
+
+auto Bytefile::fromImage(std::vector<u32> image, bool lazy) -> std::variant<DiagnosticsBag, Bytefile> {
     DiagnosticsBag readErrors;
 
-    if (!file) { throw std::runtime_error("Error opening file: " + std::string(std::strerror(errno))); }
-    // will throw an exception if cannot read
-    file.exceptions(std::ios_base::badbit | std::ios_base::failbit);
+    BytecodeHeaderV2 header;
+    if (image.size() * sizeof(u32) < sizeof(header)) { return DiagnosticsBag {"v2 header is truncated"}; }
+    copyValues(&header, image.data());
+    if (header.version != BYTECODE_V2_VERSION) {
+        return DiagnosticsBag {"unsupported bytecode version " + std::to_string(header.version)};
+    }
 
-    auto fileSize = static_cast<std::streamoff>(file.tellg());
-    if (fileSize < 0) { throw std::runtime_error("Error determining file size: " + std::string(std::strerror(errno))); }
-    file.seekg(0, std::ios::beg);
+    // Sizes are counted in 64-bit words, so nothing here could overflow on a 32-bit host
+    auto sections = sectionsOf(header);
+    if (sections.end > image.size() || header.codeSize == 0 || header.codeSize % sizeof(u32) != 0) {
+        std::stringstream ss;
+        ss << "tables and code take " << sections.end * sizeof(u32) << " bytes, while the whole file size is "
+           << image.size() * sizeof(u32) << " bytes";
+        return DiagnosticsBag {ss.str()};
+    }
 
     Bytefile result;
-    auto*    ptr         = operator new(static_cast<usize>(fileSize), std::align_val_t(alignof(i32)));
-    auto     deleter     = [](auto p) { operator delete(p); };
-    auto     raiiDeleter = std::unique_ptr<char, decltype(deleter)>(static_cast<char*>(ptr), deleter);
-
-    // exception will be thrown, if file open fails
-    file.read(static_cast<char*>(ptr), static_cast<std::streamsize>(fileSize));
-
-    u8* u8ptr = static_cast<u8*>(ptr);
-    u32 strPoolSize;
-    u32 globalAreaSize;
-    u32 publicSymbolsNumber;
-    copyValues(&strPoolSize, u8ptr);
-    copyValues(&globalAreaSize, u8ptr + sizeof(i32));
-    copyValues(&publicSymbolsNumber, u8ptr + 2 * sizeof(i32));
-    u32 headerSize = 3 * sizeof(i32);
-    {
-        // NOTE(zelourses): there could be a problem, if we are not aligned to the int
-        // That's why to decrease these chances we allocate with alignment of `i32`
-        if (publicSymbolsNumber * 2 + headerSize >= fileSize) {
+    u32*     base        = image.data();
+    result.publicSymbols = {base + sections.publicSymbols, static_cast<usize>(header.publicSymbolsNumber) * 2};
+    // NOLINTBEGIN(*-reinterpret-cast): tables are arrays of plain words
+    result.functions = {reinterpret_cast<FunctionEntry*>(base + sections.functions), header.functionsNumber};
+    result.tags      = {reinterpret_cast<TagEntry*>(base + sections.tags), header.tagsNumber};
+    result.strPool   = {reinterpret_cast<u8*>(base + sections.strPool), header.strPoolSize};
+    result.bytecode  = {reinterpret_cast<u8*>(base + sections.code), header.codeSize};
+    // NOLINTEND(*-reinterpret-cast)
+    result.globalAreaSize = header.globalAreaSize;
+
+    u32 previousEnd = 0;
+    for (auto& function : result.functions) {
+        auto opcode = function.entry < header.codeSize ? result.bytecode[function.entry] : 0;
+        if (function.entry % sizeof(u32) != 0 || function.end % sizeof(u32) != 0
+            || (opcode != to_underlying(Opcodes::BEGIN) && opcode != to_underlying(Opcodes::CBEGIN)
+                && opcode != to_underlying(Opcodes::LAZY))
+            || function.end < function.entry || function.end > header.codeSize) {
             std::stringstream ss;
-            ss << "public symbols size is " << publicSymbolsNumber * 2 << " bytes, while file size is " << fileSize
-               << " bytes";
+            ss << "function table entry at 0x" << std::hex << function.entry << " does not point to (C)BEGIN";
             readErrors.emplace_back(ss.str());
-        } else {
-            u32* publicSymbols = reinterpret_cast<u32*>(u8ptr + headerSize);
-            assert(reinterpret_cast<uintptr_t>(publicSymbols) % 4 == 0);
-            result.publicSymbols = std::span<u32> {publicSymbols, static_cast<usize>(publicSymbolsNumber) * 2};
         }
-    }
-    {
-        if (strPoolSize + publicSymbolsNumber * 2 + headerSize >= fileSize) {
+        // Callees are looked up in the table by address
+        if (function.entry < previousEnd) {
             std::stringstream ss;
-            ss << "string pool size is " << strPoolSize << " bytes, while remaining file size is "
-               << (fileSize - (publicSymbolsNumber * 2) - headerSize) << " bytes";
+            ss << "function at 0x" << std::hex << function.entry << " overlaps the previous one";
             readErrors.emplace_back(ss.str());
-        } else {
-            u8* strPool    = u8ptr + headerSize + publicSymbolsNumber * 2 * sizeof(i32);
-            result.strPool = std::span<u8> {strPool, static_cast<usize>(strPoolSize)};
         }
+        previousEnd = std::max(previousEnd, function.end);
     }
-    { result.globalAreaSize = globalAreaSize; }
-    {
-        auto bytecodeSize = static_cast<usize>(fileSize - result.publicSymbols.size() * sizeof(i32)
-                                               - result.strPool.size() - headerSize);
-        if (bytecodeSize == 0 || bytecodeSize >= fileSize) { // if we overflow
-            std::stringstream ss;
-            ss << " bytecode size is " << bytecodeSize << "bytes, while the whole file size is" << fileSize << " bytes";
-            readErrors.emplace_back(ss.str());
-        } else {
-            u8* bytecode    = u8ptr + headerSize + result.publicSymbols.size() * sizeof(i32) + result.strPool.size();
-            result.bytecode = std::span<u8>(bytecode, bytecodeSize);
+    for (auto& tag : result.tags) {
+        if (tag.name >= header.strPoolSize) {
+            readErrors.emplace_back("tag name " + std::to_string(tag.name) + " is outside of the string pool");
         }
     }
 
-    if (readErrors.empty()) {
-        // Essential, otherwise we will get double free
-        raiiDeleter.release();
-
-        result.rawData.reset(static_cast<u8*>(ptr));
+    // Handlers trust what is checked here, e.g. alignment of operands and targets
+    if (readErrors.empty()) { readErrors = verifyCode(result.bytecode, result.functions, lazy); }
 
-        result.ip = result.bytecode.data();
+    if (readErrors.empty()) {
+        // Moving a vector keeps its buffer, so spans stay valid
+        result.image = std::move(image);
+        result.ip    = result.bytecode.data();
 
         return result;
     }
@@ -121,6 +151,83 @@ auto Bytefile::readBytefile(const char* filename) -> std::variant<DiagnosticsBag
     return readErrors;
 }
 
+auto Bytefile::fromContainer(std::vector<u32> content, usize size) -> std::variant<DiagnosticsBag, Bytefile> {
+    std::span<const u8> bytes {reinterpret_cast<const u8*>(content.data()), size}; // NOLINT(*-reinterpret-cast)
+
+    auto possibleMetadata = inflateMetadata(bytes);
+    if (std::holds_alternative<DiagnosticsBag>(possibleMetadata)) {
+        return std::get<DiagnosticsBag>(std::move(possibleMetadata));
+    }
+    auto [image, frames] = std::get<1>(std::move(possibleMetadata));
+
+    auto possibleBytefile = fromImage(std::move(image), true);
+    if (std::holds_alternative<DiagnosticsBag>(possibleBytefile)) { return possibleBytefile; }
+
+    auto& result = std::get<Bytefile>(possibleBytefile);
+    // Frames point into the content, moving a vector keeps its buffer
+    result.container = std::move(content);
+    result.frames    = frames;
+    return possibleBytefile;
+}
+
+auto Bytefile::inflate(u32 address) -> bool {
+    if (address % sizeof(u32) != 0 || bytecode.size() - address < 3 * sizeof(u32)
+        || bytecode[address] != to_underlying(Opcodes::LAZY)) {
+        return true;
+    }
+
+    u32 frameIndex;
+    u32 length;
+    copyValues(&frameIndex, bytecode.data() + address + sizeof(u32));
+    copyValues(&length, bytecode.data() + address + 2 * sizeof(u32));
+    if (frameIndex >= frames.size() || frames[frameIndex].rawSize != length || bytecode.size() - address < length
+        || !lz4CouldInflate(frames[frameIndex].size, length)) {
+        std::cerr << "Cannot decompress function at 0x" << std::hex << address << " -- no frame " << std::dec
+                  << frameIndex << " of " << length << " bytes\n";
+        return false;
+    }
+
+    // The i-th frame is the i-th function, see `compressImage`
+    if (frameIndex >= functions.size() || functions[frameIndex].entry != address
+        || functions[frameIndex].end - address != length) {
+        std::cerr << "Cannot decompress function at 0x" << std::hex << address << " -- frame " << std::dec
+                  << frameIndex << " is of another function\n";
+        return false;
+    }
+
+    auto& frame = frames[frameIndex];
+    // NOLINTNEXTLINE(*-reinterpret-cast)
+    std::span<const u8> compressed {reinterpret_cast<const u8*>(container.data()) + frame.offset, frame.size};
+    if (lz4Decompress(compressed, bytecode.subspan(address, length)) != length) {
+        std::cerr << "Cannot decompress function at 0x" << std::hex << address << " -- frame " << std::dec
+                  << frameIndex << " is broken\n";
+        return false;
+    }
+    // Only the metadata has been checked on load
+    auto errors = verifyFunction(bytecode, functions[frameIndex], functions);
+    for (auto& e : errors) {
+        std::cerr << "Cannot decompress function at 0x" << std::hex << address << " -- " << e << '\n';
+    }
+    return errors.empty();
+}
+
+auto Bytefile::isFunction(u32 address) const noexcept -> bool {
+    auto function = std::ranges::lower_bound(functions, address, {}, &FunctionEntry::entry);
+    return function != functions.end() && function->entry == address;
+}
+
+auto Bytefile::inflateAll() -> DiagnosticsBag {
+    DiagnosticsBag errors;
+    for (auto& function : functions) {
+        if (!inflate(function.entry)) {
+            std::stringstream ss;
+            ss << "cannot decompress function at 0x" << std::hex << function.entry;
+            errors.emplace_back(ss.str());
+        }
+    }
+    return errors;
+}
+
 auto Bytefile::getString(usize position) -> std::optional<std::string_view> {
     if (position >= strPool.size()) { return std::nullopt; }
     // SAFETY: cast from unsigned char to signed char pointer
@@ -132,14 +239,14 @@ auto Bytefile::getString(usize position) -> std::optional<std::string_view> {
 
 auto Bytefile::getNextInt() noexcept -> i32 {
     i32 result;
-    copyValues(&result, ip);
+    copyValues(&result, std::assume_aligned<sizeof(i32)>(ip));
     ip += sizeof(i32);
     return result;
 }
 
 auto Bytefile::getNextUnsigned() noexcept -> u32 {
     u32 result;
-    copyValues(&result, ip);
+    copyValues(&result, std::assume_aligned<sizeof(u32)>(ip));
     ip += sizeof(u32);
     return result;
 }
@@ -151,9 +258,17 @@ auto Bytefile::getNextString() -> std::optional<std::string_view> {
     return getString(index);
 }
 
+auto Bytefile::getNextTagHash() -> std::optional<i32> {
+    if (!enoughBytes(sizeof(u32))) { return std::nullopt; }
+    auto index = getNextUnsigned();
+
+    if (index >= tags.size()) { return std::nullopt; }
+    return tags[index].hash;
+}
+
 auto Bytefile::closureArray(u32 n) -> std::span<ClosureArg> {
     auto* args = std::bit_cast<ClosureArg*>(ip);
-    ip += (sizeof(i8) + sizeof(u32)) * n;
+    ip += sizeof(ClosureArg) * n;
     return {args, static_cast<u32>(n)};
 }
 
@@ -174,7 +289,8 @@ auto Bytefile::enoughBytes(usize bytes) noexcept -> bool {
     return bytecode.size() - static_cast<usize>((ip - bytecode.begin().base())) >= bytes;
 }
 
-Interpreter::Interpreter(u32 globalsSize) : stack(globalsSize) { __init(); }
+// The heap is set up by `gcAware` on the first allocation, a program that allocates nothing never pays for it
+Interpreter::Interpreter(u32 globalsSize) : stack(globalsSize) {}
 
 Stack::Stack(u32 globalsSizeWords) : globalsSize(globalsSizeWords) {
     __gc_stack_bottom = innerData.data() + innerData.size() - 1;
@@ -189,7 +305,10 @@ Stack::Stack(u32 globalsSizeWords) : globalsSize(globalsSizeWords) {
 
 auto Bytefile::getNextCode() noexcept -> u8 {
     prevIP = ip;
-    return *ip++;
+    // the rest of the opcode word is reserved
+    u8 code = *ip;
+    ip += sizeof(u32);
+    return code;
 }
 
 auto Bytefile::peekNextCode() noexcept -> u8 { return *ip; }
@@ -230,9 +349,16 @@ auto Stack::getReference(u32 index, VariableType kind) -> std::optional<usize*>
 
 auto Stack::stackBegin() -> usize* { return begin; }
 
-auto Stack::prologue([[maybe_unused]] bool beginInClosure, u32 newNArgs, u32 newNLocals) -> bool {
+auto Stack::depth() const noexcept -> usize { return static_cast<usize>(begin - __gc_stack_top); }
+
+auto Stack::globals() noexcept -> std::span<usize> { return {begin + 1, globalsSize}; }
+
+auto Stack::values() noexcept -> std::span<usize> { return {__gc_stack_top + 1, depth()}; }
+
+auto Stack::prologue([[maybe_unused]] bool beginInClosure, u32 newNArgs, u32 newNLocals, u32 address) -> bool {
     // std::cerr << "prologue " << beginInClosure << ", " << newNArgs << ", " << newNLocals << std::endl;
     if (!enoughToPush(satAdd(4, newNLocals))) { return false; }
+    LAMA_PROBE3(function__entry, address, newNArgs, newNLocals);
 
     // NOLINTNEXTLINE(*-sign-conversion)
     push(BOX(nArgs));               // 1
@@ -248,9 +374,10 @@ auto Stack::prologue([[maybe_unused]] bool beginInClosure, u32 newNArgs, u32 new
     return true;
 }
 
-auto Stack::epilogue(bool isClosure) -> u8* {
+auto Stack::epilogue(bool isClosure, u32 address) -> u8* {
     u32 valuesToPop = 5 + (isClosure ? 1 : 0);
     if (!enoughToPop(satAdd(valuesToPop, nArgs))) { return nullptr; }
+    LAMA_PROBE1(function__return, address);
 
     // NOTE(zelourses): we save boxing here
     auto retval    = pop(); // 1
@@ -293,8 +420,8 @@ auto Stack::enoughToPush(usize n) noexcept -> bool {
         return InterpretResult::ERROR; \
     }
 
-auto Interpreter::onBegin(bool beginInClosure, u32 nArgs, u32 nLocals) -> InterpretResult {
-    if (!stack.prologue(beginInClosure, nArgs, nLocals)) {
+auto Interpreter::onBegin(bool beginInClosure, u32 nArgs, u32 nLocals, u32 address) -> InterpretResult {
+    if (!stack.prologue(beginInClosure, nArgs, nLocals, address)) {
         std::cerr << NOT_ENOUGH_PUSH;
         return InterpretResult::ERROR;
     }
@@ -303,7 +430,19 @@ auto Interpreter::onBegin(bool beginInClosure, u32 nArgs, u32 nLocals) -> Interp
 
 auto Interpreter::onCallLRead() -> InterpretResult {
     checkStackPush;
-    stack.push(std::bit_cast<u32>(Lread()));
+    // The prompt of `Lread` goes through stdio, everything printed before it must be out already
+    programOutput.flush();
+    if (!io) {
+        stack.push(std::bit_cast<u32>(Lread()));
+        return InterpretResult::CONTINUE;
+    }
+
+    auto value = io->read();
+    if (!value.has_value()) {
+        std::cerr << "Recorded input is over";
+        return InterpretResult::ERROR;
+    }
+    stack.push(BOX(value.value()));
     return InterpretResult::CONTINUE;
 }
 
@@ -385,6 +524,43 @@ auto Interpreter::onBinOp(BinOp operation) -> InterpretResult {
     return InterpretResult::CONTINUE;
 }
 
+auto Interpreter::onBinOpInt(BinOp operation) -> bool {
+    if (!stack.enoughToPop(2)) { return false; }
+    auto values = stack.values();
+    if (!UNBOXED(values[0]) || !UNBOXED(values[1])) { return false; }
+
+    i32 rhs = UNBOX(values[0]);
+    i32 lhs = UNBOX(values[1]);
+    i32 result;
+    switch (operation) {
+    case BinOp::ADD: result = lhs + rhs; break;
+    case BinOp::SUB: result = lhs - rhs; break;
+    case BinOp::MUL: result = lhs * rhs; break;
+    case BinOp::DIV:
+        if (rhs == 0) { return false; }
+        result = lhs / rhs;
+        break;
+    case BinOp::REM:
+        if (rhs == 0) { return false; }
+        result = lhs % rhs;
+        break;
+    case BinOp::LT: result = lhs < rhs; break;
+    case BinOp::LE: result = lhs <= rhs; break;
+    case BinOp::GT: result = lhs > rhs; break;
+    case BinOp::GE: result = lhs >= rhs; break;
+    case BinOp::EQ: result = lhs == rhs; break;
+    case BinOp::NE: result = lhs != rhs; break;
+    case BinOp::AND: result = lhs && rhs; break;
+    case BinOp::OR: result = lhs || rhs; break;
+    default: return false;
+    }
+    // The result takes the place of the left operand
+    stack.pop();
+    // NOLINTNEXTLINE(*-sign-conversion)
+    values[1] = BOX(result);
+    return true;
+}
+
 auto Interpreter::onConst(i32 value) -> InterpretResult {
     checkStackPush;
     // NOLINTNEXTLINE(*-sign-conversion)
@@ -397,14 +573,18 @@ auto Interpreter::onCallLWrite() -> InterpretResult {
 
     i32 val = UNBOX(stack.pop());
     // Is this an appropriate place to print?
-    std::cout << val << '\n';
+    if (io) {
+        io->write(val);
+    } else {
+        programOutput.number(val);
+    }
     stack.push(BOX(0)); // otherwise it will not work
     return InterpretResult::CONTINUE;
 }
 
-auto Interpreter::onEndOrRet() -> u8* {
+auto Interpreter::onEndOrRet(u32 address) -> u8* {
     u8* result = nullptr;
-    if (stack.bp != stack.stackBegin() - 1) { result = stack.epilogue(isClosure); }
+    if (stack.bp != stack.stackBegin() - 1) { result = stack.epilogue(isClosure, address); }
     isClosure = false;
     return result;
 }
@@ -443,7 +623,8 @@ auto Interpreter::onCall(u32 location, [[maybe_unused]] u32 nArgs, u8* originalI
 auto Interpreter::onString(std::string_view str) -> InterpretResult {
     checkStackPush;
 
-    void* objString = Bstring(const_cast<char*>(str.begin()));
+    LAMA_PROBE1(alloc__string, str.size());
+    void* objString = gcAware([&] { return Bstring(const_cast<char*>(str.begin())); });
 
     auto value = std::bit_cast<usize>(objString);
     stack.push(value);
@@ -451,6 +632,17 @@ auto Interpreter::onString(std::string_view str) -> InterpretResult {
     return InterpretResult::CONTINUE;
 }
 
+auto Interpreter::onStringOfLength(const char* text, u32 length) -> InterpretResult {
+    checkStackPush;
+
+    LAMA_PROBE1(alloc__string, length);
+    void* objString = gcAware([&] { return LmakeString(BOX(static_cast<i32>(length))); });
+    std::memcpy(objString, text, length + 1);
+    stack.push(std::bit_cast<usize>(objString));
+
+    return InterpretResult::CONTINUE;
+}
+
 auto Interpreter::onCallLLength() -> InterpretResult {
     checkStackPop;
 
@@ -479,6 +671,25 @@ auto Interpreter::onElem() -> InterpretResult {
     return InterpretResult::CONTINUE;
 }
 
+auto Interpreter::onElemArray() -> bool {
+    if (!stack.enoughToPop(2)) { return false; }
+    auto index  = stack.pop();
+    auto target = stack.pop();
+    if (UNBOXED(index) && !UNBOXED(target)) {
+        auto* array  = TO_DATA(std::bit_cast<void*>(target));
+        auto  header = static_cast<u32>(array->data_header);
+        if (TAG(header) == ARRAY_TAG && static_cast<u32>(UNBOX(index)) < LEN(header)) {
+            u32 element;
+            std::memcpy(&element, array->contents + static_cast<usize>(UNBOX(index)) * sizeof(u32), sizeof(u32));
+            stack.push(element);
+            return true;
+        }
+    }
+    stack.push(target);
+    stack.push(index);
+    return false;
+}
+
 auto Interpreter::onSTA() -> InterpretResult {
     if (!stack.enoughToPop(3)) {
         std::cerr << NOT_ENOUGH_POP;
@@ -499,7 +710,8 @@ auto Interpreter::onCallBArray(u32 n) -> InterpretResult {
         return InterpretResult::ERROR;
     }
 
-    data* bArray = static_cast<data*>(alloc_array(n));
+    LAMA_PROBE1(alloc__array, n);
+    data* bArray = static_cast<data*>(gcAware([&] { return alloc_array(n); }));
 
     for (; n > 0; --n) {
         auto elem = stack.pop();
@@ -513,13 +725,17 @@ auto Interpreter::onCallBArray(u32 n) -> InterpretResult {
     return InterpretResult::CONTINUE;
 }
 
-auto Interpreter::onSexp(std::string_view tag, u32 n) -> InterpretResult {
+auto Interpreter::onSexp(i32 tagHash, u32 n) -> InterpretResult {
     if (!stack.enoughToPop(n)) {
         std::cerr << NOT_ENOUGH_POP;
         return InterpretResult::ERROR;
     }
 
-    sexp* sExpArray = static_cast<sexp*>(alloc_sexp(n));
+    // Tag table keeps the boxed hash, as `LtagHash` returns it
+    auto tag = UNBOX(tagHash);
+    LAMA_PROBE2(alloc__sexp, tag, n);
+
+    sexp* sExpArray = static_cast<sexp*>(gcAware([&] { return alloc_sexp(n); }));
     sExpArray->tag  = 0;
 
     // Do I need to do n -= 1?
@@ -527,12 +743,7 @@ auto Interpreter::onSexp(std::string_view tag, u32 n) -> InterpretResult {
         auto value                         = stack.pop();
         ((i32*)sExpArray->contents)[n - 1] = value;
     }
-    // SAFETY: this call is safe because the value is actually does not changing
-    // (As far as I can see from source code of lama)
-    //
-    // Also, code inside [`LtagHash`] actually do not use this data, it's just
-    // someone forgot to put `const`
-    sExpArray->tag = UNBOX(LtagHash(const_cast<char*>(tag.data())));
+    sExpArray->tag = tag;
     stack.push(std::bit_cast<usize>(&(sExpArray->tag)));
 
     return InterpretResult::CONTINUE;
@@ -546,26 +757,37 @@ auto Interpreter::onDuplicate() -> InterpretResult {
     return InterpretResult::CONTINUE;
 }
 
-auto Interpreter::onTag(std::string_view name, u32 n) -> InterpretResult {
+auto Interpreter::onTag(i32 tagHash, u32 n) -> InterpretResult {
     checkStackPop;
 
-    // SAFETY: this call is safe because the value is actually does not changing
-    // (As far as I can see from source code of lama)
-    //
-    // Also, code inside [`LtagHash`] actually do not use this data, it's just
-    // someone forgot to put `const`
-    auto hash  = LtagHash(const_cast<char*>(name.data()));
     auto boxed = BOX(n);
 
-    auto value = std::bit_cast<u32>(Btag(std::bit_cast<void*>(stack.pop()), hash, boxed));
+    auto value = std::bit_cast<u32>(Btag(std::bit_cast<void*>(stack.pop()), tagHash, boxed));
     stack.push(value);
 
     return InterpretResult::CONTINUE;
 }
 
+auto Interpreter::onTagUnboxed(u32 tag, u32 n) -> InterpretResult {
+    checkStackPop;
+
+    // Same as `Btag`, without boxing the operands for the call
+    auto value   = stack.pop();
+    bool matches = false;
+    if (!UNBOXED(value)) {
+        auto* header = TO_DATA(std::bit_cast<void*>(value));
+        auto  word   = static_cast<u32>(header->data_header);
+        matches      = TAG(word) == SEXP_TAG && LEN(word) == n
+                && static_cast<u32>(reinterpret_cast<sexp*>(header)->tag) == tag; // NOLINT(*-reinterpret-cast)
+    }
+    stack.push(BOX(static_cast<i32>(matches)));
+
+    return InterpretResult::CONTINUE;
+}
+
 auto Interpreter::onCallLString() -> InterpretResult {
     checkStackPop;
-    auto* str = Lstring(std::bit_cast<void*>(stack.pop()));
+    auto* str = gcAware([&] { return Lstring(std::bit_cast<void*>(stack.pop())); });
     stack.push(std::bit_cast<u32>(str));
 
     return InterpretResult::CONTINUE;
@@ -591,7 +813,9 @@ auto Interpreter::onLoadAccumulator(u32 index, VariableType toLoad) -> Interpret
 auto Interpreter::onClosure(u32 address, std::span<Bytefile::ClosureArg> args) -> InterpretResult {
     checkStackPush;
 
-    data* closure = static_cast<data*>(alloc_closure(args.size() + 1)); // + address
+    LAMA_PROBE2(alloc__closure, address, args.size());
+    // + address
+    data* closure = static_cast<data*>(gcAware([&] { return alloc_closure(args.size() + 1); }));
     if (!closure) {
         std::cerr << "Cannot allocate memory for closure";
         return InterpretResult::CONTINUE;
@@ -602,11 +826,11 @@ auto Interpreter::onClosure(u32 address, std::span<Bytefile::ClosureArg> args) -
     ((u32*)closure->contents)[0] = address;
 
     u32 i = 1;
-    for (auto&& [type, index] : args) {
-        auto res = stack.getReference(index, type);
+    for (auto&& arg : args) {
+        auto res = stack.getReference(arg.argument, arg.type);
         if (!res.has_value()) {
-            std::cerr << "cannot create reference in closure for index" << index << " and value "
-                      << to_underlying(type);
+            std::cerr << "cannot create reference in closure for index" << arg.argument << " and value "
+                      << to_underlying(arg.type);
             return InterpretResult::ERROR;
         }
         // FIXME: it's very bad. We increase the alignment from 1 to 4 and I don't know how to deal with it
@@ -632,6 +856,14 @@ auto Interpreter::onCallClosure(u8* returnAddress, u32 nArgs) -> std::optional<u
     return addr;
 }
 
+auto Interpreter::closureCode(u32 nArgs) -> std::optional<usize> {
+    auto values = stack.values();
+    if (values.size() <= nArgs || UNBOXED(values[nArgs])) { return std::nullopt; }
+    auto header = static_cast<u32>(TO_DATA(std::bit_cast<void*>(values[nArgs]))->data_header);
+    if (TAG(header) != CLOSURE_TAG) { return std::nullopt; }
+    return stack.closureRelativeAddr(nArgs);
+}
+
 auto Interpreter::onPattern(PatternType pattern) -> InterpretResult {
     checkStackPop;
 
@@ -694,8 +926,50 @@ auto Interpreter::onFail() -> InterpretResult {
     } else {
         auto first  = stack.pop();
         auto second = stack.pop();
+        LAMA_PROBE2(fail, first, second);
         std::cerr << "Something went wrong: " << first << ", " << second;
     }
 
     return InterpretResult::ERROR;
 }
+
+auto Interpreter::onSafepoint() -> InterpretResult {
+    if (budget-- == 0) [[unlikely]] {
+        interrupt = InterruptReason::Budget;
+        return InterpretResult::INTERRUPTED;
+    }
+    if (interruptPending) [[unlikely]] {
+        interruptPending = 0;
+        if (timeoutExpired) {
+            interrupt = InterruptReason::Timeout;
+            return InterpretResult::INTERRUPTED;
+        }
+        if (policy && !policy->adjust()) {
+            interrupt = InterruptReason::HeapLimit;
+            return InterpretResult::INTERRUPTED;
+        }
+        if (censusRequested) {
+            censusRequested = 0;
+            reportHeap("SIGUSR1");
+        }
+    }
+    return InterpretResult::CONTINUE;
+}
+
+auto Interpreter::variable(u32 index, VariableType type) -> std::optional<usize> {
+    auto ref = stack.getReference(index, type);
+    if (!ref.has_value()) { return std::nullopt; }
+    if (type == VariableType::Captured) {
+        // Unlike the bytecode, the debugger may ask for anything, so the closure is checked
+        auto closure = std::bit_cast<usize>(ref.value() - index - 1);
+        if (UNBOXED(closure)) { return std::nullopt; }
+        auto header = static_cast<u32>(TO_DATA(std::bit_cast<void*>(closure))->data_header);
+        if (TAG(header) != CLOSURE_TAG || index + 1 >= LEN(header)) { return std::nullopt; }
+    }
+    return *ref.value();
+}
+
+void Interpreter::reportHeap(std::string_view reason) {
+    if (!census) { return; }
+    census->report(std::cerr, reason, stack.globals(), stack.values());
+}
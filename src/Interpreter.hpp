@@ -5,12 +5,14 @@
  *
  */
 #pragma once
+#include "BytecodeFormat.hpp"
 #include "Opcodes.hpp"
 #include "Types.hpp"
 #include "Utils.hpp"
 
 #include <array>
 #include <cassert>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <span>
@@ -18,27 +20,73 @@
 #include <variant>
 #include <vector>
 
-using DiagnosticsBag = std::vector<std::string>;
-
 /**
- * @brief Structure that represents Lama bytecode file
- * copied from `byterun.c` bytecode printer in Lama project
+ * @brief Structure that represents Lama bytecode file in v2 format, see
+ * `BytecodeFormat.hpp`. Originally copied from `byterun.c` bytecode printer
+ * in Lama project
  */
 struct Bytefile {
-    std::span<u8>  strPool;       // Strings table
-    std::span<u32> publicSymbols; // public symbols
-    std::span<u8>  bytecode;      // bytecode buffer
-    u32            globalAreaSize;
-    u8*            ip;
+    std::span<u8>            strPool;       // Strings table
+    std::span<u32>           publicSymbols; // public symbols
+    std::span<FunctionEntry> functions;     // sorted by entry address
+    std::span<TagEntry>      tags;          // operands of `SEXP` and `TAG` are indices here
+    std::span<u8>            bytecode;      // bytecode buffer
+    u32                      globalAreaSize;
+    u8*                      ip;
 
     u32 fileLine = 0;
 
     u8* prevIP = nullptr;
 
+    Bytefile() = default;
+    // Spans point into the owned buffers, so copies would dangle
+    Bytefile(const Bytefile&)                    = delete;
+    auto operator=(const Bytefile&) -> Bytefile& = delete;
+    Bytefile(Bytefile&&)                         = default;
+    auto operator=(Bytefile&&) -> Bytefile&      = default;
+    ~Bytefile()                                  = default;
+
+    /**
+     * @brief Reads v2 file as is, v1 file is converted to v2 first
+     */
     static auto readBytefile(const char* filename) -> std::variant<DiagnosticsBag, Bytefile>;
+    /**
+     * @brief Takes v2 image and checks that its tables are consistent with it
+     * and that the code is safe to execute, see `verifyCode`
+     *
+     * @param lazy whether functions could be `LAZY`, i.e. the image is the metadata of a container
+     */
+    static auto fromImage(std::vector<u32> image, bool lazy = false) -> std::variant<DiagnosticsBag, Bytefile>;
+    /**
+     * @brief Decompresses metadata of the container, functions stay `LAZY` till `inflate`
+     */
+    static auto fromContainer(std::vector<u32> content, usize size) -> std::variant<DiagnosticsBag, Bytefile>;
+
+    /**
+     * @brief Decompresses the function at `address` in place if it is `LAZY`,
+     * does nothing otherwise
+     *
+     * @return false if the function could not be decompressed, the reason is printed
+     */
+    auto inflate(u32 address) -> bool;
+    /**
+     * @brief Whether a function of the table starts at `address`. The loader has
+     * checked that it is a (C)BEGIN, and unlike the code the table is not patched
+     * with debugger breakpoints
+     */
+    [[nodiscard]]
+    auto isFunction(u32 address) const noexcept -> bool;
+    /**
+     * @brief Decompresses every function, passes that rewrite the code need it
+     */
+    auto inflateAll() -> DiagnosticsBag;
 
     auto getString(usize position) -> std::optional<std::string_view>;
     auto getNextString() -> std::optional<std::string_view>;
+    /**
+     * @brief Reads tag table index and returns the hash of the tag
+     */
+    auto getNextTagHash() -> std::optional<i32>;
 
     auto getNextInt() noexcept -> i32;
     auto getNextUnsigned() noexcept -> u32;
@@ -62,22 +110,22 @@ struct Bytefile {
         return static_cast<usize>(ptr - bytecode.data());
     }
 
-#pragma pack(push, 1)
-
     struct ClosureArg {
         VariableType type;
+        u8           reserved[3];
         u32          argument;
     };
 
-#pragma pack(pop)
-
-    static_assert(sizeof(ClosureArg) == 5,
-                  "ClosureArg must have the size of 5 bytes, otherwise it will miss the closure arguments");
+    static_assert(sizeof(ClosureArg) == 2 * sizeof(u32),
+                  "ClosureArg must have the size of 2 words, otherwise it will miss the closure arguments");
 
     auto closureArray(u32 n) -> std::span<ClosureArg>;
 
 private:
-    std::unique_ptr<u8> rawData;
+    std::vector<u32> image;
+
+    std::vector<u32>                 container; // compressed file, if it was
+    std::span<const CompressedFrame> frames;
 };
 
 class Stack {
@@ -94,10 +142,20 @@ public:
     auto getReference(u32 index, VariableType kind) -> std::optional<usize*>;
 
     auto stackBegin() -> usize*;
+    /**
+     * @brief amount of words pushed since the beginning, globals are not counted
+     */
+    auto depth() const noexcept -> usize;
+    /**
+     * @brief GC roots: global area and everything pushed on the stack, the
+     * latter starts from the top
+     */
+    auto globals() noexcept -> std::span<usize>;
+    auto values() noexcept -> std::span<usize>;
     LI_ALWAYS_INLINE
-    auto prologue(bool beginInClosure, u32 newNArgs, u32 newNLocals) -> bool;
+    auto prologue(bool beginInClosure, u32 newNArgs, u32 newNLocals, u32 address) -> bool;
     LI_ALWAYS_INLINE
-    auto epilogue(bool isClosure) -> u8*;
+    auto epilogue(bool isClosure, u32 address) -> u8*;
     LI_ALWAYS_INLINE
     auto closureRelativeAddr(u32 args) -> u32;
     LI_ALWAYS_INLINE
@@ -120,22 +178,47 @@ enum class InterpretResult {
     CONTINUE,
     STOP,
     ERROR,
+    INTERRUPTED, // some limit was hit in a safepoint
+    TRAP,        // breakpoint is hit, ip is on it
+};
+
+/**
+ * @brief This enum represents why the interpreter was stopped in a safepoint
+ */
+enum class InterruptReason : u8 {
+    None,
+    Budget,
+    Timeout,
+    HeapLimit,
+    Debugger,
 };
 
+class HeapCensus;
+class HeapPolicy;
+class Tier;
+class TypeFeedback;
+class ProgramIo;
+
 class Interpreter {
 public:
-    auto onBegin(bool isClosure, u32 nArgs, u32 nLocals) -> InterpretResult;
+    auto onBegin(bool isClosure, u32 nArgs, u32 nLocals, u32 address) -> InterpretResult;
     auto onCallLRead() -> InterpretResult;
     auto onLine(u32 line) -> InterpretResult;
     auto onStore(u32 index, VariableType toSave) -> InterpretResult;
     auto onDrop() -> InterpretResult;
     auto onLoad(u32 index, VariableType toLoad) -> InterpretResult;
     auto onBinOp(BinOp operation) -> InterpretResult;
+    /**
+     * @brief `BINOP` that speculates on two integers and a divisor that is not zero
+     *
+     * @return false if the speculation is wrong, the stack is left as it was
+     */
+    auto onBinOpInt(BinOp operation) -> bool;
     auto onConst(i32 value) -> InterpretResult;
     auto onCallLWrite() -> InterpretResult;
 
     [[nodiscard("This value is the next IP")]]
-    auto onEndOrRet() -> u8*;
+    auto onEndOrRet(u32 address) -> u8*;
     [[nodiscard("This value is the next IP")]]
     auto onJump(u32 jumpLocation) -> usize;
 
@@ -145,28 +228,114 @@ public:
     [[nodiscard("This value is the next IP")]]
     auto onCall(u32 location, u32 nArgs, u8* originalIP) -> std::optional<usize>;
     auto onString(std::string_view str) -> InterpretResult;
+    /**
+     * @brief `STRING` that knows the length, `text` is null-terminated
+     */
+    auto onStringOfLength(const char* text, u32 length) -> InterpretResult;
     auto onCallLLength() -> InterpretResult;
     auto onElem() -> InterpretResult;
+    /**
+     * @brief `ELEM` that speculates on an array and an index inside it
+     *
+     * @return false if the speculation is wrong, the stack is left as it was
+     */
+    auto onElemArray() -> bool;
     auto onSTA() -> InterpretResult;
     auto onCallBArray(u32 n) -> InterpretResult;
-    auto onSexp(std::string_view tag, u32 n) -> InterpretResult;
+    auto onSexp(i32 tagHash, u32 n) -> InterpretResult;
     auto onDuplicate() -> InterpretResult;
-    auto onTag(std::string_view name, u32 n) -> InterpretResult;
+    auto onTag(i32 tagHash, u32 n) -> InterpretResult;
+    /**
+     * @brief `TAG` that compares with the tag as it is in s-expressions, i.e. unboxed
+     */
+    auto onTagUnboxed(u32 tag, u32 n) -> InterpretResult;
     auto onCallLString() -> InterpretResult;
     auto onLoadAccumulator(u32 index, VariableType toLoad) -> InterpretResult;
     auto onClosure(u32 address, std::span<Bytefile::ClosureArg> args) -> InterpretResult;
 
     [[nodiscard("This value is the next IP")]]
     auto onCallClosure(u8* returnAddress, u32 nArgs) -> std::optional<usize>;
+    /**
+     * @brief Address of the code that `CALLC` with `nArgs` would call, nullopt if
+     * there is no closure under the arguments
+     */
+    auto closureCode(u32 nArgs) -> std::optional<usize>;
     auto onPattern(PatternType pattern) -> InterpretResult;
 
     auto onArray(u32 size) -> InterpretResult;
     auto onSwap() -> InterpretResult;
     auto onFail() -> InterpretResult;
 
+    /**
+     * @brief Polls execution limits and asynchronous requests. Is called only
+     * from back edges and calls
+     */
+    auto onSafepoint() -> InterpretResult;
+
     Interpreter(u32 globalAreaSize);
 
+    void setBudget(u64 safepoints) noexcept { budget = safepoints; }
+
+    void setHeapCensus(const HeapCensus* heapCensus) noexcept { census = heapCensus; }
+    void setHeapPolicy(HeapPolicy* heapPolicy) noexcept { policy = heapPolicy; }
+    void setTier(Tier* compiledTier) noexcept { tier = compiledTier; }
+    void setTypeFeedback(TypeFeedback* typeFeedback) noexcept { feedback = typeFeedback; }
+
+    [[nodiscard]]
+    auto compiledTier() const noexcept -> Tier* {
+        return tier;
+    }
+
+    [[nodiscard]]
+    auto typeFeedback() const noexcept -> TypeFeedback* {
+        return feedback;
+    }
+    /**
+     * @brief Redirects `Lread` and `Lwrite` to the recording or replay, nullptr is the real I/O
+     */
+    void setIo(ProgramIo* programIo) noexcept { io = programIo; }
+    /**
+     * @brief Prints heap census to stderr if it is enabled
+     */
+    void reportHeap(std::string_view reason);
+
+    /**
+     * @brief Stops the program outside of safepoints, e.g. from the debugger
+     */
+    void interruptWith(InterruptReason reason) noexcept { interrupt = reason; }
+
+    [[nodiscard]]
+    auto interruptReason() const noexcept -> InterruptReason {
+        return interrupt;
+    }
+
+    [[nodiscard]]
+    auto stackDepth() const noexcept -> usize {
+        return stack.depth();
+    }
+
+    /**
+     * @brief Values on the stack from the top, for the debugger
+     */
+    [[nodiscard]]
+    auto stackValues() noexcept -> std::span<usize> {
+        return stack.values();
+    }
+
+    /**
+     * @brief Variable of the current frame, for the debugger
+     */
+    auto variable(u32 index, VariableType type) -> std::optional<usize>;
+
 private:
-    bool  isClosure = false;
-    Stack stack;
+    bool            isClosure = false;
+    u64             budget    = std::numeric_limits<u64>::max();
+    InterruptReason interrupt = InterruptReason::None;
+    Stack           stack;
+
+    const HeapCensus* census   = nullptr;
+    HeapPolicy*       policy   = nullptr;
+    Tier*             tier     = nullptr;
+    TypeFeedback*     feedback = nullptr;
+    ProgramIo*        io       = nullptr;
 };
@@ -0,0 +1,135 @@
+/**
+ * @file LamaConvert.cpp
+ * @brief This file contains entry point of `lama-convert`, it converts v1 `.bc`
+ * files emitted by `lamac` into v2 format or into compressed container, see
+ * `BytecodeFormat.hpp`. On the way the code may be optimized, see `Optimizer.hpp`
+ *
+ */
+
+#include "BytecodeFormat.hpp"
+#include "Optimizer.hpp"
+#include "Types.hpp"
+
+#include <cerrno>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace {
+
+constexpr const char* CONVERT_USAGE =
+    "Usage: lama-convert [--compress] [--unroll=N] [--reuse-values] [--promote-globals] [--verbose] input.bc output.bc";
+
+constexpr u32 MAX_UNROLL_FACTOR = 16;
+
+} // namespace
+
+// NOLINTNEXTLINE
+int main(int argc, char** argv) {
+    bool             compress = false;
+    bool             verbose  = false; // print what the optimizer has done
+    OptimizerOptions optimizer;
+    bool             wrongArgs = argc < 3;
+    for (int i = 1; i < argc - 2; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--compress") {
+            compress = true;
+        } else if (arg == "--verbose") {
+            verbose = true;
+        } else if (arg == "--reuse-values") {
+            optimizer.reuseValues = true;
+        } else if (arg == "--promote-globals") {
+            optimizer.promoteGlobals = true;
+        } else if (arg.starts_with("--unroll=")) {
+            auto value  = arg.substr(arg.find('=') + 1);
+            auto result = std::from_chars(value.data(), value.data() + value.size(), optimizer.unrollFactor);
+            if (result.ec != std::errc {} || result.ptr != value.data() + value.size() || optimizer.unrollFactor == 0
+                || optimizer.unrollFactor > MAX_UNROLL_FACTOR) {
+                wrongArgs = true;
+            }
+        } else {
+            wrongArgs = true;
+        }
+    }
+    if (wrongArgs) {
+        std::cerr << CONVERT_USAGE << '\n';
+        return EXIT_FAILURE;
+    }
+    bool optimize = optimizer.unrollFactor > 1 || optimizer.reuseValues || optimizer.promoteGlobals;
+
+    const char* inputName  = argv[argc - 2];
+    const char* outputName = argv[argc - 1];
+
+    std::ifstream input(inputName, std::ios::binary);
+    if (!input) {
+        std::cerr << "E cannot open " << inputName << ": " << std::strerror(errno) << '\n';
+        return EXIT_FAILURE;
+    }
+    std::vector<char> content {std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>()};
+    // Public symbols are read as words, so keep them aligned
+    std::vector<u32> words((content.size() + sizeof(u32) - 1) / sizeof(u32));
+    std::memcpy(words.data(), content.data(), content.size());
+
+    std::span<const u8> file {reinterpret_cast<const u8*>(words.data()), content.size()}; // NOLINT
+    if (isCompressedContainer(file) || (isBytecodeV2(file) && !compress && !optimize)) {
+        std::cerr << "E " << inputName << " is converted already\n";
+        return EXIT_FAILURE;
+    }
+
+    std::vector<u32> image;
+    if (isBytecodeV2(file)) {
+        image = std::move(words);
+    } else {
+        auto possibleV1 = parseBytecodeV1(file);
+        if (std::holds_alternative<DiagnosticsBag>(possibleV1)) {
+            for (auto&& e : std::get<DiagnosticsBag>(possibleV1)) { std::cerr << "E " << e << '\n'; }
+            return EXIT_FAILURE;
+        }
+        auto possibleImage = convertToV2(std::get<BytefileV1>(possibleV1));
+        if (std::holds_alternative<DiagnosticsBag>(possibleImage)) {
+            for (auto&& e : std::get<DiagnosticsBag>(possibleImage)) { std::cerr << "E " << e << '\n'; }
+            return EXIT_FAILURE;
+        }
+        image = std::get<std::vector<u32>>(std::move(possibleImage));
+    }
+    if (optimize) {
+        OptimizerReport report;
+        auto            possibleImage = optimizeImage(image, optimizer, report);
+        if (std::holds_alternative<DiagnosticsBag>(possibleImage)) {
+            for (auto&& e : std::get<DiagnosticsBag>(possibleImage)) { std::cerr << "E " << e << '\n'; }
+            return EXIT_FAILURE;
+        }
+        image = std::get<std::vector<u32>>(std::move(possibleImage));
+        if (verbose) {
+            std::cerr << "unrolled_loops=" << report.unrolledLoops << " reused_values=" << report.reusedValues
+                      << " promoted_globals=" << report.promotedGlobals << '\n';
+        }
+    }
+
+    std::vector<u8> result(image.size() * sizeof(u32));
+    std::memcpy(result.data(), image.data(), result.size());
+    if (compress) {
+        auto possibleContainer = compressImage(image);
+        if (std::holds_alternative<DiagnosticsBag>(possibleContainer)) {
+            for (auto&& e : std::get<DiagnosticsBag>(possibleContainer)) { std::cerr << "E " << e << '\n'; }
+            return EXIT_FAILURE;
+        }
+        result = std::get<std::vector<u8>>(std::move(possibleContainer));
+    }
+
+    std::ofstream output(outputName, std::ios::binary | std::ios::trunc);
+    output.write(reinterpret_cast<const char*>(result.data()), static_cast<std::streamsize>(result.size())); // NOLINT
+    if (!output.flush()) {
+        std::cerr << "E cannot write " << outputName << ": " << std::strerror(errno) << '\n';
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,417 @@
+/**
+ * @file LamaGen.cpp
+ * @brief This file contains entry point of `lama-gen`, generator of synthetic
+ * v1 `.bc` files for scaling benchmarks (see `bench/scaling.sh`). Programs are
+ * valid and terminate: functions form call chains, loops are counted, and
+ * every function returns a number that `main` prints
+ *
+ */
+
+#include "Opcodes.hpp"
+#include "Types.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr const char* GEN_USAGE =
+    "Usage: lama-gen [--functions=N] [--body=N] [--depth=N] [--loops=N] [--iterations=N] [--arith=W] [--sexp=W] "
+    "[--array=W] [--string=W] [--closure=W] [--patterns=N] [--seed=N] output.bc";
+
+struct GeneratorOptions {
+    u32 functions  = 16; // besides `main` and the lambda
+    u32 body       = 16; // statements in the innermost loop of every function
+    u32 depth      = 4;  // length of call chains
+    u32 loops      = 1;  // loop nesting
+    u32 iterations = 4;  // of every loop
+    u32 patterns   = 4;  // branches of the `case` at the end of every function
+
+    // statement mix
+    u32 arith   = 4;
+    u32 sexp    = 1;
+    u32 array   = 1;
+    u32 string  = 1;
+    u32 closure = 1;
+
+    u32 seed = 1;
+
+    const char* output = nullptr;
+};
+
+template<typename T>
+auto parseNumber(std::string_view text) -> std::optional<T> {
+    T    value {};
+    auto end = text.data() + text.size();
+
+    auto [ptr, ec] = std::from_chars(text.data(), end, value);
+    if (ec != std::errc {} || ptr != end) { return std::nullopt; }
+    return value;
+}
+
+auto parseOptions(int argc, char** argv) -> std::optional<GeneratorOptions> {
+    GeneratorOptions options;
+
+    std::unordered_map<std::string_view, u32*> numbers {
+        {"--functions", &options.functions},
+        {"--body", &options.body},
+        {"--depth", &options.depth},
+        {"--loops", &options.loops},
+        {"--iterations", &options.iterations},
+        {"--patterns", &options.patterns},
+        {"--arith", &options.arith},
+        {"--sexp", &options.sexp},
+        {"--array", &options.array},
+        {"--string", &options.string},
+        {"--closure", &options.closure},
+        {"--seed", &options.seed},
+    };
+
+    bool ok = true;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (!arg.starts_with("--")) {
+            if (options.output) { ok = false; }
+            options.output = argv[i];
+            continue;
+        }
+
+        auto separator = arg.find('=');
+        auto option    = numbers.find(arg.substr(0, separator));
+        auto value     = separator == std::string_view::npos ? std::nullopt : parseNumber<u32>(arg.substr(separator + 1));
+        if (option == numbers.end() || !value) {
+            std::cerr << "E wrong option " << arg << '\n';
+            ok = false;
+            continue;
+        }
+        *option->second = *value;
+    }
+
+    if (options.depth == 0 || options.arith + options.sexp + options.array + options.string + options.closure == 0) {
+        std::cerr << "E depth and the statement mix must not be zero\n";
+        ok = false;
+    }
+    if (!ok || !options.output) { return std::nullopt; }
+    return options;
+}
+
+/**
+ * @brief v1 code with forward references, labels are resolved in `finish`
+ */
+class Assembler {
+public:
+    void op(Opcodes opcode) { code.push_back(to_underlying(opcode)); }
+
+    void word(u32 value) {
+        std::array<u8, sizeof(u32)> bytes {};
+        std::memcpy(bytes.data(), &value, sizeof(value));
+        code.insert(code.end(), bytes.begin(), bytes.end());
+    }
+
+    void byte(u8 value) { code.push_back(value); }
+
+    auto label() -> u32 {
+        labels.push_back(UNBOUND);
+        return static_cast<u32>(labels.size() - 1);
+    }
+
+    void bind(u32 label) { labels[label] = static_cast<u32>(code.size()); }
+
+    void ref(u32 label) {
+        fixups.push_back({static_cast<u32>(code.size()), label});
+        word(0);
+    }
+
+    auto string(const std::string& text) -> u32 {
+        auto [it, inserted] = strings.try_emplace(text, static_cast<u32>(pool.size()));
+        if (inserted) { pool.append(text).push_back('\0'); }
+        return it->second;
+    }
+
+    /**
+     * @brief Resolves labels and lays out the file
+     */
+    auto finish(u32 globals, const std::vector<std::pair<std::string, u32>>& publicSymbols) -> std::vector<u8> {
+        byte(0xFF); // end of the code marker
+        for (auto [at, label] : fixups) { std::memcpy(code.data() + at, &labels[label], sizeof(u32)); }
+
+        std::vector<u32> symbols;
+        for (auto& [name, label] : publicSymbols) {
+            symbols.push_back(string(name));
+            symbols.push_back(labels[label]);
+        }
+
+        std::vector<u8> file(3 * sizeof(u32) + symbols.size() * sizeof(u32));
+        std::array<u32, 3> header {static_cast<u32>(pool.size()), globals, static_cast<u32>(symbols.size() / 2)};
+        std::memcpy(file.data(), header.data(), sizeof(header));
+        std::memcpy(file.data() + sizeof(header), symbols.data(), symbols.size() * sizeof(u32));
+        file.insert(file.end(), pool.begin(), pool.end());
+        file.insert(file.end(), code.begin(), code.end());
+        return file;
+    }
+
+private:
+    static constexpr u32 UNBOUND = ~0U;
+
+    struct Fixup {
+        u32 at;
+        u32 label;
+    };
+
+    std::vector<u8>                      code;
+    std::vector<u32>                     labels;
+    std::vector<Fixup>                   fixups;
+    std::string                          pool;
+    std::unordered_map<std::string, u32> strings;
+};
+
+class Generator {
+public:
+    explicit Generator(const GeneratorOptions& generatorOptions)
+        : options(generatorOptions), random(generatorOptions.seed) {}
+
+    auto generate() -> std::vector<u8> {
+        auto mainLabel = as.label();
+        lambda         = as.label();
+        for (u32 i = 0; i < options.functions; ++i) { functions.push_back(as.label()); }
+
+        emitMain(mainLabel);
+        for (u32 i = 0; i < options.functions; ++i) { emitFunction(i); }
+
+        // The only closure body: returns its argument
+        as.bind(lambda);
+        as.op(Opcodes::CBEGIN);
+        as.word(1);
+        as.word(0);
+        as.op(Opcodes::LD_A);
+        as.word(0);
+        as.op(Opcodes::END);
+
+        return as.finish(1, {{"main", mainLabel}});
+    }
+
+private:
+    // Locals of generated functions: accumulator, the last allocated object, then loop counters
+    static constexpr u32 ACC    = 0;
+    static constexpr u32 OBJECT = 1;
+    static constexpr u32 ARITY  = 2; // of generated constructors
+
+    void emitMain(u32 label) {
+        as.bind(label);
+        as.op(Opcodes::BEGIN);
+        as.word(2);
+        as.word(0);
+        for (u32 head = 0; head < options.functions; head += options.depth) {
+            constant(static_cast<i32>(head));
+            as.op(Opcodes::CALL);
+            as.ref(functions[head]);
+            as.word(1);
+            as.op(Opcodes::CALL_Lwrite);
+            as.op(Opcodes::DROP);
+        }
+        constant(0);
+        as.op(Opcodes::END);
+    }
+
+    void emitFunction(u32 index) {
+        as.bind(functions[index]);
+        as.op(Opcodes::BEGIN);
+        as.word(1);
+        as.word(OBJECT + 1 + options.loops);
+        line();
+
+        constant(static_cast<i32>(index));
+        store(ACC);
+
+        // Chains of `depth` functions, the head is called from `main`
+        if ((index + 1) % options.depth != 0 && index + 1 < options.functions) {
+            load(Opcodes::LD_A, 0);
+            as.op(Opcodes::CALL);
+            as.ref(functions[index + 1]);
+            as.word(1);
+            as.op(Opcodes::ST_L);
+            as.word(ACC);
+            as.op(Opcodes::DROP);
+        }
+
+        emitLoop(0);
+        emitCase();
+
+        load(Opcodes::LD_L, ACC);
+        as.op(Opcodes::END);
+    }
+
+    void emitLoop(u32 level) {
+        if (level == options.loops) {
+            for (u32 i = 0; i < options.body; ++i) { emitStatement(); }
+            return;
+        }
+
+        u32  counter = OBJECT + 1 + level;
+        auto head    = as.label();
+        auto exit    = as.label();
+
+        constant(static_cast<i32>(options.iterations));
+        store(counter);
+        as.bind(head);
+        load(Opcodes::LD_L, counter);
+        constant(0);
+        as.op(Opcodes::BINOP_gt);
+        as.op(Opcodes::CJMPz);
+        as.ref(exit);
+
+        emitLoop(level + 1);
+
+        load(Opcodes::LD_L, counter);
+        constant(1);
+        as.op(Opcodes::BINOP_sub);
+        store(counter);
+        as.op(Opcodes::JMP);
+        as.ref(head);
+        as.bind(exit);
+    }
+
+    void emitStatement() {
+        line();
+        auto choice = static_cast<u32>(random() % (options.arith + options.sexp + options.array + options.string
+                                                   + options.closure));
+        // Weights are laid out one after another, the choice falls into one of them
+        auto pick = [&](u32 weight) {
+            if (choice < weight) { return true; }
+            choice -= weight;
+            return false;
+        };
+
+        if (pick(options.arith)) {
+            load(Opcodes::LD_L, ACC);
+            constant(static_cast<i32>(random() % 100));
+            as.op(arithmetic[random() % arithmetic.size()]);
+            store(ACC);
+        } else if (pick(options.sexp)) {
+            for (u32 i = 0; i < ARITY; ++i) { load(Opcodes::LD_L, ACC); }
+            as.op(Opcodes::SEXP);
+            as.word(tag(random() % std::max(options.patterns, 1U)));
+            as.word(ARITY);
+            store(OBJECT);
+        } else if (pick(options.array)) {
+            u32 length = 1 + random() % 4;
+            for (u32 i = 0; i < length; ++i) { constant(static_cast<i32>(i)); }
+            as.op(Opcodes::CALL_Barray);
+            as.word(length);
+            store(OBJECT);
+        } else if (pick(options.string)) {
+            as.op(Opcodes::STRING);
+            as.word(as.string("s" + std::to_string(random() % 16)));
+            store(OBJECT);
+        } else {
+            as.op(Opcodes::CLOSURE);
+            as.ref(lambda);
+            as.word(1);
+            as.byte(to_underlying(VariableType::Local));
+            as.word(ACC);
+            store(OBJECT);
+            load(Opcodes::LD_L, OBJECT);
+            load(Opcodes::LD_L, ACC);
+            as.op(Opcodes::CALLC);
+            as.word(1);
+            store(ACC);
+        }
+    }
+
+    /**
+     * @brief `case object of A0 (_, _) -> acc + 1 | ... | _ -> acc`, every test
+     * is a separate `TAG`, as `lamac` does it
+     */
+    void emitCase() {
+        if (options.patterns == 0) { return; }
+
+        auto hit  = as.label();
+        auto done = as.label();
+        for (u32 i = 0; i < options.patterns; ++i) {
+            load(Opcodes::LD_L, OBJECT);
+            as.op(Opcodes::TAG);
+            as.word(tag(i));
+            as.word(ARITY);
+            as.op(Opcodes::CJMPnz);
+            as.ref(hit);
+        }
+        as.op(Opcodes::JMP);
+        as.ref(done);
+
+        as.bind(hit);
+        load(Opcodes::LD_L, ACC);
+        constant(1);
+        as.op(Opcodes::BINOP_add);
+        store(ACC);
+        as.bind(done);
+    }
+
+    auto tag(u32 index) -> u32 { return as.string("A" + std::to_string(index)); }
+
+    void constant(i32 value) {
+        as.op(Opcodes::CONST);
+        as.word(static_cast<u32>(value));
+    }
+
+    void load(Opcodes opcode, u32 index) {
+        as.op(opcode);
+        as.word(index);
+    }
+
+    void store(u32 local) {
+        as.op(Opcodes::ST_L);
+        as.word(local);
+        as.op(Opcodes::DROP);
+    }
+
+    void line() {
+        as.op(Opcodes::LINE);
+        as.word(++lines);
+    }
+
+    // Division and remainder are left out, the accumulator may be zero
+    static constexpr std::array<Opcodes, 4> arithmetic {Opcodes::BINOP_add, Opcodes::BINOP_sub, Opcodes::BINOP_mul,
+                                                        Opcodes::BINOP_and};
+
+    const GeneratorOptions& options;
+    std::minstd_rand        random;
+    Assembler               as;
+    std::vector<u32>        functions;
+    u32                     lambda = 0;
+    u32                     lines  = 0;
+};
+
+} // namespace
+
+// NOLINTNEXTLINE
+int main(int argc, char** argv) {
+    auto options = parseOptions(argc, argv);
+    if (!options) {
+        std::cerr << GEN_USAGE << '\n';
+        return EXIT_FAILURE;
+    }
+
+    auto file = Generator(*options).generate();
+
+    std::ofstream output(options->output, std::ios::binary | std::ios::trunc);
+    output.write(reinterpret_cast<const char*>(file.data()), static_cast<std::streamsize>(file.size())); // NOLINT
+    if (!output.flush()) {
+        std::cerr << "E cannot write " << options->output << ": " << std::strerror(errno) << '\n';
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -16,6 +16,7 @@ extern "C" {
 void* Belem(void* p, int i);
 void* Bsta(void* v, int i, void* x);
 void* Bstring(void* p);
+void* LmakeString(int length);
 int   Llength(void* p);
 int   Lread();
 int   LtagHash(char*);
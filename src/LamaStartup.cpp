@@ -0,0 +1,121 @@
+/**
+ * @file LamaStartup.cpp
+ * @brief This file contains entry point of `lama-startup`, benchmark of the
+ * interpreter startup. It runs the interpreter with `--time-phases` many times
+ * and collects the time from `execve` to the first executed instruction
+ *
+ */
+
+#include "Types.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+constexpr const char* STARTUP_USAGE = "Usage: lama-startup [--runs=N] LamaInterpreter file.bc";
+
+auto monotonicNanos() noexcept -> u64 {
+    timespec now {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<u64>(now.tv_sec) * 1'000'000'000 + static_cast<u64>(now.tv_nsec);
+}
+
+/**
+ * @brief Runs the interpreter once, its output is dropped
+ *
+ * @return startup time in microseconds, std::nullopt if the run has failed
+ */
+auto runOnce(const char* interpreter, const char* file) -> std::optional<u64> {
+    std::array<int, 2> pipeEnds {};
+    if (pipe(pipeEnds.data()) < 0) { return std::nullopt; }
+
+    pid_t child = fork();
+    if (child < 0) { return std::nullopt; }
+    if (child == 0) {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(pipeEnds[1], STDERR_FILENO);
+        close(pipeEnds[0]);
+
+        std::string variable = "LAMA_EXEC_NS=" + std::to_string(monotonicNanos());
+        putenv(variable.data());
+        std::array<char*, 4> args {const_cast<char*>(interpreter), const_cast<char*>("--time-phases"),
+                                   const_cast<char*>(file), nullptr};
+        execv(interpreter, args.data());
+        _exit(127);
+    }
+
+    close(pipeEnds[1]);
+    std::string errors;
+    std::array<char, 4096> chunk {};
+    for (ssize_t n = 0; (n = read(pipeEnds[0], chunk.data(), chunk.size())) != 0;) {
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n < 0) { break; }
+        errors.append(chunk.data(), static_cast<usize>(n));
+    }
+    close(pipeEnds[0]);
+
+    int status = 0;
+    waitpid(child, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) { return std::nullopt; }
+
+    constexpr std::string_view KEY = "startup_us=";
+    auto                       at  = errors.find(KEY);
+    if (at == std::string::npos) { return std::nullopt; }
+    u64 micros = 0;
+    std::from_chars(errors.data() + at + KEY.size(), errors.data() + errors.size(), micros);
+    return micros;
+}
+
+} // namespace
+
+// NOLINTNEXTLINE
+int main(int argc, char** argv) {
+    u32 runs = 100;
+    int next = 1;
+    if (argc > next && std::string_view(argv[next]).starts_with("--runs=")) {
+        std::string_view value = std::string_view(argv[next]).substr(std::string_view("--runs=").size());
+        auto [ptr, ec]         = std::from_chars(value.data(), value.data() + value.size(), runs);
+        if (ec != std::errc {} || ptr != value.data() + value.size() || runs == 0) {
+            std::cerr << STARTUP_USAGE << '\n';
+            return EXIT_FAILURE;
+        }
+        ++next;
+    }
+    if (argc - next != 2) {
+        std::cerr << STARTUP_USAGE << '\n';
+        return EXIT_FAILURE;
+    }
+    const char* interpreter = argv[next];
+    const char* file        = argv[next + 1];
+
+    std::vector<u64> samples;
+    for (u32 i = 0; i < runs; ++i) {
+        auto micros = runOnce(interpreter, file);
+        if (!micros) {
+            std::cerr << "E run of " << interpreter << " " << file << " has failed\n";
+            return EXIT_FAILURE;
+        }
+        samples.push_back(*micros);
+    }
+
+    std::sort(samples.begin(), samples.end());
+    std::cout << "execve to the first instruction over " << runs << " runs, us: min " << samples.front()
+              << " median " << samples[samples.size() / 2] << " p90 " << samples[samples.size() * 9 / 10] << " max "
+              << samples.back() << '\n';
+    return EXIT_SUCCESS;
+}
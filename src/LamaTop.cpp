@@ -0,0 +1,153 @@
+/**
+ * @file LamaTop.cpp
+ * @brief This file contains `lama-top` -- a tiny viewer of live statistics,
+ * that interpreter publishes with `--stats-shm`
+ *
+ */
+
+#include "SharedStats.hpp"
+#include "Types.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+struct Snapshot {
+    u64 instructions = 0;
+    u64 calls        = 0;
+    u64 allocations  = 0;
+    u64 gcNanos      = 0;
+
+    static auto take(StatsSegment& segment) -> Snapshot {
+        constexpr auto RELAXED = std::memory_order_relaxed;
+        return {segment.instructions.load(RELAXED),
+                segment.calls.load(RELAXED),
+                segment.allocations.load(RELAXED),
+                segment.gcNanos.load(RELAXED)};
+    }
+};
+
+auto segmentName(std::string_view arg) -> std::string {
+    u32  pid {};
+    auto end = arg.data() + arg.size();
+    if (auto [ptr, ec] = std::from_chars(arg.data(), end, pid); ec == std::errc {} && ptr == end) {
+        return defaultStatsName(pid);
+    }
+    return std::string(arg);
+}
+
+/**
+ * @brief The interpreter could be killed by a signal, it never finishes the segment then
+ */
+auto alive(u32 pid) -> bool { return kill(static_cast<pid_t>(pid), 0) == 0 || errno != ESRCH; }
+
+auto perSecond(u64 now, u64 before, double seconds) -> u64 {
+    return static_cast<u64>(static_cast<double>(now - before) / seconds);
+}
+
+} // namespace
+
+// NOLINTNEXTLINE
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        std::cerr << "Usage: lama-top <pid | shared memory name>\n";
+        return EXIT_FAILURE;
+    }
+    auto name = segmentName(argv[1]);
+
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        std::cerr << "E cannot open " << name << ": " << std::strerror(errno) << '\n';
+        return EXIT_FAILURE;
+    }
+    struct stat info {};
+    if (fstat(fd, &info) != 0 || static_cast<usize>(info.st_size) < sizeof(StatsSegment)) {
+        std::cerr << "E " << name << " is not a statistics segment\n";
+        return EXIT_FAILURE;
+    }
+    auto  size   = static_cast<usize>(info.st_size);
+    void* memory = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        std::cerr << "E cannot map " << name << ": " << std::strerror(errno) << '\n';
+        return EXIT_FAILURE;
+    }
+
+    auto& segment = *static_cast<StatsSegment*>(memory);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (segment.magic != StatsSegment::MAGIC || segment.version != StatsSegment::VERSION
+        || StatsSegment::sizeFor(segment.functionCount) > size) {
+        std::cerr << "E " << name << " has unknown format\n";
+        return EXIT_FAILURE;
+    }
+
+    using Clock        = std::chrono::steady_clock;
+    constexpr auto TICK = std::chrono::seconds(1);
+
+    auto before     = Snapshot::take(segment);
+    auto beforeTime = Clock::now();
+    std::cout << "pid " << segment.pid << '\n'
+              << std::setw(14) << "instr/s" << std::setw(12) << "calls/s" << std::setw(12) << "allocs/s"
+              << std::setw(8) << "gc" << std::setw(8) << "gc %" << std::setw(10) << "stack" << "  function\n";
+
+    while (!segment.finished.load(std::memory_order_acquire)) {
+        std::this_thread::sleep_for(TICK);
+        if (!segment.finished.load(std::memory_order_acquire) && !alive(segment.pid)) {
+            std::cerr << "E interpreter " << segment.pid << " has died without finishing\n";
+            // Nobody else would remove the segment
+            shm_unlink(name.c_str());
+            munmap(memory, size);
+            return EXIT_FAILURE;
+        }
+        auto now     = Snapshot::take(segment);
+        auto nowTime = Clock::now();
+        auto seconds = std::chrono::duration<double>(nowTime - beforeTime).count();
+
+        auto gcShare = static_cast<double>(now.gcNanos - before.gcNanos) / (seconds * 1e9) * 100;
+        auto current = segment.currentFunction.load(std::memory_order_relaxed);
+
+        std::cout << std::setw(14) << perSecond(now.instructions, before.instructions, seconds) << std::setw(12)
+                  << perSecond(now.calls, before.calls, seconds) << std::setw(12)
+                  << perSecond(now.allocations, before.allocations, seconds) << std::setw(8)
+                  << segment.gcCount.load(std::memory_order_relaxed) << std::setw(8) << std::fixed
+                  << std::setprecision(1) << gcShare << std::setw(10)
+                  << segment.stackDepth.load(std::memory_order_relaxed) << "  ";
+        if (current < segment.functionCount) {
+            const auto& function = segment.functions()[current];
+            if (function.name[0]) {
+                std::cout << std::string_view(function.name, strnlen(function.name, StatsSegment::NAME_LEN));
+            } else {
+                std::cout << "0x" << std::hex << function.address << std::dec;
+            }
+        } else {
+            std::cout << '-';
+        }
+        std::cout << std::endl;
+
+        before     = now;
+        beforeTime = nowTime;
+    }
+
+    auto total = Snapshot::take(segment);
+    std::cout << "finished: " << total.instructions << " instructions, " << total.calls << " calls, "
+              << total.allocations << " allocations, " << segment.gcCount.load(std::memory_order_relaxed)
+              << " collections\n";
+    munmap(memory, size);
+    return EXIT_SUCCESS;
+}
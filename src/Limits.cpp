@@ -0,0 +1,50 @@
+#include "Limits.hpp"
+
+#include "Types.hpp"
+
+#include <csignal>
+#include <sys/time.h>
+
+volatile std::sig_atomic_t interruptPending = 0;
+volatile std::sig_atomic_t timeoutExpired   = 0;
+volatile std::sig_atomic_t censusRequested  = 0;
+
+namespace {
+
+void onAlarm(int /*signal*/) {
+    timeoutExpired   = 1;
+    interruptPending = 1;
+}
+
+void onCensusSignal(int /*signal*/) {
+    censusRequested  = 1;
+    interruptPending = 1;
+}
+
+auto installHandler(int signal, void (*handler)(int)) -> bool {
+    struct sigaction action {};
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask);
+    // NOTE: we don't want to interrupt `Lread` waiting for input, it will be
+    // noticed on the next safepoint anyway
+    action.sa_flags = SA_RESTART;
+    return sigaction(signal, &action, nullptr) == 0;
+}
+
+} // namespace
+
+auto armCensusSignal() -> bool { return installHandler(SIGUSR1, onCensusSignal); }
+
+auto armTimeout(double seconds) -> bool {
+    if (!installHandler(SIGALRM, onAlarm)) { return false; }
+
+    auto micros = static_cast<u64>(seconds * 1'000'000);
+
+    itimerval timer {};
+    timer.it_value.tv_sec  = static_cast<time_t>(micros / 1'000'000);
+    timer.it_value.tv_usec = static_cast<suseconds_t>(micros % 1'000'000);
+    // zero timer disarms it, so wait at least a microsecond
+    if (micros == 0) { timer.it_value.tv_usec = 1; }
+
+    return setitimer(ITIMER_REAL, &timer, nullptr) == 0;
+}
@@ -0,0 +1,40 @@
+/**
+ * @file Limits.hpp
+ * @brief This file contains execution limits and other asynchronous requests
+ * from signal handlers. They are never checked per instruction, only in
+ * safepoints -- back edges and calls, see `insertSafepoints`
+ *
+ */
+#pragma once
+
+#include <csignal>
+
+/**
+ * @brief Set by every handler below, so the safepoint polls only a single flag
+ */
+extern volatile std::sig_atomic_t interruptPending;
+
+/**
+ * @brief Set by SIGALRM handler when wall-clock limit is over
+ */
+extern volatile std::sig_atomic_t timeoutExpired;
+
+/**
+ * @brief Set by SIGUSR1 handler when someone asks for a heap census
+ */
+extern volatile std::sig_atomic_t censusRequested;
+
+/**
+ * @brief Starts a one-shot timer that sets `timeoutExpired` after `seconds`,
+ * they are positive and fit into `time_t`, see `Options::parse`
+ *
+ * @return false if the timer or signal handler could not be installed
+ */
+auto armTimeout(double seconds) -> bool;
+
+/**
+ * @brief Installs SIGUSR1 handler that sets `censusRequested`
+ *
+ * @return false if the signal handler could not be installed
+ */
+auto armCensusSignal() -> bool;
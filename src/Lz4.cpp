@@ -0,0 +1,130 @@
+#include "Lz4.hpp"
+
+#include "Types.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <vector>
+
+// Block is a sequence of
+// ┌───────┬────────────────┬──────────┬────────┬──────────────┐
+// │       │                │          │        │              │
+// │ token │ literal length │ literals │ offset │ match length │
+// │       │ (extra bytes)  │          │        │ (extra bytes)│
+// └───────┴────────────────┴──────────┴────────┴──────────────┘
+//   high nibble -- literal length, low -- match length - 4, 15 means that
+//   extra bytes follow, every 255 continues. The last sequence has literals only
+
+namespace {
+
+constexpr usize MIN_MATCH     = 4;
+constexpr usize LAST_LITERALS = 5;  // the last bytes of a block are always literals
+constexpr usize MF_LIMIT      = 12; // the last match starts at least that far from the end
+constexpr usize MAX_OFFSET    = 0xFFFF;
+constexpr usize NIBBLE_MAX    = 15;
+constexpr u32   HASH_LOG      = 12;
+
+auto read32(std::span<const u8> data, usize offset) noexcept -> u32 {
+    u32 result;
+    copyValues(&result, data.data() + offset);
+    return result;
+}
+
+auto hash(u32 sequence) noexcept -> u32 { return (sequence * 2654435761U) >> (32 - HASH_LOG); }
+
+void writeLength(std::vector<u8>& out, usize length) {
+    for (; length >= 0xFF; length -= 0xFF) { out.push_back(0xFF); }
+    out.push_back(static_cast<u8>(length));
+}
+
+void writeLiterals(std::vector<u8>& out, std::span<const u8> literals, u8 matchNibble) {
+    auto length = literals.size();
+    out.push_back(static_cast<u8>(std::min(length, NIBBLE_MAX) << 4 | matchNibble));
+    if (length >= NIBBLE_MAX) { writeLength(out, length - NIBBLE_MAX); }
+    out.insert(out.end(), literals.begin(), literals.end());
+}
+
+} // namespace
+
+auto lz4Compress(std::span<const u8> input) -> std::vector<u8> {
+    std::vector<u8>  out;
+    std::vector<u32> table(usize {1} << HASH_LOG, 0); // position + 1, zero is empty
+    out.reserve(input.size() + input.size() / 0xFF + 16);
+
+    usize anchor = 0;
+    usize pos    = 0;
+    while (input.size() >= MF_LIMIT && pos <= input.size() - MF_LIMIT) {
+        auto  sequence  = read32(input, pos);
+        auto& slot      = table[hash(sequence)];
+        usize candidate = slot;
+        slot            = static_cast<u32>(pos + 1);
+
+        if (candidate == 0 || pos - (candidate - 1) > MAX_OFFSET || read32(input, candidate - 1) != sequence) {
+            ++pos;
+            continue;
+        }
+
+        usize match    = candidate - 1;
+        usize length   = MIN_MATCH;
+        usize maxMatch = input.size() - LAST_LITERALS - pos;
+        while (length < maxMatch && input[pos + length] == input[match + length]) { ++length; }
+
+        auto extra = length - MIN_MATCH;
+        writeLiterals(out, input.subspan(anchor, pos - anchor), static_cast<u8>(std::min(extra, NIBBLE_MAX)));
+        auto offset = pos - match;
+        out.push_back(static_cast<u8>(offset & 0xFF));
+        out.push_back(static_cast<u8>(offset >> 8));
+        if (extra >= NIBBLE_MAX) { writeLength(out, extra - NIBBLE_MAX); }
+
+        pos   += length;
+        anchor = pos;
+    }
+
+    writeLiterals(out, input.subspan(anchor), 0);
+    return out;
+}
+
+auto lz4Decompress(std::span<const u8> input, std::span<u8> output) noexcept -> std::optional<usize> {
+    usize ip = 0;
+    usize op = 0;
+
+    auto readLength = [&](usize length) -> std::optional<usize> {
+        u8 byte = 0;
+        do {
+            if (ip >= input.size() || length > output.size()) { return std::nullopt; }
+            byte    = input[ip++];
+            length += byte;
+        } while (byte == 0xFF);
+        return length;
+    };
+
+    while (ip < input.size()) {
+        u8 token = input[ip++];
+
+        std::optional<usize> literals = token >> 4;
+        if (literals == NIBBLE_MAX) { literals = readLength(*literals); }
+        if (!literals || input.size() - ip < *literals || output.size() - op < *literals) { return std::nullopt; }
+        std::memcpy(output.data() + op, input.data() + ip, *literals);
+        ip += *literals;
+        op += *literals;
+
+        // the last sequence has no match
+        if (ip == input.size()) { break; }
+
+        if (input.size() - ip < 2) { return std::nullopt; }
+        usize offset = input[ip] | static_cast<usize>(input[ip + 1]) << 8;
+        ip          += 2;
+        if (offset == 0 || offset > op) { return std::nullopt; }
+
+        std::optional<usize> length = token & NIBBLE_MAX;
+        if (length == NIBBLE_MAX) { length = readLength(*length); }
+        if (!length || output.size() - op < *length + MIN_MATCH) { return std::nullopt; }
+
+        // byte by byte, matches could overlap with themselves
+        for (usize i = 0; i < *length + MIN_MATCH; ++i, ++op) { output[op] = output[op - offset]; }
+    }
+    return op;
+}
@@ -0,0 +1,39 @@
+/**
+ * @file Lz4.hpp
+ * @brief This file contains a small self-contained codec of LZ4 block format.
+ * Blocks are compatible with the reference implementation, but the compressor
+ * is the simplest greedy one: bytecode is compressed once and decompressed
+ * many times, only the decompressor has to be fast
+ *
+ */
+#pragma once
+
+#include "Types.hpp"
+
+#include <optional>
+#include <span>
+#include <vector>
+
+/**
+ * @brief Compresses `input` into a single LZ4 block
+ */
+auto lz4Compress(std::span<const u8> input) -> std::vector<u8>;
+
+/**
+ * @brief Whether a block of `compressed` bytes could inflate to `raw` bytes. A
+ * byte of the block gives at most 255 bytes of a match, so it's checked before
+ * anything is allocated for a size that is read from a file
+ */
+constexpr auto lz4CouldInflate(u64 compressed, u64 raw) noexcept -> bool {
+    constexpr u64 MAX_RATIO = 255;
+    return raw <= compressed * MAX_RATIO;
+}
+
+/**
+ * @brief Decompresses a single LZ4 block into `output`. Every read and write
+ * is checked, so a broken block could not write outside `output`
+ *
+ * @return size of decompressed data or std::nullopt if the block is broken or
+ * does not fit into `output`
+ */
+auto lz4Decompress(std::span<const u8> input, std::span<u8> output) noexcept -> std::optional<usize>;
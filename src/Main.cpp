@@ -5,18 +5,73 @@
  *
  */
 
+#include "Analysis.hpp"
+#include "Debugger.hpp"
+#include "GcHooks.hpp"
+#include "HeapCensus.hpp"
+#include "HeapPolicy.hpp"
 #include "Interpreter.hpp"
+#include "LamaRuntime.hpp"
+#include "Limits.hpp"
 #include "Opcodes.hpp"
+#include "Options.hpp"
+#include "Output.hpp"
+#include "PerfMap.hpp"
+#include "Profile.hpp"
+#include "ProgramIo.hpp"
+#include "SharedStats.hpp"
+#include "Tier.hpp"
+#include "TypeFeedback.hpp"
 #include "Types.hpp"
 #include "Utils.hpp"
 
 #include <cassert>
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
 #include <exception>
+#include <fstream>
 #include <iostream>
+#include <optional>
+#include <unistd.h>
 
 namespace {
 
+constexpr usize MAX_QUICKENED_LENGTH = usize {1} << 24; // must fit into the reserved bytes of the opcode word
+
+/**
+ * @brief Notes the operands of a profiled instruction, its site is in the reserved bytes
+ *
+ * @tparam Profiled whether type feedback is collected, otherwise nothing is even read
+ */
+template<bool Profiled>
+LI_ALWAYS_INLINE void recordFeedback(const Bytefile& bytefile, Interpreter& interpreter) {
+    if constexpr (Profiled) {
+        // Zero is an instruction that has got no site, the loader checks that the reserved bytes are clear
+        u32 word;
+        copyValues(&word, bytefile.prevIP);
+        if (word >> 8) { interpreter.typeFeedback()->record(word >> 8, interpreter.stackValues()); }
+    }
+}
+
+/**
+ * @brief Rewrites the instruction that is being executed into its quickened
+ * variant, the reserved bytes keep `extra` if it is given
+ */
+LI_ALWAYS_INLINE
+void quicken(Bytefile& bytefile, Opcodes opcode, std::optional<u32> extra = std::nullopt) {
+    if (extra) {
+        u32 word = to_underlying(opcode) | *extra << 8;
+        std::memcpy(bytefile.prevIP, &word, sizeof(u32));
+    } else {
+        *bytefile.prevIP = to_underlying(opcode);
+    }
+}
+
+/**
+ * @tparam Profiled whether type feedback is collected, see `recordFeedback`
+ */
+template<bool Profiled>
 auto interpretOne(Bytefile& bytefile, Interpreter& interpreter) -> InterpretResult {
 #define checkEnoughBytes(bytes)                                                \
     if (!bytefile.enoughBytes(bytes)) {                                        \
@@ -30,10 +85,12 @@ auto interpretOne(Bytefile& bytefile, Interpreter& interpreter) -> InterpretResu
         return InterpretResult::ERROR;                                                                     \
     }
 
-    checkEnoughBytes(1);
+    checkEnoughBytes(sizeof(u32));
 
-    u8 code = bytefile.getNextCode();
-    u8 low  = (code & 0x0F);
+    u8          code = bytefile.getNextCode();
+    const auto& info = opcodeInfo(code);
+    // Operands of every instruction are checked at once, the table knows how many there are
+    checkEnoughBytes(info.operands * sizeof(u32));
 
     switch (static_cast<Opcodes>(code)) {
     case Opcodes::BINOP_add:
@@ -49,26 +106,34 @@ auto interpretOne(Bytefile& bytefile, Interpreter& interpreter) -> InterpretResu
     case Opcodes::BINOP_ne:
     case Opcodes::BINOP_and:
     case Opcodes::BINOP_or: {
-        // SAFETY: this cast could happen only if we got
-        // into right opcode
-        auto operation = static_cast<BinOp>(low);
+        recordFeedback<Profiled>(bytefile, interpreter);
+        // SAFETY: variant of these opcodes is the operation, see `LAMA_OPCODES`
+        auto operation = static_cast<BinOp>(info.variant);
         return interpreter.onBinOp(operation);
     }
     case Opcodes::CONST: {
-        checkEnoughBytes(sizeof(u32));
         auto val = bytefile.getNextInt();
         return interpreter.onConst(val);
     }
     case Opcodes::STRING: {
         auto val = bytefile.getNextString();
         if (!val.has_value()) { return InterpretResult::ERROR; }
+        if (val->size() < MAX_QUICKENED_LENGTH) {
+            quicken(bytefile, Opcodes::STRING_len, static_cast<u32>(val->size()));
+        }
         return interpreter.onString(val.value());
     }
+    case Opcodes::STRING_len: {
+        u32 word;
+        copyValues(&word, bytefile.prevIP);
+        // The index is checked by `STRING` already: only quickening writes this opcode, the loader rejects it
+        auto* text = bytefile.strPool.data() + bytefile.getNextUnsigned();
+        return interpreter.onStringOfLength(reinterpret_cast<const char*>(text), word >> 8); // NOLINT
+    }
     case Opcodes::SEXP: {
-        auto tag = bytefile.getNextString();
+        auto tag = bytefile.getNextTagHash();
         if (!tag.has_value()) { return InterpretResult::ERROR; }
 
-        checkEnoughBytes(sizeof(u32));
         auto n = bytefile.getNextUnsigned();
 
         return interpreter.onSexp(tag.value(), n);
@@ -78,10 +143,13 @@ auto interpretOne(Bytefile& bytefile, Interpreter& interpreter) -> InterpretResu
         FAIL();
     }
     case Opcodes::STA: {
+        recordFeedback<Profiled>(bytefile, interpreter);
         return interpreter.onSTA();
     }
+    case Opcodes::JMP_safe:
+        if (interpreter.onSafepoint() != InterpretResult::CONTINUE) { return InterpretResult::INTERRUPTED; }
+        [[fallthrough]];
     case Opcodes::JMP: {
-        checkEnoughBytes(sizeof(u32));
         auto toJump = bytefile.getNextUnsigned();
 
         auto absoluteAddress = interpreter.onJump(toJump);
@@ -90,12 +158,14 @@ auto interpretOne(Bytefile& bytefile, Interpreter& interpreter) -> InterpretResu
     }
     case Opcodes::END:
     case Opcodes::RET: {
-        auto* nextCode = interpreter.onEndOrRet();
+        auto* nextCode = interpreter.onEndOrRet(static_cast<u32>(bytefile.relAddr(bytefile.prevIP)));
 
         bytefile.ip = nextCode;
         if (!nextCode) { return InterpretResult::STOP; }
 
-        return InterpretResult::CONTINUE;
+        // Compiled code has left for the call, it goes on from the return address
+        auto* tier = interpreter.compiledTier();
+        return tier ? tier->onReturn(interpreter) : InterpretResult::CONTINUE;
     }
     case Opcodes::DROP: {
         return interpreter.onDrop();
@@ -107,45 +177,53 @@ auto interpretOne(Bytefile& bytefile, Interpreter& interpreter) -> InterpretResu
         return interpreter.onSwap();
     }
     case Opcodes::ELEM: {
+        recordFeedback<Profiled>(bytefile, interpreter);
+        if (interpreter.onElemArray()) {
+            quicken(bytefile, Opcodes::ELEM_arr);
+            return InterpretResult::CONTINUE;
+        }
+        return interpreter.onElem();
+    }
+    case Opcodes::ELEM_arr: {
+        recordFeedback<Profiled>(bytefile, interpreter);
+        if (interpreter.onElemArray()) { return InterpretResult::CONTINUE; }
+        quicken(bytefile, Opcodes::ELEM);
         return interpreter.onElem();
     }
     case Opcodes::LD_G:
     case Opcodes::LD_L:
     case Opcodes::LD_A:
     case Opcodes::LD_C: {
-        checkEnoughBytes(sizeof(u32));
         auto idx = bytefile.getNextUnsigned();
-        // SAFETY: this cast could happen only if we got
-        // into right opcode
-        auto type = static_cast<VariableType>(low);
+        // SAFETY: variant of these opcodes is the variable type, see `LAMA_OPCODES`
+        auto type = static_cast<VariableType>(info.variant);
         return interpreter.onLoad(idx, type);
     }
     case Opcodes::LDA_G:
     case Opcodes::LDA_L:
     case Opcodes::LDA_A:
     case Opcodes::LDA_C: {
-        checkEnoughBytes(sizeof(u32));
         auto idx = bytefile.getNextUnsigned();
-        // SAFETY: this cast could happen only if we got
-        // into right opcode
-        auto type = static_cast<VariableType>(low);
+        // SAFETY: variant of these opcodes is the variable type, see `LAMA_OPCODES`
+        auto type = static_cast<VariableType>(info.variant);
         return interpreter.onLoadAccumulator(idx, type);
     }
     case Opcodes::ST_G:
     case Opcodes::ST_L:
     case Opcodes::ST_A:
     case Opcodes::ST_C: {
-        checkEnoughBytes(sizeof(u32));
         auto idx = bytefile.getNextUnsigned();
-        // SAFETY: this cast could happen only if we got
-        // into right opcode
-        auto storeType = static_cast<VariableType>(low);
+        // SAFETY: variant of these opcodes is the variable type, see `LAMA_OPCODES`
+        auto storeType = static_cast<VariableType>(info.variant);
         return interpreter.onStore(idx, storeType);
     }
+    case Opcodes::CJMPz_safe:
+    case Opcodes::CJMPnz_safe:
+        if (interpreter.onSafepoint() != InterpretResult::CONTINUE) { return InterpretResult::INTERRUPTED; }
+        [[fallthrough]];
     case Opcodes::CJMPz:
     case Opcodes::CJMPnz: {
-        checkEnoughBytes(sizeof(u32));
-        bool isNotEq      = low & 0x01;
+        bool isNotEq      = info.variant != 0;
         auto jumpLocation = bytefile.getNextUnsigned();
         auto jump         = interpreter.onCondJump(isNotEq, jumpLocation, bytefile.address());
         if (!jump.has_value()) { return InterpretResult::ERROR; }
@@ -155,62 +233,123 @@ auto interpretOne(Bytefile& bytefile, Interpreter& interpreter) -> InterpretResu
     }
     case Opcodes::BEGIN: // Begin and closure begin are the same(?)
     case Opcodes::CBEGIN: {
-        checkEnoughBytes(sizeof(u32) * 2);
-        // Begin is even, while Cbegin is odd (because it's next instruction)
-        bool isCBegin = low & 0x1;
+        bool isCBegin = info.variant != 0;
         auto nArgs    = bytefile.getNextUnsigned();
         auto nLocals  = bytefile.getNextUnsigned();
-        return interpreter.onBegin(isCBegin, nArgs, nLocals);
+        return interpreter.onBegin(isCBegin, nArgs, nLocals, static_cast<u32>(bytefile.relAddr(bytefile.prevIP)));
+    }
+    case Opcodes::BEGIN_cnt:
+    case Opcodes::CBEGIN_cnt: {
+        bool isCBegin = info.variant != 0;
+        auto address  = static_cast<u32>(bytefile.relAddr(bytefile.prevIP));
+        // Index of the function is in the reserved bytes of the opcode word
+        u32 function;
+        copyValues(&function, bytefile.prevIP);
+        auto nArgs   = bytefile.getNextUnsigned();
+        auto nLocals = bytefile.getNextUnsigned();
+        auto result  = interpreter.onBegin(isCBegin, nArgs, nLocals, address);
+        // Only the tier writes these opcodes, the loader rejects them. Still, no tier is no counting
+        auto* tier = interpreter.compiledTier();
+        if (result != InterpretResult::CONTINUE || !tier) { return result; }
+        return tier->onEntry(interpreter, function >> 8);
+    }
+    case Opcodes::JMP_osr:
+    case Opcodes::CJMPz_osr:
+    case Opcodes::CJMPnz_osr: {
+        if (interpreter.onSafepoint() != InterpretResult::CONTINUE) { return InterpretResult::INTERRUPTED; }
+        // Index of the loop is in the reserved bytes of the opcode word
+        u32 loop;
+        copyValues(&loop, bytefile.prevIP);
+        auto header = bytefile.getNextUnsigned();
+        auto jump   = code == to_underlying(Opcodes::JMP_osr)
+                        ? std::optional {interpreter.onJump(header)}
+                        : interpreter.onCondJump(info.variant != 0, header, bytefile.address());
+        if (!jump.has_value()) { return InterpretResult::ERROR; }
+
+        trySetAddr("jump", jump.value());
+        auto* tier = interpreter.compiledTier();
+        if (jump.value() != header || !tier) { return InterpretResult::CONTINUE; }
+        return tier->onBackEdge(interpreter, loop >> 8);
     }
     case Opcodes::CLOSURE: {
-        checkEnoughBytes(sizeof(u32) * 2);
         auto address = bytefile.getNextUnsigned();
         auto n       = bytefile.getNextUnsigned();
         return interpreter.onClosure(address, bytefile.closureArray(n));
     }
+    case Opcodes::CALLC_safe:
+        if (interpreter.onSafepoint() != InterpretResult::CONTINUE) { return InterpretResult::INTERRUPTED; }
+        [[fallthrough]];
     case Opcodes::CALLC: {
-        checkEnoughBytes(sizeof(u32));
+        recordFeedback<Profiled>(bytefile, interpreter);
         auto nArgs          = bytefile.getNextUnsigned();
         auto closureAddress = interpreter.onCallClosure(bytefile.ip, nArgs);
         if (!closureAddress.has_value()) { return InterpretResult::ERROR; }
 
         trySetAddr("jump", closureAddress.value());
-
-        auto nextOpcode = bytefile.peekNextCode();
-
-        if (nextOpcode != to_underlying(Opcodes::CBEGIN) && nextOpcode != to_underlying(Opcodes::BEGIN)) {
+        // The table, not the opcode: a breakpoint on the callee has replaced its (C)BEGIN with TRAP
+        if (!bytefile.isFunction(static_cast<u32>(closureAddress.value()))) {
             std::cerr << "Cannot call closure to address 0x" << std::hex << closureAddress.value()
-                      << " -- next opcode is " << toString(Opcodes(nextOpcode)) << " not (C)BEGIN\n";
+                      << " -- it is not a function\n";
             return InterpretResult::ERROR;
         }
+        if (!bytefile.inflate(static_cast<u32>(closureAddress.value()))) { return InterpretResult::ERROR; }
         return InterpretResult::CONTINUE;
     }
+    case Opcodes::CALL_safe:
+        if (interpreter.onSafepoint() != InterpretResult::CONTINUE) { return InterpretResult::INTERRUPTED; }
+        [[fallthrough]];
     case Opcodes::CALL: {
-        checkEnoughBytes(sizeof(u32) * 2);
         auto location    = bytefile.getNextUnsigned();
         auto nArgs       = bytefile.getNextUnsigned();
         auto callAddress = interpreter.onCall(location, nArgs, bytefile.ip);
         if (!callAddress.has_value()) { return InterpretResult::ERROR; }
 
         trySetAddr("call", callAddress.value());
-
-        if (bytefile.peekNextCode() != to_underlying(Opcodes::BEGIN)) {
-            std::cerr << "Cannot call to address 0x" << std::hex << callAddress.value() << " -- next opcode is "
-                      << toString(Opcodes(bytefile.peekNextCode())) << " not BEGIN\n";
+        if (!bytefile.isFunction(static_cast<u32>(callAddress.value()))) {
+            std::cerr << "Cannot call to address 0x" << std::hex << callAddress.value() << " -- it is not a function\n";
             return InterpretResult::ERROR;
         }
+        if (!bytefile.inflate(static_cast<u32>(callAddress.value()))) { return InterpretResult::ERROR; }
+
+        quicken(bytefile, info.has(OP_POLLS) ? Opcodes::CALL_lk_safe : Opcodes::CALL_lk);
+        return InterpretResult::CONTINUE;
+    }
+    case Opcodes::CALL_lk_safe:
+        if (interpreter.onSafepoint() != InterpretResult::CONTINUE) { return InterpretResult::INTERRUPTED; }
+        [[fallthrough]];
+    case Opcodes::CALL_lk: {
+        // The callee is decompressed and is a function, `CALL` has checked it. Only quickening writes
+        // this opcode, the loader rejects it
+        auto location    = bytefile.getNextUnsigned();
+        auto nArgs       = bytefile.getNextUnsigned();
+        auto callAddress = interpreter.onCall(location, nArgs, bytefile.ip);
+        if (!callAddress.has_value()) { return InterpretResult::ERROR; }
+
+        bytefile.ip = bytefile.bytecode.data() + callAddress.value();
         return InterpretResult::CONTINUE;
     }
     case Opcodes::TAG: {
-        auto name = bytefile.getNextString();
-        if (!name.has_value()) {
-            std::cerr << "could not retrieve a string\n";
+        recordFeedback<Profiled>(bytefile, interpreter);
+        auto tag = bytefile.getNextTagHash();
+        if (!tag.has_value()) {
+            std::cerr << "could not retrieve a tag\n";
             return InterpretResult::ERROR;
         }
         auto n = bytefile.getNextUnsigned();
-        return interpreter.onTag(name.value(), n);
+        // The tag is put right into the operand, it is unboxed as s-expressions keep it
+        auto unboxed = static_cast<u32>(UNBOX(tag.value()));
+        std::memcpy(bytefile.prevIP + sizeof(u32), &unboxed, sizeof(u32));
+        quicken(bytefile, Opcodes::TAG_hash);
+        return interpreter.onTag(tag.value(), n);
+    }
+    case Opcodes::TAG_hash: {
+        recordFeedback<Profiled>(bytefile, interpreter);
+        auto tag = bytefile.getNextUnsigned();
+        auto n   = bytefile.getNextUnsigned();
+        return interpreter.onTagUnboxed(tag, n);
     }
     case Opcodes::ARRAY: {
+        recordFeedback<Profiled>(bytefile, interpreter);
         auto size = bytefile.getNextUnsigned();
         return interpreter.onArray(size);
     }
@@ -229,9 +368,9 @@ auto interpretOne(Bytefile& bytefile, Interpreter& interpreter) -> InterpretResu
     case Opcodes::PATT_ref:
     case Opcodes::PATT_val:
     case Opcodes::PATT_fun: {
-        // SAFETY: this cast could happen only if we got
-        // into right opcode
-        auto type = static_cast<PatternType>(low);
+        recordFeedback<Profiled>(bytefile, interpreter);
+        // SAFETY: variant of these opcodes is the pattern, see `LAMA_OPCODES`
+        auto type = static_cast<PatternType>(info.variant);
         return interpreter.onPattern(type);
     }
     case Opcodes::CALL_Lread: {
@@ -250,47 +389,335 @@ auto interpretOne(Bytefile& bytefile, Interpreter& interpreter) -> InterpretResu
         auto arg = bytefile.getNextUnsigned();
         return interpreter.onCallBArray(arg);
     }
+    case Opcodes::LAZY: {
+        // Calls decompress their callees themselves, so only the entry point gets here
+        auto address = static_cast<u32>(bytefile.relAddr(bytefile.prevIP));
+        if (!bytefile.inflate(address)) { return InterpretResult::ERROR; }
+        bytefile.ip = bytefile.prevIP;
+        return InterpretResult::CONTINUE;
+    }
+    case Opcodes::TRAP: {
+        // The debugger executes the instruction under the breakpoint itself
+        bytefile.ip = bytefile.prevIP;
+        return InterpretResult::TRAP;
+    }
     default: {
         std::cerr << "unknown opcode " << static_cast<u32>(code) << '\n';
         return InterpretResult::ERROR;
     }
     }
 }
+
+template<bool Profiled>
+auto runLoop(Bytefile& bytefile, Interpreter& interpreter) -> InterpretResult {
+    InterpretResult result = InterpretResult::CONTINUE;
+    while ((result = interpretOne<Profiled>(bytefile, interpreter)) == InterpretResult::CONTINUE) {}
+    return result;
+}
+
+/**
+ * @brief Interpreter loop under `--debug`. Till a breakpoint or a step it is
+ * the plain loop, breakpoints stop it by themselves
+ */
+template<bool Profiled>
+auto runDebugLoop(Bytefile& bytefile, Interpreter& interpreter, Debugger& debugger) -> InterpretResult {
+    auto resume = debugger.stop(bytefile, interpreter, "entry");
+    while (resume != Debugger::Resume::Kill) {
+        auto result = debugger.executeOne(bytefile, [&] { return interpretOne<Profiled>(bytefile, interpreter); });
+        if (result == InterpretResult::CONTINUE && resume == Debugger::Resume::Continue) {
+            result = runLoop<Profiled>(bytefile, interpreter);
+        }
+
+        if (result == InterpretResult::TRAP || result == InterpretResult::CONTINUE) {
+            resume = debugger.stop(bytefile, interpreter, result == InterpretResult::TRAP ? "breakpoint" : "step");
+            continue;
+        }
+        debugger.exited(result);
+        return result;
+    }
+    interpreter.interruptWith(InterruptReason::Debugger);
+    return InterpretResult::INTERRUPTED;
+}
+
+/**
+ * @brief Interpreter loop under `--stats-shm`. Instructions and calls are counted in
+ * registers and published with the rest of the counters once in a period
+ */
+template<bool Profiled>
+auto runStatsLoop(Bytefile& bytefile, Interpreter& interpreter, SharedStats& stats) -> InterpretResult {
+    constexpr u64 PUBLISH_PERIOD = u64 {1} << 16;
+
+    u64 instructions = 0;
+    u64 calls        = 0;
+    while (true) {
+        for (u64 i = 1; i <= PUBLISH_PERIOD; ++i) {
+            // Every call ends up in a (C)BEGIN, the compiled tier that counts them differently is not allowed here
+            u8 code = bytefile.enoughBytes(sizeof(u32)) ? bytefile.peekNextCode() : 0;
+            if (code == to_underlying(Opcodes::BEGIN) || code == to_underlying(Opcodes::CBEGIN)) { ++calls; }
+
+            auto result = interpretOne<Profiled>(bytefile, interpreter);
+            if (result != InterpretResult::CONTINUE) {
+                stats.publish(bytefile, interpreter, instructions + i, calls);
+                stats.finish();
+                return result;
+            }
+        }
+        instructions += PUBLISH_PERIOD;
+        stats.publish(bytefile, interpreter, instructions, calls);
+    }
+}
+
+/**
+ * @brief Runs one Lama frame under `--perf-map`: callees are entered through their
+ * trampolines, so native stack has a frame per Lama function. Returns CONTINUE
+ * when the function of this frame returns
+ */
+template<bool Profiled>
+auto runPerfFrame(PerfContext* context) -> InterpretResult {
+    auto& [bytefile, interpreter, trampolines] = *context;
+    while (true) {
+        u8   code   = bytefile.enoughBytes(sizeof(u32)) ? bytefile.peekNextCode() : 0;
+        auto result = interpretOne<Profiled>(bytefile, interpreter);
+        if (result != InterpretResult::CONTINUE) { return result; }
+
+        switch (static_cast<Opcodes>(code)) {
+        case Opcodes::CALL:
+        case Opcodes::CALL_safe:
+        case Opcodes::CALL_lk:
+        case Opcodes::CALL_lk_safe:
+        case Opcodes::CALLC:
+        case Opcodes::CALLC_safe: {
+            // ip is on the `BEGIN` of callee already
+            auto* trampoline = trampolines.find(static_cast<u32>(bytefile.address()));
+            result           = trampoline ? trampoline(context) : runPerfFrame<Profiled>(context);
+            if (result != InterpretResult::CONTINUE) { return result; }
+            break;
+        }
+        case Opcodes::END:
+        case Opcodes::RET: return InterpretResult::CONTINUE;
+        default: break;
+        }
+    }
+}
+
+void reportLocation(Bytefile& bytefile) {
+    if (!bytefile.fileLine) {
+        std::cerr << "code without line info";
+    } else {
+        std::cerr << "file line " << bytefile.fileLine;
+    }
+    if (!bytefile.prevIP) {
+        std::cerr << " on very first opcode";
+    } else {
+        auto address = bytefile.relAddr(bytefile.prevIP);
+        std::cerr << "on 0x" << std::hex << address << std::dec << ": "
+                  << describeInstruction(bytefile.bytecode, address);
+    }
+}
 } // namespace
 
 // NOLINTNEXTLINE
 int main(int argc, char** argv) try {
-    if (argc != 2) {
-        std::cerr << "Wrong input, support only file to bytecode that will be interpreted\n";
+    auto possibleOptions = Options::parse(argc, argv);
+    if (std::holds_alternative<DiagnosticsBag>(possibleOptions)) {
+        auto errors = std::get<DiagnosticsBag>(std::move(possibleOptions));
+        for (auto&& e : errors) { std::cerr << "E " << e << '\n'; }
+        std::cerr << USAGE << '\n';
         return EXIT_FAILURE;
     }
-    const char* file             = argv[1];
-    auto        possibleBytefile = Bytefile::readBytefile(file);
+    auto options          = std::get<Options>(std::move(possibleOptions));
+    u64  loadStart        = monotonicNanos();
+    auto possibleBytefile = Bytefile::readBytefile(options.file);
     if (std::holds_alternative<DiagnosticsBag>(possibleBytefile)) {
         auto errors = std::get<DiagnosticsBag>(std::move(possibleBytefile));
         for (auto&& e : errors) { std::cerr << "E " << e << '\n'; }
         return EXIT_FAILURE;
     }
-    auto            bytefile = std::get<Bytefile>(std::move(possibleBytefile));
-    Interpreter     interpreter {bytefile.globalAreaSize};
-    InterpretResult result = InterpretResult::CONTINUE;
-    while ((result = interpretOne(bytefile, interpreter)) == InterpretResult::CONTINUE) {}
+    auto        bytefile = std::get<Bytefile>(std::move(possibleBytefile));
+    Interpreter interpreter {bytefile.globalAreaSize};
+    u64         analysisStart = monotonicNanos();
 
-    if (result == InterpretResult::ERROR) {
-        std::cerr << "E while trying to interpret ";
-        if (!bytefile.fileLine) {
-            std::cerr << "code without line info";
-        } else {
-            std::cerr << "file line " << bytefile.fileLine;
+    // Nothing is patched yet, so the digest is the same in every run
+    std::optional<Profile> profile;
+    if (options.profilePath) {
+        auto possibleProfile =
+            Profile::load(*options.profilePath, Profile::digestOf(bytefile.bytecode), bytefile.functions.size());
+        if (std::holds_alternative<DiagnosticsBag>(possibleProfile)) {
+            auto errors = std::get<DiagnosticsBag>(std::move(possibleProfile));
+            for (auto&& e : errors) { std::cerr << "E " << e << '\n'; }
+            return EXIT_FAILURE;
         }
-        if (!bytefile.prevIP) {
-            std::cerr << " on very first opcode";
-        } else {
-            std::cerr << "on 0x" << std::hex << bytefile.relAddr(bytefile.prevIP) << ": "
-                      << toString(Opcodes(*bytefile.prevIP));
+        profile = std::get<Profile>(std::move(possibleProfile));
+    }
+
+    // Breakpoints, counted entries and feedback sites are patched into the code, so it must be decompressed before
+    if (options.needsSafepoints() || options.timePhases || options.debugSocket || options.compileThreshold
+        || options.typeFeedbackPath) {
+        auto errors = bytefile.inflateAll();
+        // Decoding scan is what every analysis starts with, so it is timed even when nothing else needs it
+        if (errors.empty() && options.timePhases) {
+            errors = forEachInstruction(bytefile.bytecode, [](usize, usize) {});
         }
+        if (errors.empty() && options.needsSafepoints()) { errors = insertSafepoints(bytefile); }
+        for (auto&& e : errors) { std::cerr << "E " << e << '\n'; }
+        if (!errors.empty()) { return EXIT_FAILURE; }
+    }
+    std::optional<TypeFeedback> feedback;
+    if (options.typeFeedbackPath) {
+        feedback.emplace(bytefile);
+        interpreter.setTypeFeedback(&feedback.value());
+    }
+    std::optional<Tier> tier;
+    if (options.compileThreshold) {
+        tier.emplace(bytefile, feedback ? interpretOne<true> : interpretOne<false>, *options.compileThreshold,
+                     options.backgroundCompile);
+        interpreter.setTier(&tier.value());
+    }
+    if (profile) { profile->apply(tier ? &tier.value() : nullptr, feedback ? &feedback.value() : nullptr); }
+    if (options.asyncOutput) { programOutput.writeInBackground(); }
+    if (options.maxInstructions) { interpreter.setBudget(*options.maxInstructions); }
+    if (options.timeoutSeconds && !armTimeout(*options.timeoutSeconds)) {
+        std::cerr << "E cannot set up timeout: " << std::strerror(errno) << '\n';
+        return EXIT_FAILURE;
+    }
 
+    std::optional<HeapCensus> census;
+    if (options.heapCensus) {
+        if (!armCensusSignal()) {
+            std::cerr << "E cannot set up SIGUSR1 handler: " << std::strerror(errno) << '\n';
+            return EXIT_FAILURE;
+        }
+        census.emplace(bytefile);
+        interpreter.setHeapCensus(&census.value());
+    }
+
+    std::optional<HeapPolicy> heapPolicy;
+    if (options.sizesHeap()) {
+        heapPolicy.emplace(HeapSizing {
+            options.heapMinBytes.value_or(0),
+            options.heapMaxBytes,
+            options.heapGrowth.value_or(2.0),
+            options.gcTargetShare,
+        });
+        heapPolicy->start();
+        interpreter.setHeapPolicy(&heapPolicy.value());
+    }
+
+    std::optional<ProgramIo> io;
+    if (options.recordPath) {
+        io = ProgramIo::record(*options.recordPath);
+    } else if (options.replayPath) {
+        auto possibleIo = ProgramIo::replay(*options.replayPath);
+        if (std::holds_alternative<DiagnosticsBag>(possibleIo)) {
+            auto errors = std::get<DiagnosticsBag>(std::move(possibleIo));
+            for (auto&& e : errors) { std::cerr << "E " << e << '\n'; }
+            return EXIT_FAILURE;
+        }
+        io = std::get<ProgramIo>(std::move(possibleIo));
+    }
+    if (io) { interpreter.setIo(&io.value()); }
+
+    u64             executionStart = monotonicNanos();
+    InterpretResult result         = InterpretResult::CONTINUE;
+    if (options.perfMap) {
+        auto* runFrame            = feedback ? runPerfFrame<true> : runPerfFrame<false>;
+        auto  possibleTrampolines = PerfTrampolines::create(bytefile, runFrame);
+        if (std::holds_alternative<DiagnosticsBag>(possibleTrampolines)) {
+            auto errors = std::get<DiagnosticsBag>(std::move(possibleTrampolines));
+            for (auto&& e : errors) { std::cerr << "E " << e << '\n'; }
+            return EXIT_FAILURE;
+        }
+        auto        trampolines = std::get<PerfTrampolines>(std::move(possibleTrampolines));
+        PerfContext context {bytefile, interpreter, trampolines};
+
+        auto* entry = trampolines.find(static_cast<u32>(bytefile.address()));
+        result      = entry ? entry(&context) : runFrame(&context);
+    } else if (options.statsName) {
+        auto name = options.statsName->empty() ? defaultStatsName(static_cast<u32>(getpid())) : *options.statsName;
+        auto possibleStats = SharedStats::create(name, bytefile);
+        if (std::holds_alternative<DiagnosticsBag>(possibleStats)) {
+            auto errors = std::get<DiagnosticsBag>(std::move(possibleStats));
+            for (auto&& e : errors) { std::cerr << "E " << e << '\n'; }
+            return EXIT_FAILURE;
+        }
+        auto stats = std::get<SharedStats>(std::move(possibleStats));
+        result     = feedback ? runStatsLoop<true>(bytefile, interpreter, stats)
+                              : runStatsLoop<false>(bytefile, interpreter, stats);
+    } else if (options.debugSocket) {
+        auto possibleDebugger = Debugger::attach(*options.debugSocket);
+        if (std::holds_alternative<DiagnosticsBag>(possibleDebugger)) {
+            auto errors = std::get<DiagnosticsBag>(std::move(possibleDebugger));
+            for (auto&& e : errors) { std::cerr << "E " << e << '\n'; }
+            return EXIT_FAILURE;
+        }
+        auto debugger = std::get<Debugger>(std::move(possibleDebugger));
+        result        = feedback ? runDebugLoop<true>(bytefile, interpreter, debugger)
+                                 : runDebugLoop<false>(bytefile, interpreter, debugger);
+    } else {
+        result = feedback ? runLoop<true>(bytefile, interpreter) : runLoop<false>(bytefile, interpreter);
+    }
+    programOutput.flush();
+    if (options.timePhases) {
+        u64 end = monotonicNanos();
+        std::cerr << "load_us=" << (analysisStart - loadStart) / 1000 << " analysis_us="
+                  << (executionStart - analysisStart) / 1000 << " execution_us=" << (end - executionStart) / 1000;
+        // `lama-startup` passes the moment it has called `execve`, the clock is the same for every process
+        if (const char* execNanos = std::getenv("LAMA_EXEC_NS")) {
+            std::cerr << " startup_us=" << (executionStart - std::strtoull(execNanos, nullptr, 10)) / 1000;
+        }
+        if (tier) {
+            std::cerr << " compiled=" << tier->compiledCount() << " osr_entries=" << tier->osrEntryCount()
+                      << " deoptimizations=" << tier->deoptimizationCount();
+        }
+        std::cerr << '\n';
+    }
+    interpreter.reportHeap("exit");
+    if (feedback && options.typeFeedbackPath->empty()) {
+        feedback->dump(std::cerr);
+    } else if (feedback) {
+        std::ofstream out(*options.typeFeedbackPath);
+        feedback->dump(out);
+        if (!out.flush()) {
+            std::cerr << "E cannot write type feedback to " << *options.typeFeedbackPath << ": " << std::strerror(errno)
+                      << '\n';
+        }
+    }
+    if (profile) {
+        profile->update(tier ? &tier.value() : nullptr, feedback ? &feedback.value() : nullptr);
+        for (auto&& e : profile->save(*options.profilePath)) { std::cerr << "E " << e << '\n'; }
+    }
+
+    if (io) {
+        auto errors = io->finish();
+        for (auto&& e : errors) { std::cerr << "E " << e << '\n'; }
+        if (!errors.empty()) { return EXIT_FAILURE; }
+    }
+
+    // Breakpoint could be hit only with the debugger, otherwise it's in the file
+    if (result == InterpretResult::ERROR || result == InterpretResult::TRAP) {
+        std::cerr << "E while trying to interpret ";
+        reportLocation(bytefile);
+        std::cerr << std::endl;
+    }
+
+    if (result == InterpretResult::INTERRUPTED) {
+        switch (interpreter.interruptReason()) {
+        case InterruptReason::Budget:
+            std::cerr << "E instruction budget of " << *options.maxInstructions << " is exhausted ";
+            break;
+        case InterruptReason::Timeout:
+            std::cerr << "E timeout of " << *options.timeoutSeconds << " seconds is exceeded ";
+            break;
+        case InterruptReason::HeapLimit:
+            std::cerr << "E heap of " << gcCounters.heapBytes << " bytes exceeds the limit of " << *options.heapMaxBytes
+                      << " bytes ";
+            break;
+        case InterruptReason::Debugger: std::cerr << "E killed by the debugger "; break;
+        case InterruptReason::None: break;
+        }
+        reportLocation(bytefile);
         std::cerr << std::endl;
+        return EXIT_FAILURE;
     }
 
 } catch (std::exception& e) {
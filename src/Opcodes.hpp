@@ -7,79 +7,141 @@
 #pragma once
 
 #include "Types.hpp"
+#include "Utils.hpp"
+
+#include <array>
 #include <string_view>
 
-// FIXME: Maybe we need to change the names of Opcodes?
+// Every opcode of the interpreter with everything that is known about it statically.
+// The enum, `toString`, the length computation, the checks of the decoder and the
+// safepoint placement are all derived from this table, so they cannot disagree
+//
+//   X(name, code, operand words, pops, pushes, flags, variant, polling variant)
+//
+// Operand words do not count closure arguments. Pops of calls and constructors
+// depend on operands, see `POPS_*`. Variant is what the low nibble used to mean:
+// `BinOp`, `VariableType`, `PatternType`, "not zero" of `CJMP` or "closure" of `BEGIN`.
+// Polling variant is the private opcode that `insertSafepoints` puts instead
 //
 // NOLINTBEGIN
+#define LAMA_OPCODES(X)                                                                                               \
+    X(BINOP_add,    0x01, 0, 2,                 1, OP_NONE,                                                0x1, 0)    \
+    X(BINOP_sub,    0x02, 0, 2,                 1, OP_NONE,                                                0x2, 0)    \
+    X(BINOP_mul,    0x03, 0, 2,                 1, OP_NONE,                                                0x3, 0)    \
+    X(BINOP_div,    0x04, 0, 2,                 1, OP_NONE,                                                0x4, 0)    \
+    X(BINOP_rem,    0x05, 0, 2,                 1, OP_NONE,                                                0x5, 0)    \
+    X(BINOP_lt,     0x06, 0, 2,                 1, OP_NONE,                                                0x6, 0)    \
+    X(BINOP_le,     0x07, 0, 2,                 1, OP_NONE,                                                0x7, 0)    \
+    X(BINOP_gt,     0x08, 0, 2,                 1, OP_NONE,                                                0x8, 0)    \
+    X(BINOP_ge,     0x09, 0, 2,                 1, OP_NONE,                                                0x9, 0)    \
+    X(BINOP_eq,     0x0A, 0, 2,                 1, OP_NONE,                                                0xA, 0)    \
+    X(BINOP_ne,     0x0B, 0, 2,                 1, OP_NONE,                                                0xB, 0)    \
+    X(BINOP_and,    0x0C, 0, 2,                 1, OP_NONE,                                                0xC, 0)    \
+    X(BINOP_or,     0x0D, 0, 2,                 1, OP_NONE,                                                0xD, 0)    \
+                                                                                                                      \
+    X(CONST,        0x10, 1, 0,                 1, OP_NONE,                                                0,   0)    \
+    X(STRING,       0x11, 1, 0,                 1, OP_ALLOCATES,                                           0,   0)    \
+    X(SEXP,         0x12, 2, POPS_OPERAND1,     1, OP_ALLOCATES,                                           0,   0)    \
+    X(STI,          0x13, 0, 2,                 1, OP_NONE,                                                0,   0)    \
+    X(STA,          0x14, 0, 3,                 1, OP_NONE,                                                0,   0)    \
+    X(JMP,          0x15, 1, 0,                 0, OP_BRANCHES | OP_NO_FALLTHROUGH | OP_TARGET,            0,   0x82) \
+    X(END,          0x16, 0, 1,                 0, OP_RETURNS | OP_NO_FALLTHROUGH,                         0,   0)    \
+    X(RET,          0x17, 0, 1,                 0, OP_RETURNS | OP_NO_FALLTHROUGH,                         0,   0)    \
+    X(DROP,         0x18, 0, 1,                 0, OP_NONE,                                                0,   0)    \
+    X(DUP,          0x19, 0, 1,                 2, OP_NONE,                                                0,   0)    \
+    X(SWAP,         0x1A, 0, 2,                 2, OP_NONE,                                                0,   0)    \
+    X(ELEM,         0x1B, 0, 2,                 1, OP_NONE,                                                0,   0)    \
+                                                                                                                      \
+    X(LD_G,         0x20, 1, 0,                 1, OP_NONE,                                                0x0, 0)    \
+    X(LD_L,         0x21, 1, 0,                 1, OP_NONE,                                                0x1, 0)    \
+    X(LD_A,         0x22, 1, 0,                 1, OP_NONE,                                                0x2, 0)    \
+    X(LD_C,         0x23, 1, 0,                 1, OP_NONE,                                                0x3, 0)    \
+                                                                                                                      \
+    X(LDA_G,        0x30, 1, 0,                 2, OP_NONE,                                                0x0, 0)    \
+    X(LDA_L,        0x31, 1, 0,                 2, OP_NONE,                                                0x1, 0)    \
+    X(LDA_A,        0x32, 1, 0,                 2, OP_NONE,                                                0x2, 0)    \
+    X(LDA_C,        0x33, 1, 0,                 2, OP_NONE,                                                0x3, 0)    \
+                                                                                                                      \
+    X(ST_G,         0x40, 1, 1,                 1, OP_NONE,                                                0x0, 0)    \
+    X(ST_L,         0x41, 1, 1,                 1, OP_NONE,                                                0x1, 0)    \
+    X(ST_A,         0x42, 1, 1,                 1, OP_NONE,                                                0x2, 0)    \
+    X(ST_C,         0x43, 1, 1,                 1, OP_NONE,                                                0x3, 0)    \
+                                                                                                                      \
+    X(CJMPz,        0x50, 1, 1,                 0, OP_BRANCHES | OP_TARGET,                                0,   0x80) \
+    X(CJMPnz,       0x51, 1, 1,                 0, OP_BRANCHES | OP_TARGET,                                1,   0x81) \
+    X(BEGIN,        0x52, 2, 0,                 0, OP_NONE,                                                0,   0)    \
+    X(CBEGIN,       0x53, 2, 0,                 0, OP_NONE,                                                1,   0)    \
+    X(CLOSURE,      0x54, 2, 0,                 1, OP_ALLOCATES | OP_VARIABLE_LENGTH | OP_TARGET,          0,   0)    \
+    X(CALLC,        0x55, 1, POPS_CLOSURE_CALL, 1, OP_CALLS,                                               0,   0x85) \
+    X(CALL,         0x56, 2, POPS_OPERAND1,     1, OP_CALLS | OP_TARGET,                                   0,   0x86) \
+    X(TAG,          0x57, 2, 1,                 1, OP_NONE,                                                0,   0)    \
+    X(ARRAY,        0x58, 1, 1,                 1, OP_NONE,                                                0,   0)    \
+    X(FAIL,         0x59, 2, 1,                 0, OP_NO_FALLTHROUGH,                                      0,   0)    \
+    X(LINE,         0x5A, 1, 0,                 0, OP_NONE,                                                0,   0)    \
+                                                                                                                      \
+    X(PATT_str,     0x60, 0, 2,                 1, OP_NONE,                                                0x0, 0)    \
+    X(PATT_string,  0x61, 0, 1,                 1, OP_NONE,                                                0x1, 0)    \
+    X(PATT_array,   0x62, 0, 1,                 1, OP_NONE,                                                0x2, 0)    \
+    X(PATT_sexp,    0x63, 0, 1,                 1, OP_NONE,                                                0x3, 0)    \
+    X(PATT_ref,     0x64, 0, 1,                 1, OP_NONE,                                                0x4, 0)    \
+    X(PATT_val,     0x65, 0, 1,                 1, OP_NONE,                                                0x5, 0)    \
+    X(PATT_fun,     0x66, 0, 1,                 1, OP_NONE,                                                0x6, 0)    \
+                                                                                                                      \
+    X(CALL_Lread,   0x70, 0, 0,                 1, OP_NONE,                                                0,   0)    \
+    X(CALL_Lwrite,  0x71, 0, 1,                 1, OP_NONE,                                                0,   0)    \
+    X(CALL_Llength, 0x72, 0, 1,                 1, OP_NONE,                                                0,   0)    \
+    X(CALL_Lstring, 0x73, 0, 1,                 1, OP_ALLOCATES,                                           0,   0)    \
+    X(CALL_Barray,  0x74, 1, POPS_OPERAND0,     1, OP_ALLOCATES,                                           0,   0)    \
+                                                                                                                      \
+    /* Private opcodes, `lamac` never emits them. The interpreter rewrites */                                         \
+    /* its own copy of the bytecode with them, operands stay the same */                                              \
+    X(CJMPz_safe,   0x80, 1, 1,                 0, OP_BRANCHES | OP_POLLS | OP_TARGET,                     0,   0)    \
+    X(CJMPnz_safe,  0x81, 1, 1,                 0, OP_BRANCHES | OP_POLLS | OP_TARGET,                     1,   0)    \
+    X(JMP_safe,     0x82, 1, 0,                 0, OP_BRANCHES | OP_NO_FALLTHROUGH | OP_POLLS | OP_TARGET, 0,   0)    \
+    X(CALLC_safe,   0x85, 1, POPS_CLOSURE_CALL, 1, OP_CALLS | OP_POLLS,                                    0,   0)    \
+    X(CALL_safe,    0x86, 2, POPS_OPERAND1,     1, OP_CALLS | OP_POLLS | OP_TARGET,                        0,   0)    \
+    /* LAZY, int, int -- compressed function: its frame and length in bytes */                                        \
+    X(LAZY,         0x87, 2, 0,                 0, OP_VARIABLE_LENGTH | OP_NO_FALLTHROUGH,                 0,   0)    \
+    /* TRAP -- breakpoint, the debugger keeps the opcode it has replaced */                                           \
+    X(TRAP,         0x88, 0, 0,                 0, OP_NONE,                                                0,   0)    \
+    /* (C)BEGIN that counts calls for the compiled tier, the reserved bytes keep the function index */                \
+    X(BEGIN_cnt,    0x89, 2, 0,                 0, OP_NONE,                                                0,   0)    \
+    X(CBEGIN_cnt,   0x8A, 2, 0,                 0, OP_NONE,                                                1,   0)    \
+    /* Back edges that count iterations for on-stack replacement, the reserved bytes keep the loop index */           \
+    X(CJMPz_osr,    0x8B, 1, 1,                 0, OP_BRANCHES | OP_POLLS | OP_TARGET,                     0,   0)    \
+    X(CJMPnz_osr,   0x8C, 1, 1,                 0, OP_BRANCHES | OP_POLLS | OP_TARGET,                     1,   0)    \
+    X(JMP_osr,      0x8D, 1, 0,                 0, OP_BRANCHES | OP_NO_FALLTHROUGH | OP_POLLS | OP_TARGET, 0,   0)    \
+    /* Quickened instructions, the generic ones rewrite themselves after the first execution */                       \
+    /* STRING_len, int -- the reserved bytes keep the length of the string */                                         \
+    X(STRING_len,   0x8E, 1, 0,                 1, OP_ALLOCATES,                                           0,   0)    \
+    /* TAG_hash, int, int -- the tag itself instead of its index in the tag table */                                  \
+    X(TAG_hash,     0x8F, 2, 1,                 1, OP_NONE,                                                0,   0)    \
+    /* ELEM_arr -- ELEM of an array, it turns back into ELEM when it meets anything else */                           \
+    X(ELEM_arr,     0x90, 0, 2,                 1, OP_NONE,                                                0,   0)    \
+    /* CALL that has found the BEGIN of the callee already */                                                         \
+    X(CALL_lk,      0x91, 2, POPS_OPERAND1,     1, OP_CALLS | OP_TARGET,                                   0,   0)    \
+    X(CALL_lk_safe, 0x92, 2, POPS_OPERAND1,     1, OP_CALLS | OP_POLLS | OP_TARGET,                        0,   0)
+
+// What an instruction may do besides the stack effect
+constexpr u8 OP_NONE            = 0;
+constexpr u8 OP_ALLOCATES       = 1U << 0; // may start a collection
+constexpr u8 OP_BRANCHES        = 1U << 1; // jumps to operand 0
+constexpr u8 OP_CALLS           = 1U << 2;
+constexpr u8 OP_RETURNS         = 1U << 3;
+constexpr u8 OP_NO_FALLTHROUGH  = 1U << 4; // the next instruction is not executed after it
+constexpr u8 OP_VARIABLE_LENGTH = 1U << 5; // length depends on operands
+constexpr u8 OP_POLLS           = 1U << 6; // a safepoint
+constexpr u8 OP_TARGET          = 1U << 7; // operand 0 is a code address
+
+// Pops that are not constant
+constexpr u8 POPS_OPERAND0     = 0xF0; // operand 0 values
+constexpr u8 POPS_OPERAND1     = 0xF1; // operand 1 values
+constexpr u8 POPS_CLOSURE_CALL = 0xF2; // operand 0 arguments and the closure below them
+
 enum class Opcodes : u8 {
-    BINOP_add = 0x01, // BINOP +
-    BINOP_sub = 0x02, // BINOP -
-    BINOP_mul = 0x03, // BINOP *
-    BINOP_div = 0x04, // BINOP /
-    BINOP_rem = 0x05, // BINOP %
-    BINOP_lt  = 0x06, // BINOP <
-    BINOP_le  = 0x07, // BINOP <=
-    BINOP_gt  = 0x08, // BINOP >
-    BINOP_ge  = 0x09, // BINOP >=
-    BINOP_eq  = 0x0A, // BINOP ==
-    BINOP_ne  = 0x0B, // BINOP !=
-    BINOP_and = 0x0C, // BINOP &&
-    BINOP_or  = 0x0D, // BINOP ||
-
-    CONST  = 0x10, // CONST, int
-    STRING = 0x11, // STRING, string
-    SEXP   = 0x12, // SEXP, string, int
-    STI    = 0x13, // STI
-    STA    = 0x14, // STA
-    JMP    = 0x15, // JMP, int
-    END    = 0x16, // END
-    RET    = 0x17, // RET
-    DROP   = 0x18, // DROP
-    DUP    = 0x19, // DUP
-    SWAP   = 0x1A, // SWAP
-    ELEM   = 0x1B, // ELEM
-
-    LD_G = 0x20, // LD, G(int)
-    LD_L = 0x21, // LD, L(int)
-    LD_A = 0x22, // LD, A(int)
-    LD_C = 0x23, // LD, C(int)
-
-    LDA_G = 0x30, // LDA, G(int)
-    LDA_L = 0x31, // LDA, L(int)
-    LDA_A = 0x32, // LDA, A(int)
-    LDA_C = 0x33, // LDA, C(int)
-
-    ST_G = 0x40, // ST, G(int)
-    ST_L = 0x41, // ST, L(int)
-    ST_A = 0x42, // ST, A(int)
-    ST_C = 0x43, // ST, C(int)
-
-    CJMPz   = 0x50, // CJMPz, int
-    CJMPnz  = 0x51, // CJMPnz, int
-    BEGIN   = 0x52, // BEGIN, int, int
-    CBEGIN  = 0x53, // CBEGIN, int, int
-    CLOSURE = 0x54, // CLOSURE, int, n: int, [byte, int][n]
-    CALLC   = 0x55, // CALLC, int
-    CALL    = 0x56, // CALL, int, int
-    TAG     = 0x57, // TAG, string, int
-    ARRAY   = 0x58, // ARRAY, int
-    FAIL    = 0x59, // FAIL, int, int
-    LINE    = 0x5A, // LINE, int
-
-    PATT_str    = 0x60, // PATT =str
-    PATT_string = 0x61, // PATT #string
-    PATT_array  = 0x62, // PATT #array
-    PATT_sexp   = 0x63, // PATT #sexp
-    PATT_ref    = 0x64, // PATT #ref
-    PATT_val    = 0x65, // PATT #val
-    PATT_fun    = 0x66, // PATT #fun
-
-    CALL_Lread   = 0x70, // CALL Lread
-    CALL_Lwrite  = 0x71, // CALL Lwrite
-    CALL_Llength = 0x72, // CALL Llength
-    CALL_Lstring = 0x73, // CALL Lstring
-    CALL_Barray  = 0x74, // CALL Barray, int
+#define LAMA_OPCODE_ENUM(name, code, ...) name = code,
+    LAMA_OPCODES(LAMA_OPCODE_ENUM)
+#undef LAMA_OPCODE_ENUM
 };
 // NOLINTEND
 
@@ -128,73 +190,80 @@ enum class PatternType : u8 {
     Closure = 0x6, // #fun
 };
 
-inline auto toString(Opcodes op) -> std::string_view {
-#define toStr(op) \
-    case Opcodes::op: return #op
-    switch (op) {
-        toStr(BINOP_add);
-        toStr(BINOP_sub);
-        toStr(BINOP_mul);
-        toStr(BINOP_div);
-        toStr(BINOP_rem);
-        toStr(BINOP_lt);
-        toStr(BINOP_le);
-        toStr(BINOP_gt);
-        toStr(BINOP_ge);
-        toStr(BINOP_eq);
-        toStr(BINOP_ne);
-        toStr(BINOP_and);
-        toStr(BINOP_or);
-        toStr(CONST);
-        toStr(STRING);
-        toStr(SEXP);
-        toStr(STI);
-        toStr(STA);
-        toStr(JMP);
-        toStr(END);
-        toStr(RET);
-        toStr(DROP);
-        toStr(DUP);
-        toStr(SWAP);
-        toStr(ELEM);
-        toStr(LD_G);
-        toStr(LD_L);
-        toStr(LD_A);
-        toStr(LD_C);
-        toStr(LDA_G);
-        toStr(LDA_L);
-        toStr(LDA_A);
-        toStr(LDA_C);
-        toStr(ST_G);
-        toStr(ST_L);
-        toStr(ST_A);
-        toStr(ST_C);
-        toStr(CJMPz);
-        toStr(CJMPnz);
-        toStr(BEGIN);
-        toStr(CBEGIN);
-        toStr(CLOSURE);
-        toStr(CALLC);
-        toStr(CALL);
-        toStr(TAG);
-        toStr(ARRAY);
-        toStr(FAIL);
-        toStr(LINE);
-        toStr(PATT_str);
-        toStr(PATT_string);
-        toStr(PATT_array);
-        toStr(PATT_sexp);
-        toStr(PATT_ref);
-        toStr(PATT_val);
-        toStr(PATT_fun);
-        toStr(CALL_Lread);
-        toStr(CALL_Lwrite);
-        toStr(CALL_Llength);
-        toStr(CALL_Lstring);
-        toStr(CALL_Barray);
-
-    default: return "UNKNOWN_OPCODE";
+/**
+ * @brief Static description of an opcode, see `LAMA_OPCODES`
+ */
+struct OpcodeInfo {
+    std::string_view name;
+    u8               operands = 0; // words, closure arguments are not counted
+    u8               pops     = 0; // or one of `POPS_*`
+    u8               pushes   = 0;
+    u8               flags    = OP_NONE;
+    u8               variant  = 0;
+    u8               polling  = 0; // opcode to use at safepoints, 0 if there is none
+    bool             known    = false;
+
+    [[nodiscard]]
+    constexpr auto has(u8 flag) const noexcept -> bool {
+        return (flags & flag) != 0;
     }
 
-#undef toStr
+    /**
+     * @brief length of v2 instruction in bytes, closure arguments and lazy range are not counted
+     */
+    [[nodiscard]]
+    constexpr auto length() const noexcept -> u32 {
+        return (1U + operands) * sizeof(u32);
+    }
+
+    /**
+     * @brief Number of values taken from the stack, given the operands of the instruction
+     */
+    [[nodiscard]]
+    constexpr auto popsWith(u32 operand0, u32 operand1) const noexcept -> u32 {
+        switch (pops) {
+        case POPS_OPERAND0: return operand0;
+        case POPS_OPERAND1: return operand1;
+        case POPS_CLOSURE_CALL: return operand0 + 1;
+        default: return pops;
+        }
+    }
+};
+
+/**
+ * @brief Every byte value, unknown opcodes have `known` unset
+ */
+inline constexpr std::array<OpcodeInfo, 256> OPCODES = [] {
+    std::array<OpcodeInfo, 256> table {};
+#define LAMA_OPCODE_INFO(opName, code, operandWords, popCount, pushCount, opFlags, opVariant, opPolling) \
+    table[code] = {#opName, operandWords, popCount, pushCount, opFlags, opVariant, opPolling, true};
+    LAMA_OPCODES(LAMA_OPCODE_INFO)
+#undef LAMA_OPCODE_INFO
+    return table;
+}();
+
+constexpr auto opcodeInfo(u8 code) noexcept -> const OpcodeInfo& { return OPCODES[code]; }
+
+/**
+ * @brief checks whether only the interpreter may put the opcode into the code, see `LAMA_OPCODES`
+ */
+constexpr auto isPrivateOpcode(u8 code) noexcept -> bool { return code >= 0x80; }
+
+// The table is checked against itself: polling variants are the same instructions that poll
+static_assert([] {
+    for (const auto& info : OPCODES) {
+        if (!info.known || info.polling == 0) { continue; }
+        const auto& polling = OPCODES[info.polling];
+        if (!polling.known || !polling.has(OP_POLLS) || polling.operands != info.operands
+            || polling.pops != info.pops || polling.pushes != info.pushes || polling.variant != info.variant
+            || (polling.flags & ~OP_POLLS) != info.flags) {
+            return false;
+        }
+    }
+    return true;
+}());
+
+inline auto toString(Opcodes op) -> std::string_view {
+    const auto& info = opcodeInfo(to_underlying(op));
+    return info.known ? info.name : "UNKNOWN_OPCODE";
 }
@@ -0,0 +1,703 @@
+#include "Optimizer.hpp"
+
+#include "Analysis.hpp"
+#include "BytecodeFormat.hpp"
+#include "Opcodes.hpp"
+#include "Types.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <map>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace {
+
+constexpr usize WORD     = sizeof(u32);
+constexpr u32   NO_LABEL = std::numeric_limits<u32>::max();
+
+// Lama integers are boxed, so only 31 bits of them are left
+constexpr i64 LAMA_INT_MIN = -(i64 {1} << 30);
+constexpr i64 LAMA_INT_MAX = (i64 {1} << 30) - 1;
+
+constexpr usize MAX_UNROLLED_WORDS = 256; // every copy of the body together, only small loops are unrolled
+
+auto hex(usize value) -> std::string {
+    std::stringstream ss;
+    ss << "0x" << std::hex << value;
+    return ss.str();
+}
+
+struct Instruction {
+    u32              label; // targets refer to it, so instructions move freely
+    std::vector<u32> words; // the opcode word and operands, the target operand keeps a label
+
+    [[nodiscard]]
+    auto opcode() const noexcept -> Opcodes {
+        return static_cast<Opcodes>(words[0] & 0xFF);
+    }
+
+    [[nodiscard]]
+    auto info() const noexcept -> const OpcodeInfo& {
+        return opcodeInfo(static_cast<u8>(words[0] & 0xFF));
+    }
+
+    [[nodiscard]]
+    auto is(Opcodes code) const noexcept -> bool {
+        return opcode() == code;
+    }
+};
+
+struct Variable {
+    VariableType type;
+    u32          index;
+
+    auto operator<=>(const Variable&) const noexcept = default;
+};
+
+/**
+ * @brief Variable of `LD`, `LDA` and `ST` of any kind
+ */
+auto variableOf(const Instruction& instruction) -> Variable {
+    return {static_cast<VariableType>(instruction.info().variant), instruction.words[1]};
+}
+
+/**
+ * @brief Variable of `LD`, `LDA` and `ST` of locals and arguments. Globals and
+ * captured variables are changed by calls behind the back of the loop
+ */
+auto frameVariable(const Instruction& instruction) -> std::optional<Variable> {
+    switch (instruction.opcode()) {
+    case Opcodes::LD_L:
+    case Opcodes::LD_A:
+    case Opcodes::LDA_L:
+    case Opcodes::LDA_A:
+    case Opcodes::ST_L:
+    case Opcodes::ST_A:
+        return Variable {static_cast<VariableType>(instruction.info().variant), instruction.words[1]};
+    default: return std::nullopt;
+    }
+}
+
+/**
+ * @brief checks whether the instruction may change the variable: stores to it
+ * and takes its address for `STA`
+ */
+auto writes(const Instruction& instruction, const Variable& variable) -> bool {
+    if (!instruction.is(Opcodes::ST_L) && !instruction.is(Opcodes::ST_A) && !instruction.is(Opcodes::LDA_L)
+        && !instruction.is(Opcodes::LDA_A)) {
+        return false;
+    }
+    return frameVariable(instruction) == variable;
+}
+
+/**
+ * @brief Decoded code of v2 image, with everything that points into it
+ */
+struct Program {
+    std::vector<Instruction>   code; // the end of the code marker is the last one
+    std::vector<FunctionEntry> functions; // entry and end are labels
+    std::vector<u32>           symbols;   // label of every public symbol
+    u32                        labels = 0;
+
+    auto newLabel() -> u32 { return labels++; }
+
+    auto make(Opcodes opcode, std::initializer_list<u32> operands) -> Instruction {
+        Instruction result {newLabel(), {to_underlying(opcode)}};
+        result.words.insert(result.words.end(), operands);
+        return result;
+    }
+
+    /**
+     * @brief Index of every instruction by its label, `NO_LABEL` for labels that are not in the code anymore
+     */
+    [[nodiscard]]
+    auto positions() const -> std::vector<u32> {
+        std::vector<u32> result(labels, NO_LABEL);
+        for (usize i = 0; i < code.size(); ++i) { result[code[i].label] = static_cast<u32>(i); }
+        return result;
+    }
+};
+
+auto decode(std::span<const u32> image, const BytecodeHeaderV2& header, const SectionsV2& sections)
+    -> std::variant<DiagnosticsBag, Program> {
+    std::span<const u8> code {reinterpret_cast<const u8*>(image.data() + sections.code), header.codeSize}; // NOLINT
+    Program             program;
+    std::vector<u32>    labelAt(code.size() / WORD + 1, NO_LABEL);
+
+    usize end    = 0;
+    auto  errors = forEachInstruction(code, [&](usize offset, usize length) {
+        labelAt[offset / WORD] = program.newLabel();
+        program.code.push_back({labelAt[offset / WORD], {}});
+        program.code.back().words.resize(length / WORD);
+        std::memcpy(program.code.back().words.data(), code.data() + offset, length);
+        end = offset + length;
+    });
+    if (!errors.empty()) { return errors; }
+    if (end + WORD > code.size()) { return DiagnosticsBag {"no end of the code marker"}; }
+    labelAt[end / WORD] = program.newLabel();
+    program.code.push_back({labelAt[end / WORD], {code[end]}});
+
+    auto labelOf = [&](u32 address) {
+        return address % WORD == 0 && address <= end ? labelAt[address / WORD] : NO_LABEL;
+    };
+
+    usize offset = 0;
+    for (auto& instruction : program.code) {
+        if (instruction.is(Opcodes::LAZY)) { return DiagnosticsBag {"compressed image cannot be optimized"}; }
+        if (instruction.info().has(OP_TARGET)) {
+            auto target = labelOf(instruction.words[1]);
+            if (target == NO_LABEL) {
+                errors.emplace_back("target " + hex(instruction.words[1]) + " of instruction at " + hex(offset)
+                                    + " is not the beginning of an instruction");
+            }
+            instruction.words[1] = target;
+        }
+        offset += instruction.words.size() * WORD;
+    }
+
+    for (u32 i = 0; i < header.functionsNumber; ++i) {
+        FunctionEntry function;
+        std::memcpy(&function, image.data() + sections.functions + i * (sizeof(FunctionEntry) / WORD),
+                    sizeof(function));
+        auto entry = labelOf(function.entry);
+        auto last  = labelOf(function.end);
+        if (entry == NO_LABEL || last == NO_LABEL) {
+            errors.emplace_back("function at " + hex(function.entry) + " has wrong code range");
+        }
+        program.functions.push_back({entry, function.nArgs, function.nLocals, last});
+    }
+    for (u32 i = 0; i < header.publicSymbolsNumber; ++i) {
+        u32 address = image[sections.publicSymbols + 2 * i + 1];
+        program.symbols.push_back(labelOf(address));
+        if (program.symbols.back() == NO_LABEL) {
+            errors.emplace_back("public symbol " + std::to_string(i) + " points to " + hex(address)
+                                + ", it is not the beginning of an instruction");
+        }
+    }
+
+    if (!errors.empty()) { return errors; }
+    return program;
+}
+
+auto encode(const Program& program, std::span<const u32> image, BytecodeHeaderV2 header, const SectionsV2& sections)
+    -> std::vector<u32> {
+    std::vector<u32> addressOf(program.labels, 0);
+    u32              address = 0;
+    for (auto& instruction : program.code) {
+        addressOf[instruction.label]  = address;
+        address                      += static_cast<u32>(instruction.words.size() * WORD);
+    }
+    header.codeSize = address;
+
+    std::vector<u32> result(sizeof(header) / WORD);
+    std::memcpy(result.data(), &header, sizeof(header));
+    for (usize i = 0; i < program.symbols.size(); ++i) {
+        result.insert(result.end(), {image[sections.publicSymbols + 2 * i], addressOf[program.symbols[i]]});
+    }
+    for (auto& [entry, nArgs, nLocals, end] : program.functions) {
+        result.insert(result.end(), {addressOf[entry], nArgs, nLocals, addressOf[end]});
+    }
+    // Tags and strings do not point into the code
+    auto tables = image.subspan(sections.tags, sections.code - sections.tags);
+    result.insert(result.end(), tables.begin(), tables.end());
+
+    for (auto& instruction : program.code) {
+        auto start = result.size();
+        result.insert(result.end(), instruction.words.begin(), instruction.words.end());
+        if (instruction.info().has(OP_TARGET)) { result[start + 1] = addressOf[instruction.words[1]]; }
+    }
+    return result;
+}
+
+/**
+ * @brief Rotated counted loop, as `lamac` emits `while` and `for`:
+ *
+ *     JMP cond
+ *     body: ...
+ *           LD i, CONST step, BINOP_add, ST i, [DROP]
+ *     cond: LD i, CONST bound | LD bound, BINOP_lt | BINOP_le, CJMPnz body
+ *
+ * Indices are positions in the code, LINE instructions may be anywhere in between
+ */
+struct CountedLoop {
+    usize                   entry;     // JMP
+    usize                   body;      // the first instruction of the body
+    usize                   condition; // the first instruction of the condition
+    usize                   counterAt; // LD i of the condition
+    usize                   boundAt;   // CONST or LD of the bound
+    usize                   backEdge;  // CJMPnz
+    Variable                counter;
+    i32                     step;
+    Opcodes                 compare;
+    std::optional<Variable> bound; // not set for a constant
+};
+
+/**
+ * @brief Recognizes the counted loop that the instruction at `entry` enters
+ */
+auto countedLoopAt(const std::vector<Instruction>& code, const std::vector<u32>& positions, usize entry)
+    -> std::optional<CountedLoop> {
+    if (!code[entry].is(Opcodes::JMP)) { return std::nullopt; }
+
+    CountedLoop loop {};
+    loop.entry     = entry;
+    loop.body      = entry + 1;
+    loop.condition = positions[code[entry].words[1]];
+    if (loop.condition <= loop.body) { return std::nullopt; }
+
+    // Condition: the next four instructions that are not LINE
+    std::vector<usize> condition;
+    for (usize i = loop.condition; i < code.size() && condition.size() < 4; ++i) {
+        if (!code[i].is(Opcodes::LINE)) { condition.push_back(i); }
+    }
+    if (condition.size() < 4) { return std::nullopt; }
+    const auto& counter = code[condition[0]];
+    const auto& bound   = code[condition[1]];
+    const auto& compare = code[condition[2]];
+    const auto& jump    = code[condition[3]];
+    if ((!counter.is(Opcodes::LD_L) && !counter.is(Opcodes::LD_A))
+        || (!bound.is(Opcodes::CONST) && !bound.is(Opcodes::LD_L) && !bound.is(Opcodes::LD_A))
+        || (!compare.is(Opcodes::BINOP_lt) && !compare.is(Opcodes::BINOP_le)) || !jump.is(Opcodes::CJMPnz)
+        || jump.words[1] != code[loop.body].label) {
+        return std::nullopt;
+    }
+    loop.counterAt = condition[0];
+    loop.boundAt   = condition[1];
+    loop.backEdge  = condition[3];
+    loop.counter   = frameVariable(counter).value();
+    loop.compare   = compare.opcode();
+    loop.bound     = frameVariable(bound);
+    if (loop.bound == loop.counter) { return std::nullopt; }
+
+    // Increment: the last instructions of the body that are not LINE
+    std::vector<usize> increment;
+    for (usize i = loop.condition; i > loop.body && increment.size() < 5; --i) {
+        if (!code[i - 1].is(Opcodes::LINE)) { increment.push_back(i - 1); }
+    }
+    if (!increment.empty() && code[increment.front()].is(Opcodes::DROP)) { increment.erase(increment.begin()); }
+    if (increment.size() < 4) { return std::nullopt; }
+    const auto& store = code[increment[0]];
+    const auto& add   = code[increment[1]];
+    const auto& step  = code[increment[2]];
+    const auto& load  = code[increment[3]];
+    if ((!store.is(Opcodes::ST_L) && !store.is(Opcodes::ST_A)) || !add.is(Opcodes::BINOP_add)
+        || !step.is(Opcodes::CONST) || frameVariable(store) != loop.counter || frameVariable(load) != loop.counter
+        || load.is(Opcodes::LDA_L) || load.is(Opcodes::LDA_A)) {
+        return std::nullopt;
+    }
+    loop.step = static_cast<i32>(step.words[1]);
+    if (loop.step <= 0) { return std::nullopt; }
+
+    for (usize i = loop.body; i < loop.condition; ++i) {
+        const auto& instruction = code[i];
+        if (instruction.is(Opcodes::BEGIN) || instruction.is(Opcodes::CBEGIN)) { return std::nullopt; }
+        if (i != increment[0] && writes(instruction, loop.counter)) { return std::nullopt; }
+        if (loop.bound && writes(instruction, *loop.bound)) { return std::nullopt; }
+        if (!instruction.info().has(OP_BRANCHES)) { continue; }
+        // Forward jumps inside the body are copied with it, an inner loop is not unrolled
+        auto target = positions[instruction.words[1]];
+        if (target >= loop.body && target <= loop.backEdge && (target <= i || target >= loop.condition)) {
+            return std::nullopt;
+        }
+    }
+    for (usize i = loop.condition; i < loop.backEdge; ++i) {
+        if (code[i].info().has(OP_BRANCHES)) { return std::nullopt; }
+    }
+    // Nothing but the loop itself may jump into it
+    for (usize i = 0; i < code.size(); ++i) {
+        if ((i >= loop.entry && i <= loop.backEdge) || !code[i].info().has(OP_TARGET)) { continue; }
+        auto target = positions[code[i].words[1]];
+        if (target >= loop.body && target <= loop.backEdge) { return std::nullopt; }
+    }
+    return loop;
+}
+
+/**
+ * @brief Puts copies of the body before the loop, they run while every one of
+ * them would pass the condition:
+ *
+ *     [LD bound, CONST MIN + k, BINOP_lt, CJMPnz cond] -- `bound - k` would wrap
+ *     JMP check
+ *     copies: body ... body
+ *     check: LD i, CONST bound - k | LD bound, CONST k, BINOP_sub, BINOP_lt, CJMPnz copies
+ *     JMP cond -- the original loop runs the rest of the iterations
+ *
+ * where k is `(copies - 1) * step`. The first new instruction takes the label of
+ * the original `JMP`, so whatever has jumped to the loop enters the copies
+ */
+auto unrollLoops(Program& program, u32 factor) -> usize {
+    const auto&              code      = program.code;
+    auto                     positions = program.positions();
+    std::vector<Instruction> result;
+    usize                    unrolled = 0;
+
+    for (usize i = 0; i < code.size(); ++i) {
+        auto loop = countedLoopAt(code, positions, i);
+        if (!loop) {
+            result.push_back(code[i]);
+            continue;
+        }
+
+        usize bodyWords = 0;
+        for (usize j = loop->body; j < loop->condition; ++j) { bodyWords += code[j].words.size(); }
+        auto copies = std::min<usize>(factor, MAX_UNROLLED_WORDS / bodyWords);
+        i64  ahead  = static_cast<i64>(copies - 1) * loop->step;
+        i64  limit  = loop->bound ? 0 : static_cast<i32>(code[loop->boundAt].words[1]) - ahead;
+        if (copies < 2 || ahead > LAMA_INT_MAX || limit < LAMA_INT_MIN) {
+            result.push_back(code[i]);
+            continue;
+        }
+
+        auto first = result.size();
+        auto check = program.newLabel();
+        if (loop->bound) {
+            result.push_back({program.newLabel(), code[loop->boundAt].words});
+            result.push_back(program.make(Opcodes::CONST, {static_cast<u32>(static_cast<i32>(LAMA_INT_MIN + ahead))}));
+            result.push_back(program.make(Opcodes::BINOP_lt, {}));
+            result.push_back(program.make(Opcodes::CJMPnz, {code[i].words[1]}));
+        }
+        result.push_back(program.make(Opcodes::JMP, {check}));
+
+        u32 copiesStart = NO_LABEL;
+        for (usize copy = 0; copy < copies; ++copy) {
+            std::unordered_map<u32, u32> renamed;
+            for (usize j = loop->body; j < loop->condition; ++j) { renamed.emplace(code[j].label, program.newLabel()); }
+            if (copy == 0) { copiesStart = renamed[code[loop->body].label]; }
+
+            for (usize j = loop->body; j < loop->condition; ++j) {
+                auto& instruction = result.emplace_back(code[j]);
+                instruction.label = renamed[code[j].label];
+                if (!instruction.info().has(OP_BRANCHES)) { continue; }
+                if (auto target = renamed.find(instruction.words[1]); target != renamed.end()) {
+                    instruction.words[1] = target->second;
+                }
+            }
+        }
+
+        result.push_back({check, code[loop->counterAt].words});
+        if (loop->bound) {
+            result.push_back({program.newLabel(), code[loop->boundAt].words});
+            result.push_back(program.make(Opcodes::CONST, {static_cast<u32>(static_cast<i32>(ahead))}));
+            result.push_back(program.make(Opcodes::BINOP_sub, {}));
+        } else {
+            result.push_back(program.make(Opcodes::CONST, {static_cast<u32>(static_cast<i32>(limit))}));
+        }
+        result.push_back(program.make(loop->compare, {}));
+        result.push_back(program.make(Opcodes::CJMPnz, {copiesStart}));
+
+        auto& entry = result.emplace_back(code[i]);
+        std::swap(entry.label, result[first].label);
+        ++unrolled;
+    }
+    program.code = std::move(result);
+    return unrolled;
+}
+
+/**
+ * @brief State of local value numbering, it is dropped at the beginning of every block
+ */
+struct BlockValues {
+    static constexpr u32   NO_TEMP  = std::numeric_limits<u32>::max();
+    static constexpr usize NO_START = std::numeric_limits<usize>::max();
+
+    // Value on the stack and where the instructions that compute it start
+    struct Slot {
+        u32   value;
+        usize start; // `NO_START` if it is computed in another block or by something impure
+    };
+
+    // Operation and value numbers of its operands, with the state of memory for `ELEM`
+    using Expression = std::array<u32, 4>;
+
+    struct Available {
+        u32   value;
+        usize definer; // the instruction that has computed it
+        u32   temp = NO_TEMP;
+    };
+
+    std::vector<Slot>               stack;
+    std::map<Variable, u32>         variables;
+    std::map<i32, u32>              constants;
+    std::map<Expression, Available> expressions;
+    u32                             memory     = 0; // bumped by whatever may change arrays, strings and s-expressions
+    usize                           lastImpure = NO_START; // no pure computation spans it
+    u32                             temps      = 0;
+
+    auto pop(u32& values) -> Slot {
+        if (stack.empty()) { return {values++, NO_START}; }
+        auto slot = stack.back();
+        stack.pop_back();
+        return slot;
+    }
+};
+
+/**
+ * @brief Calls may change globals, captured variables and memory, stores
+ * through references may change any variable too
+ */
+void forget(BlockValues& block, const Instruction& instruction) {
+    switch (instruction.opcode()) {
+    case Opcodes::STA:
+    case Opcodes::STI:
+        ++block.memory;
+        block.variables.clear();
+        break;
+    case Opcodes::CALL:
+    case Opcodes::CALLC:
+        ++block.memory;
+        std::erase_if(block.variables, [](const auto& variable) {
+            return variable.first.type == VariableType::Global || variable.first.type == VariableType::Captured;
+        });
+        break;
+    default: break;
+    }
+}
+
+/**
+ * @brief Local value numbering: in a basic block, `ELEM`, `Llength` and binary
+ * operations that recompute a value already computed are replaced by a load of
+ * a temporary local. The first computation stores the value into it with `ST_L`,
+ * which leaves the stack as it is. A computation is replaced with its operands,
+ * so they must be pure loads and operations
+ */
+auto reuseValues(Program& program) -> usize {
+    const auto& code = program.code;
+
+    std::vector<bool> targeted(program.labels, false);
+    for (auto& instruction : code) {
+        if (instruction.info().has(OP_BRANCHES)) { targeted[instruction.words[1]] = true; }
+    }
+    std::unordered_map<u32, usize> functionAt; // entry label -> index in the function table
+    for (usize i = 0; i < program.functions.size(); ++i) { functionAt.emplace(program.functions[i].entry, i); }
+
+    std::vector<u32>     replacedBy(code.size(), BlockValues::NO_TEMP); // temp to load instead
+    std::vector<bool>    removed(code.size(), false);
+    std::vector<u32>     storeAfter(code.size(), BlockValues::NO_TEMP);
+    std::vector<u32>     temps(program.functions.size(), 0); // added locals of every function
+    std::optional<usize> function;
+    BlockValues          block;
+    u32                  values = 0;
+    usize                reused = 0;
+
+    for (usize i = 0; i < code.size(); ++i) {
+        const auto& instruction = code[i];
+        const auto& info        = instruction.info();
+        if (instruction.is(Opcodes::BEGIN) || instruction.is(Opcodes::CBEGIN)) {
+            auto entry = functionAt.find(instruction.label);
+            function   = entry == functionAt.end() ? std::nullopt : std::optional {entry->second};
+        }
+        bool starts = i == 0 || targeted[instruction.label] || instruction.is(Opcodes::BEGIN)
+                   || instruction.is(Opcodes::CBEGIN)
+                   || code[i - 1].info().flags & (OP_BRANCHES | OP_NO_FALLTHROUGH | OP_RETURNS);
+        if (starts) { block = {}; }
+
+        auto push = [&](u32 value, usize start) { block.stack.push_back({value, start}); };
+        switch (instruction.opcode()) {
+        case Opcodes::CONST: {
+            auto [constant, added] = block.constants.try_emplace(static_cast<i32>(instruction.words[1]), values);
+            if (added) { ++values; }
+            push(constant->second, i);
+            continue;
+        }
+        case Opcodes::LD_G:
+        case Opcodes::LD_L:
+        case Opcodes::LD_A:
+        case Opcodes::LD_C: {
+            auto [variable, added] = block.variables.try_emplace(variableOf(instruction), values);
+            if (added) { ++values; }
+            push(variable->second, i);
+            continue;
+        }
+        case Opcodes::ST_G:
+        case Opcodes::ST_L:
+        case Opcodes::ST_A:
+        case Opcodes::ST_C: {
+            auto value                               = block.pop(values).value;
+            block.variables[variableOf(instruction)] = value;
+            push(value, BlockValues::NO_START);
+            block.lastImpure = i;
+            continue;
+        }
+        default: break;
+        }
+
+        bool computes = instruction.is(Opcodes::ELEM) || instruction.is(Opcodes::CALL_Llength)
+                     || (instruction.opcode() >= Opcodes::BINOP_add && instruction.opcode() <= Opcodes::BINOP_or);
+        if (!computes) {
+            u32 pops = info.popsWith(info.operands > 0 ? instruction.words[1] : 0,
+                                     info.operands > 1 ? instruction.words[2] : 0);
+            for (u32 j = 0; j < pops; ++j) { block.pop(values); }
+            for (u32 j = 0; j < info.pushes; ++j) { push(values++, BlockValues::NO_START); }
+            forget(block, instruction);
+            block.lastImpure = i;
+            continue;
+        }
+
+        BlockValues::Expression expression {to_underlying(instruction.opcode()), 0, 0, 0};
+        usize                   start = i;
+        for (u32 j = info.pops; j > 0; --j) {
+            auto operand  = block.pop(values);
+            expression[j] = operand.value;
+            start         = operand.start;
+        }
+        if (instruction.is(Opcodes::ELEM)) { expression[3] = block.memory; }
+        bool pure  = start != BlockValues::NO_START
+               && (block.lastImpure == BlockValues::NO_START || start > block.lastImpure);
+
+        auto [available, added] = block.expressions.try_emplace(expression, BlockValues::Available {values, i});
+        if (added) {
+            ++values;
+            push(available->second.value, pure ? start : BlockValues::NO_START);
+            continue;
+        }
+        if (!pure || !function) {
+            push(available->second.value, BlockValues::NO_START);
+            continue;
+        }
+
+        auto& reuse = available->second;
+        if (reuse.temp == BlockValues::NO_TEMP) {
+            reuse.temp                = program.functions[*function].nLocals + block.temps++;
+            temps[*function]          = std::max(temps[*function], block.temps);
+            storeAfter[reuse.definer] = reuse.temp;
+        }
+        // Values reused inside of the operands are not needed anymore
+        for (usize j = start; j <= i; ++j) {
+            removed[j]    = true;
+            replacedBy[j] = BlockValues::NO_TEMP;
+        }
+        replacedBy[start] = reuse.temp;
+        push(reuse.value, start);
+        ++reused;
+    }
+    if (reused == 0) { return 0; }
+
+    std::vector<Instruction> result;
+    for (usize i = 0; i < code.size(); ++i) {
+        if (replacedBy[i] != BlockValues::NO_TEMP) {
+            result.push_back({code[i].label, {to_underlying(Opcodes::LD_L), replacedBy[i]}});
+            continue;
+        }
+        if (removed[i]) { continue; }
+        auto& instruction = result.emplace_back(code[i]);
+        auto  entry       = functionAt.find(instruction.label);
+        if (entry != functionAt.end()) { instruction.words[2] += temps[entry->second]; } // nLocals of `BEGIN`
+        if (storeAfter[i] != BlockValues::NO_TEMP) { result.push_back(program.make(Opcodes::ST_L, {storeAfter[i]})); }
+    }
+    for (usize i = 0; i < program.functions.size(); ++i) { program.functions[i].nLocals += temps[i]; }
+    program.code = std::move(result);
+    return reused;
+}
+
+/**
+ * @brief What the whole program does with a global
+ */
+struct GlobalUse {
+    std::optional<u32> value;                // the constant every store puts, if there is one
+    bool               varies       = false; // some store puts another value
+    bool               addressTaken = false; // `STA` may store to it
+    bool               initialized  = false; // stored at the start of `main` before any load
+    bool               loadedEarly  = false; // loaded at the start of `main` before that
+};
+
+/**
+ * @brief Replaces loads of a global by `CONST` when every store to it puts the
+ * same constant and one of them dominates every load. The program starts with
+ * the first instruction, so the code of `main` till its first branch, call or
+ * jump target runs before anything else: a store there that is not preceded by
+ * a load dominates the whole program
+ */
+auto promoteGlobals(Program& program) -> usize {
+    auto& code = program.code;
+
+    std::vector<bool> targeted(program.labels, false);
+    for (auto& instruction : code) {
+        if (instruction.info().has(OP_BRANCHES)) { targeted[instruction.words[1]] = true; }
+    }
+
+    std::unordered_map<u32, GlobalUse> globals;
+    bool                               start = true;
+    for (usize i = 0; i < code.size(); ++i) {
+        const auto& instruction = code[i];
+        // Recursive call of `main` runs the same stores again
+        if (i > 0 && targeted[instruction.label]) { start = false; }
+
+        switch (instruction.opcode()) {
+        case Opcodes::ST_G: {
+            auto& use = globals[instruction.words[1]];
+            // The instruction before a jump target is not the only one that may precede it
+            if (i > 0 && code[i - 1].is(Opcodes::CONST) && !targeted[instruction.label]) {
+                if (use.value && *use.value != code[i - 1].words[1]) { use.varies = true; }
+                use.value = code[i - 1].words[1];
+            } else {
+                use.varies = true;
+            }
+            if (start && !use.loadedEarly) { use.initialized = true; }
+            break;
+        }
+        case Opcodes::LD_G: {
+            auto& use = globals[instruction.words[1]];
+            if (start && !use.initialized) { use.loadedEarly = true; }
+            break;
+        }
+        case Opcodes::LDA_G: globals[instruction.words[1]].addressTaken = true; break;
+        default: break;
+        }
+        if (instruction.info().flags & (OP_BRANCHES | OP_NO_FALLTHROUGH | OP_RETURNS | OP_CALLS)) { start = false; }
+    }
+
+    usize promoted = 0;
+    for (auto& [index, use] : globals) {
+        if (!use.value || use.varies || use.addressTaken || !use.initialized || use.loadedEarly) {
+            use.value.reset();
+            continue;
+        }
+        ++promoted;
+    }
+    if (promoted == 0) { return 0; }
+
+    // Stores stay, the global keeps its value for whoever looks at it
+    for (auto& instruction : code) {
+        if (!instruction.is(Opcodes::LD_G)) { continue; }
+        auto& use = globals[instruction.words[1]];
+        if (use.value) { instruction.words = {to_underlying(Opcodes::CONST), *use.value}; }
+    }
+    return promoted;
+}
+
+} // namespace
+
+auto optimizeImage(std::span<const u32> image, const OptimizerOptions& options, OptimizerReport& report)
+    -> std::variant<DiagnosticsBag, std::vector<u32>> {
+    BytecodeHeaderV2 header;
+    if (image.size() * WORD < sizeof(header)) { return DiagnosticsBag {"v2 header is truncated"}; }
+    std::memcpy(&header, image.data(), sizeof(header));
+
+    auto sections = sectionsOf(header);
+    if (sections.end > image.size()) { return DiagnosticsBag {"v2 image is truncated"}; }
+
+    auto possibleProgram = decode(image, header, sections);
+    if (std::holds_alternative<DiagnosticsBag>(possibleProgram)) {
+        return std::get<DiagnosticsBag>(std::move(possibleProgram));
+    }
+    auto program = std::get<Program>(std::move(possibleProgram));
+
+    // Bounds of loops and operands of expressions become constants
+    if (options.promoteGlobals) { report.promotedGlobals += promoteGlobals(program); }
+    if (options.unrollFactor > 1) { report.unrolledLoops += unrollLoops(program, options.unrollFactor); }
+    // Copies of unrolled bodies make longer blocks, so values are numbered after them
+    if (options.reuseValues) { report.reusedValues += reuseValues(program); }
+
+    return encode(program, image, header, sections);
+}
@@ -0,0 +1,38 @@
+/**
+ * @file Optimizer.hpp
+ * @brief This file contains the bytecode optimizer of `lama-convert`. The code of
+ * a v2 image is decoded into a list of instructions whose targets are labels
+ * instead of addresses, passes rewrite the list, and it is encoded back with jump,
+ * call and closure targets, the function table and public symbols relocated
+ *
+ */
+#pragma once
+
+#include "Types.hpp"
+
+#include <span>
+#include <variant>
+#include <vector>
+
+struct OptimizerOptions {
+    u32  unrollFactor   = 1;     // copies of the body of a counted loop, 1 leaves loops as they are
+    bool reuseValues    = false; // eliminate computations repeated in a basic block
+    bool promoteGlobals = false; // load globals that are constant as constants
+};
+
+/**
+ * @brief What the passes have done
+ */
+struct OptimizerReport {
+    usize unrolledLoops   = 0;
+    usize reusedValues    = 0;
+    usize promotedGlobals = 0;
+};
+
+/**
+ * @brief Optimizes the code of v2 image, the image must not be compressed
+ *
+ * @return errors if the image is inconsistent or some target is not at the beginning of an instruction
+ */
+auto optimizeImage(std::span<const u32> image, const OptimizerOptions& options, OptimizerReport& report)
+    -> std::variant<DiagnosticsBag, std::vector<u32>>;
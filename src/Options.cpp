@@ -0,0 +1,189 @@
+#include "Options.hpp"
+
+#include "HeapPolicy.hpp"
+#include "Types.hpp"
+
+#include <array>
+#include <charconv>
+#include <cstdlib>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace {
+
+template<typename T>
+auto parseNumber(std::string_view text) -> std::optional<T> {
+    T    value {};
+    auto end = text.data() + text.size();
+
+    auto [ptr, ec] = std::from_chars(text.data(), end, value);
+    if (ec != std::errc {} || ptr != end) { return std::nullopt; }
+    return value;
+}
+
+/**
+ * @brief Bytes with an optional binary suffix: K, M or G
+ */
+auto parseSize(std::string_view text) -> std::optional<usize> {
+    usize shift = 0;
+    if (!text.empty()) {
+        switch (text.back()) {
+        case 'K': shift = 10; break;
+        case 'M': shift = 20; break;
+        case 'G': shift = 30; break;
+        default: break;
+        }
+    }
+    if (shift) { text.remove_suffix(1); }
+
+    auto value = parseNumber<usize>(text);
+    if (!value || *value > (std::numeric_limits<usize>::max() >> shift)) { return std::nullopt; }
+    return *value << shift;
+}
+
+// `itimerval` keeps seconds in `time_t`, which is 32-bit for the interpreter. Three years is enough for anybody
+constexpr u32 MAX_TIMEOUT_SECONDS = 100'000'000;
+
+struct EnvironmentOption {
+    const char*      variable;
+    std::string_view option;
+};
+
+constexpr std::array HEAP_ENVIRONMENT {
+    EnvironmentOption {"LAMA_HEAP_MIN", "--heap-min"},
+    EnvironmentOption {"LAMA_HEAP_MAX", "--heap-max"},
+    EnvironmentOption {"LAMA_HEAP_GROWTH", "--heap-growth"},
+    EnvironmentOption {"LAMA_GC_TARGET", "--gc-target"},
+};
+
+} // namespace
+
+auto Options::parse(int argc, char** argv) -> std::variant<DiagnosticsBag, Options> {
+    Options        result;
+    DiagnosticsBag errors;
+
+    // Environment goes first, so the command line overrides it. Its errors name the variable, not the option
+    std::vector<std::string> environment;
+    std::vector<std::string> settings;
+    for (auto& [variable, option] : HEAP_ENVIRONMENT) {
+        if (const char* value = std::getenv(variable)) {
+            environment.push_back(std::string(option) + "=" + value);
+            settings.push_back(std::string(variable) + "=" + value);
+        }
+    }
+    std::vector<std::string_view> args(environment.begin(), environment.end());
+    args.insert(args.end(), argv + 1, argv + argc);
+
+    std::string_view heapMinSource = "--heap-min";
+    std::string_view heapMaxSource = "--heap-max";
+    for (usize i = 0; i < args.size(); ++i) {
+        auto arg     = args[i];
+        auto setting = i < settings.size() ? std::string_view(settings[i]) : arg;
+        if (!arg.starts_with("--")) {
+            if (result.file) { errors.emplace_back("more than one bytecode file given: " + std::string(arg)); }
+            result.file = arg.data(); // only the command line has got files, so it's null-terminated
+            continue;
+        }
+
+        auto separator = arg.find('=');
+        auto name      = arg.substr(0, separator);
+        auto value     = separator == std::string_view::npos ? std::string_view {} : arg.substr(separator + 1);
+
+        if (name == "--max-instructions") {
+            result.maxInstructions = parseNumber<u64>(value);
+            if (!result.maxInstructions) { errors.emplace_back("expected a number in " + std::string(arg)); }
+        } else if (name == "--timeout") {
+            result.timeoutSeconds = parseNumber<double>(value);
+            auto seconds          = result.timeoutSeconds.value_or(0);
+            // Written so that NaN is rejected too
+            if (!(seconds > 0 && seconds <= MAX_TIMEOUT_SECONDS)) {
+                errors.emplace_back("expected a positive amount of seconds up to " + std::to_string(MAX_TIMEOUT_SECONDS)
+                                    + " in " + std::string(arg));
+            }
+        } else if (arg == "--perf-map") {
+            result.perfMap = true;
+        } else if (name == "--stats-shm") {
+            // empty name means the default one, it depends on pid
+            result.statsName = std::string(value);
+            if (!value.empty() && value.front() != '/') {
+                errors.emplace_back("shared memory name must start with '/' in " + std::string(arg));
+            }
+        } else if (arg == "--heap-census") {
+            result.heapCensus = true;
+        } else if (name == "--heap-min" || name == "--heap-max") {
+            auto size = parseSize(value);
+            if (!size) { errors.emplace_back("expected a size in bytes, K, M or G in " + std::string(setting)); }
+            if (size && name == "--heap-min" && *size > MAX_HEAP_MIN) {
+                errors.emplace_back("expected a size up to 512M, the most the ballast holds, in "
+                                    + std::string(setting));
+            }
+            (name == "--heap-min" ? result.heapMinBytes : result.heapMaxBytes) = size;
+            (name == "--heap-min" ? heapMinSource : heapMaxSource) = setting.substr(0, setting.find('='));
+        } else if (name == "--heap-growth") {
+            result.heapGrowth = parseNumber<double>(value);
+            // Ballast could only add to the live data, and the collector doubles it anyway
+            if (!result.heapGrowth || *result.heapGrowth < 2) {
+                errors.emplace_back("expected a growth factor of at least 2 in " + std::string(setting));
+            }
+        } else if (name == "--gc-target") {
+            auto percent = parseNumber<double>(value);
+            if (!percent || *percent <= 0 || *percent >= 100) {
+                errors.emplace_back("expected a share of time between 0 and 100 percent in " + std::string(setting));
+            } else {
+                result.gcTargetShare = *percent / 100;
+            }
+        } else if (name == "--record" || name == "--replay") {
+            if (value.empty()) { errors.emplace_back("expected a file name in " + std::string(arg)); }
+            (name == "--record" ? result.recordPath : result.replayPath) = std::string(value);
+        } else if (name == "--debug") {
+            if (value.empty()) { errors.emplace_back("expected a socket path in " + std::string(arg)); }
+            result.debugSocket = std::string(value);
+        } else if (name == "--compile-threshold") {
+            result.compileThreshold = parseNumber<u32>(value);
+            if (!result.compileThreshold || *result.compileThreshold == 0) {
+                errors.emplace_back("expected a positive number of calls in " + std::string(arg));
+            }
+        } else if (arg == "--background-compile") {
+            result.backgroundCompile = true;
+        } else if (name == "--type-feedback") {
+            // empty name means stderr
+            result.typeFeedbackPath = std::string(value);
+        } else if (name == "--profile") {
+            if (value.empty()) { errors.emplace_back("expected a file name in " + std::string(arg)); }
+            result.profilePath = std::string(value);
+        } else if (arg == "--async-output") {
+            result.asyncOutput = true;
+        } else if (arg == "--time-phases") {
+            result.timePhases = true;
+        } else {
+            errors.emplace_back("unknown option " + std::string(arg));
+        }
+    }
+
+    if (!result.file) { errors.emplace_back("no bytecode file given"); }
+    if (result.perfMap && result.statsName) { errors.emplace_back("--perf-map and --stats-shm cannot be combined"); }
+    if (result.heapMinBytes && result.heapMaxBytes && *result.heapMinBytes > *result.heapMaxBytes) {
+        errors.emplace_back(std::string(heapMinSource) + " is bigger than " + std::string(heapMaxSource));
+    }
+    if (result.debugSocket && (result.perfMap || result.statsName)) {
+        errors.emplace_back("--debug cannot be combined with --perf-map or --stats-shm");
+    }
+    // Those run their own loops, which see every instruction
+    if (result.compileThreshold && (result.perfMap || result.statsName || result.debugSocket)) {
+        errors.emplace_back("--compile-threshold cannot be combined with --perf-map, --stats-shm or --debug");
+    }
+    if (result.backgroundCompile && !result.compileThreshold) {
+        errors.emplace_back("--background-compile is meaningful only with --compile-threshold");
+    }
+    if (result.profilePath && !result.compileThreshold && !result.typeFeedbackPath) {
+        errors.emplace_back("--profile is meaningful only with --compile-threshold or --type-feedback");
+    }
+    if (result.recordPath && result.replayPath) { errors.emplace_back("--record and --replay cannot be combined"); }
+
+    if (!errors.empty()) { return errors; }
+    return result;
+}
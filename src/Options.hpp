@@ -0,0 +1,71 @@
+/**
+ * @file Options.hpp
+ * @brief This file contains command line options of the interpreter
+ *
+ */
+#pragma once
+
+#include "Types.hpp"
+
+#include <optional>
+#include <string>
+#include <variant>
+
+/**
+ * @brief Options given to the interpreter in command line. Everything except
+ * bytecode file is optional
+ */
+struct Options {
+    const char* file = nullptr;
+
+    std::optional<u64>    maxInstructions; // budget charged on back edges and calls
+    std::optional<double> timeoutSeconds;  // wall-clock limit
+
+    bool perfMap = false; // enter every Lama function through its own native trampoline
+
+    std::optional<std::string> statsName; // shared memory segment for `lama-top`
+
+    bool heapCensus = false; // print live heap at exit and on SIGUSR1
+
+    std::optional<usize>  heapMinBytes;  // heap after a collection is never smaller, see `HeapPolicy`
+    std::optional<usize>  heapMaxBytes;  // stop the program when the heap outgrows it
+    std::optional<double> heapGrowth;    // heap size to live data after a collection
+    std::optional<double> gcTargetShare; // grow the heap while collections take more of the time
+
+    std::optional<std::string> recordPath; // save input and output digest
+    std::optional<std::string> replayPath; // feed recorded input and check the output
+
+    std::optional<std::string> debugSocket; // wait for the debugger on this UNIX socket, see `Debugger`
+
+    std::optional<u32> compileThreshold;          // calls after which a function runs in the compiled tier, see `Tier`
+    bool               backgroundCompile = false; // compile on a thread of its own, the interpreter does not wait
+
+    std::optional<std::string> typeFeedbackPath; // dump operand kinds seen by instructions at exit, empty is stderr
+    std::optional<std::string> profilePath;      // start with the heat and feedback of previous runs, see `Profile`
+
+    bool asyncOutput = false; // write the output of the program by a thread of its own, see `Output`
+
+    bool timePhases = false; // print time of loading, analysis and execution to stderr
+
+    /**
+     * @brief Heap options are taken from `LAMA_HEAP_MIN`, `LAMA_HEAP_MAX`,
+     * `LAMA_HEAP_GROWTH` and `LAMA_GC_TARGET` too, command line overrides them
+     */
+    static auto parse(int argc, char** argv) -> std::variant<DiagnosticsBag, Options>;
+
+    [[nodiscard]]
+    auto sizesHeap() const noexcept -> bool {
+        return heapMinBytes.has_value() || heapMaxBytes.has_value() || heapGrowth.has_value()
+            || gcTargetShare.has_value();
+    }
+
+    /**
+     * @brief checks whether some limit must be polled on back edges and calls
+     */
+    [[nodiscard]]
+    auto needsSafepoints() const noexcept -> bool {
+        return maxInstructions.has_value() || timeoutSeconds.has_value() || heapCensus || sizesHeap();
+    }
+};
+
+constexpr const char* USAGE = "Usage: LamaInterpreter [--max-instructions=N] [--timeout=SECONDS] [--perf-map] [--stats-shm[=NAME]] [--heap-census] [--heap-min=SIZE] [--heap-max=SIZE] [--heap-growth=F] [--gc-target=PERCENT] [--record=FILE | --replay=FILE] [--debug=SOCKET] [--compile-threshold=N [--background-compile]] [--type-feedback[=FILE]] [--profile=FILE] [--async-output] [--time-phases] file.bc";
@@ -0,0 +1,134 @@
+#include "Output.hpp"
+
+#include "Types.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+
+// Constant initialized, so it costs nothing at startup
+constinit Output programOutput;
+
+/**
+ * @brief Single producer, single consumer: the program fills the slot at `filled`,
+ * the writer thread writes out the slot at `written`. Both only grow, the slot is
+ * the counter modulo the size of the ring
+ */
+struct Output::Ring {
+    struct Slot {
+        std::array<char, CAPACITY> data;
+        usize                      size;
+    };
+
+    std::array<Slot, RING_SLOTS> slots;
+    // Apart, so the program and the writer do not bounce a cache line
+    alignas(64) std::atomic<u32> filled {0};
+    alignas(64) std::atomic<u32> written {0};
+};
+
+namespace {
+
+// Lama runtime reports its failures with `exit`, the output printed before them must not be lost
+void flushAtExit() { programOutput.flush(); }
+
+void writeAll(const char* chars, usize size) noexcept {
+    usize written = 0;
+    while (written < size) {
+        auto result = ::write(STDOUT_FILENO, chars + written, size - written);
+        if (result < 0 && errno == EINTR) { continue; }
+        // Nobody reads the output anymore, as with `std::cout` it is dropped silently
+        if (result <= 0) { break; }
+        written += static_cast<usize>(result);
+    }
+}
+
+} // namespace
+
+void Output::writeInBackground() {
+    ring = new Ring; // NOLINT(*-owning-memory)
+    std::thread([ring = ring] {
+        for (u32 next = 0;; ++next) {
+            for (u32 filled; (filled = ring->filled.load(std::memory_order_acquire)) == next;) {
+                ring->filled.wait(filled, std::memory_order_acquire);
+            }
+            auto& slot = ring->slots[next % RING_SLOTS];
+            writeAll(slot.data.data(), slot.size);
+            ring->written.store(next + 1, std::memory_order_release);
+            ring->written.notify_one();
+        }
+    }).detach();
+}
+
+auto Output::data() noexcept -> char* {
+    if (!ring) { return buffer.data(); }
+    // Only this thread moves `filled`
+    return ring->slots[ring->filled.load(std::memory_order_relaxed) % RING_SLOTS].data.data();
+}
+
+void Output::number(i32 value) {
+    constexpr usize MAX_LINE = 16; // sign, 10 digits and newline
+    if (CAPACITY - used < MAX_LINE) { handOver(); }
+
+    auto* start    = data();
+    auto [end, ec] = std::to_chars(start + used, start + CAPACITY, value);
+    *end++         = '\n';
+    used           = static_cast<usize>(end - start);
+
+    afterWrite();
+}
+
+void Output::text(std::string_view chars) {
+    while (!chars.empty()) {
+        if (used == CAPACITY) { handOver(); }
+        usize chunk = std::min(chars.size(), CAPACITY - used);
+        std::memcpy(data() + used, chars.data(), chunk);
+        used += chunk;
+        chars.remove_prefix(chunk);
+    }
+    afterWrite();
+}
+
+void Output::afterWrite() {
+    if (buffering == Buffering::Unknown) [[unlikely]] {
+        buffering = isatty(STDOUT_FILENO) ? Buffering::Line : Buffering::Full;
+        std::atexit(flushAtExit);
+    }
+    if (buffering == Buffering::Line) { handOver(); }
+}
+
+void Output::handOver() noexcept {
+    if (!ring) {
+        writeAll(buffer.data(), used);
+        used = 0;
+        return;
+    }
+    if (used == 0) { return; }
+
+    auto  filled = ring->filled.load(std::memory_order_relaxed);
+    auto& slot   = ring->slots[filled % RING_SLOTS];
+    slot.size    = used;
+    ring->filled.store(filled + 1, std::memory_order_release);
+    ring->filled.notify_one();
+    used = 0;
+
+    // The next slot may be still being written out, that's the only time the program waits
+    for (u32 written; filled + 1 - (written = ring->written.load(std::memory_order_acquire)) >= RING_SLOTS;) {
+        ring->written.wait(written, std::memory_order_acquire);
+    }
+}
+
+void Output::flush() noexcept {
+    handOver();
+    if (!ring) { return; }
+    auto filled = ring->filled.load(std::memory_order_relaxed);
+    for (u32 written; (written = ring->written.load(std::memory_order_acquire)) != filled;) {
+        ring->written.wait(written, std::memory_order_acquire);
+    }
+}
@@ -0,0 +1,74 @@
+/**
+ * @file Output.hpp
+ * @brief This file contains output of the interpreted program. Numbers are
+ * formatted into a buffer which is written to the standard output with `write`,
+ * so printing touches neither iostreams nor stdio
+ *
+ * Output may be written by a thread of its own: the program fills a ring of
+ * buffers and hands them over without a lock, the thread drains them in order.
+ * Then the program does not wait for a slow pipe or file, unless it gets a whole
+ * ring ahead
+ *
+ */
+#pragma once
+
+#include "Types.hpp"
+
+#include <array>
+#include <string_view>
+
+class Output {
+public:
+    constexpr Output() = default;
+
+    /**
+     * @brief Appends the number and a newline, as `Lwrite` prints it
+     */
+    void number(i32 value);
+    void text(std::string_view chars);
+
+    /**
+     * @brief Starts the writer thread, must be called before anything is printed.
+     * The thread is never stopped, the last flush at exit drains the ring
+     */
+    void writeInBackground();
+
+    /**
+     * @brief Writes the buffer out, with the writer thread waits till it has
+     * written everything. Called before reading input, before errors and at exit,
+     * also after every line when the output is a terminal
+     */
+    void flush() noexcept;
+
+private:
+    static constexpr usize CAPACITY   = 64 * 1024;
+    static constexpr usize RING_SLOTS = 16;
+
+    struct Ring;
+
+    enum class Buffering : u8 {
+        Unknown, // nothing has been written yet
+        Full,
+        Line,
+    };
+
+    /**
+     * @brief Decides on buffering with the first write, then flushes if the output is a terminal
+     */
+    void afterWrite();
+    /**
+     * @brief Writes the buffer out, or gives it to the writer thread and takes the next one
+     */
+    void handOver() noexcept;
+    auto data() noexcept -> char*;
+
+    std::array<char, CAPACITY> buffer {}; // unused with the writer thread, it fills the slots of the ring
+    usize                      used      = 0;
+    Buffering                  buffering = Buffering::Unknown;
+    Ring*                      ring      = nullptr; // never freed, the writer thread may outlive `main`
+};
+
+/**
+ * @brief Everything the program prints, it is flushed at exit even if the runtime exits by itself
+ */
+extern Output programOutput;
@@ -0,0 +1,148 @@
+#include "PerfMap.hpp"
+
+#include "Interpreter.hpp"
+#include "Types.hpp"
+#include "Utils.hpp"
+
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <ios>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace {
+
+#if defined(__i386__)
+
+// sub esp, 8; push dword [esp + 12]; call rel32; add esp, 12; ret
+// 8 bytes of padding keep the stack 16-byte aligned at the call, as the ABI wants
+constexpr usize TRAMPOLINE_SIZE = 16;
+
+constexpr std::array<u8, TRAMPOLINE_SIZE> TRAMPOLINE_CODE = {
+    0x83, 0xEC, 0x08,             // sub esp, 8
+    0xFF, 0x74, 0x24, 0x0C,       // push dword [esp + 12]
+    0xE8, 0x00, 0x00, 0x00, 0x00, // call rel32
+    0x83, 0xC4, 0x0C,             // add esp, 12
+    0xC3,                         // ret
+};
+
+void patchTarget(u8* trampoline, FrameRunner runner) {
+    constexpr usize CALL_OPERAND = 8;
+    constexpr usize AFTER_CALL   = 12;
+
+    auto target   = std::bit_cast<u32>(runner);
+    auto relative = target - std::bit_cast<u32>(trampoline + AFTER_CALL);
+    copyValues(trampoline + CALL_OPERAND, &relative);
+}
+
+#elif defined(__x86_64__)
+
+// Argument is already in rdi, only the stack needs to be aligned for the call
+constexpr usize TRAMPOLINE_SIZE = 32;
+
+constexpr std::array<u8, TRAMPOLINE_SIZE> TRAMPOLINE_CODE = {
+    0x48, 0x83, 0xEC, 0x08,                                     // sub rsp, 8
+    0x48, 0xB8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // movabs rax, imm64
+    0xFF, 0xD0,                                                 // call rax
+    0x48, 0x83, 0xC4, 0x08,                                     // add rsp, 8
+    0xC3,                                                       // ret
+};
+
+void patchTarget(u8* trampoline, FrameRunner runner) {
+    constexpr usize IMMEDIATE = 6;
+
+    auto target = std::bit_cast<u64>(runner);
+    copyValues(trampoline + IMMEDIATE, &target);
+}
+
+#else
+#error "perf trampolines are implemented only for x86"
+#endif
+
+auto functionNames(Bytefile& bytefile) -> std::unordered_map<u32, std::string_view> {
+    std::unordered_map<u32, std::string_view> names;
+    for (usize i = 0; i + 1 < bytefile.publicSymbols.size(); i += 2) {
+        auto name = bytefile.getString(bytefile.publicSymbols[i]);
+        if (name.has_value()) { names.emplace(bytefile.publicSymbols[i + 1], name.value()); }
+    }
+    return names;
+}
+
+} // namespace
+
+auto PerfTrampolines::create(Bytefile& bytefile, FrameRunner runner)
+    -> std::variant<DiagnosticsBag, PerfTrampolines> {
+    auto functions = bytefile.functions;
+
+    PerfTrampolines result;
+    if (functions.empty()) { return result; }
+
+    auto pageSize   = static_cast<usize>(sysconf(_SC_PAGESIZE));
+    result.codeSize = (functions.size() * TRAMPOLINE_SIZE + pageSize - 1) / pageSize * pageSize;
+
+    void* memory = mmap(nullptr, result.codeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) { return DiagnosticsBag {"cannot map trampolines: " + std::string(std::strerror(errno))}; }
+    result.code = memory;
+
+    auto* trampoline = static_cast<u8*>(memory);
+    for (auto& function : functions) {
+        std::memcpy(trampoline, TRAMPOLINE_CODE.data(), TRAMPOLINE_SIZE);
+        patchTarget(trampoline, runner);
+        result.trampolines.emplace(function.entry, std::bit_cast<FrameRunner>(trampoline));
+        trampoline += TRAMPOLINE_SIZE;
+    }
+
+    if (mprotect(memory, result.codeSize, PROT_READ | PROT_EXEC) != 0) {
+        return DiagnosticsBag {"cannot make trampolines executable: " + std::string(std::strerror(errno))};
+    }
+
+    // Format is described in `tools/perf/Documentation/jit-interface.txt` of Linux:
+    // START SIZE symbolname, numbers are hex without 0x
+    std::stringstream path;
+    path << "/tmp/perf-" << getpid() << ".map";
+    std::ofstream map(path.str());
+    if (!map) { return DiagnosticsBag {"cannot open " + path.str() + ": " + std::string(std::strerror(errno))}; }
+
+    auto names = functionNames(bytefile);
+    for (auto& function : functions) {
+        auto address = function.entry;
+        map << std::hex << std::bit_cast<uintptr_t>(result.trampolines[address]) << ' ' << TRAMPOLINE_SIZE << " lama::";
+        if (auto name = names.find(address); name != names.end()) {
+            map << name->second << '\n';
+        } else {
+            map << "0x" << address << '\n';
+        }
+    }
+
+    return result;
+}
+
+auto PerfTrampolines::find(u32 address) const -> FrameRunner {
+    auto trampoline = trampolines.find(address);
+    return trampoline == trampolines.end() ? nullptr : trampoline->second;
+}
+
+PerfTrampolines::PerfTrampolines(PerfTrampolines&& other) noexcept
+    : trampolines(std::move(other.trampolines)),
+      code(std::exchange(other.code, nullptr)),
+      codeSize(std::exchange(other.codeSize, 0)) {}
+
+auto PerfTrampolines::operator=(PerfTrampolines&& other) noexcept -> PerfTrampolines& {
+    std::swap(trampolines, other.trampolines);
+    std::swap(code, other.code);
+    std::swap(codeSize, other.codeSize);
+    return *this;
+}
+
+PerfTrampolines::~PerfTrampolines() {
+    if (code) { munmap(code, codeSize); }
+}
@@ -0,0 +1,56 @@
+/**
+ * @file PerfMap.hpp
+ * @brief This file contains per-function native trampolines for Linux `perf`
+ *
+ * Every Lama function (keyed by the address of its `BEGIN`) gets a tiny piece of
+ * machine code that just calls the interpreter loop. In this mode each Lama call is
+ * entered through the trampoline of its callee, so native profilers see Lama frames
+ * in the call chains. Their names are written to `/tmp/perf-<pid>.map`
+ *
+ */
+#pragma once
+
+#include "Interpreter.hpp"
+#include "Types.hpp"
+
+#include <unordered_map>
+#include <variant>
+
+struct PerfContext;
+
+/**
+ * @brief Interpreter loop that runs a single Lama frame. Trampolines pass their
+ * only argument to it
+ */
+using FrameRunner = InterpretResult (*)(PerfContext*);
+
+class PerfTrampolines {
+public:
+    static auto create(Bytefile& bytefile, FrameRunner runner) -> std::variant<DiagnosticsBag, PerfTrampolines>;
+
+    /**
+     * @brief returns trampoline of a function which `BEGIN` is at `address`
+     * or nullptr if there is no such function
+     */
+    auto find(u32 address) const -> FrameRunner;
+
+    PerfTrampolines(const PerfTrampolines&)                    = delete;
+    auto operator=(const PerfTrampolines&) -> PerfTrampolines& = delete;
+    PerfTrampolines(PerfTrampolines&& other) noexcept;
+    auto operator=(PerfTrampolines&& other) noexcept -> PerfTrampolines&;
+    ~PerfTrampolines();
+
+private:
+    PerfTrampolines() = default;
+
+    std::unordered_map<u32, FrameRunner> trampolines;
+
+    void* code     = nullptr;
+    usize codeSize = 0;
+};
+
+struct PerfContext {
+    Bytefile&        bytefile;
+    Interpreter&     interpreter;
+    PerfTrampolines& trampolines;
+};
@@ -0,0 +1,14 @@
+#include "Probes.hpp"
+
+#if defined(LAMA_USDT) && LAMA_USDT
+
+// Tracer increments the semaphore when it attaches to the probe. They must live
+// in `.probes` section, that's where `bpftrace` and `perf` are looking for them
+extern "C" {
+#define LAMA_DEFINE_SEMAPHORE(name) \
+    __attribute__((section(".probes"), used)) volatile unsigned short LAMA_PROBE_SEMAPHORE(name) = 0;
+LAMA_PROBES_LIST(LAMA_DEFINE_SEMAPHORE)
+#undef LAMA_DEFINE_SEMAPHORE
+}
+
+#endif
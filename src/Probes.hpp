@@ -0,0 +1,61 @@
+/**
+ * @file Probes.hpp
+ * @brief This file contains USDT static probes of the interpreter. They are
+ * compiled to a single NOP when no tracer is attached, so they stay in release builds
+ *
+ * List the probes with `bpftrace -l 'usdt:./build/LamaInterpreter:*'`:
+ * - `lama:function__entry(address, nArgs, nLocals)` -- `BEGIN`/`CBEGIN` at `address`
+ * - `lama:function__return(address)` -- `END`/`RET` at `address`
+ * - `lama:alloc__string(length)`, `lama:alloc__array(n)`, `lama:alloc__sexp(tagHash, n)`,
+ *   `lama:alloc__closure(address, nCaptured)` -- allocations done by the interpreter
+ * - `lama:gc__resize(oldBytes, newBytes)` -- heap resize inside of a collection
+ * - `lama:gc__done(collection, pauseNanos, heapBytes)` -- allocation that has collected is over
+ * - `lama:fail(first, second)` -- `FAIL` instruction
+ *
+ */
+#pragma once
+
+#if defined(LAMA_USDT) && LAMA_USDT
+
+// Semaphores let us skip preparing expensive arguments when nobody listens
+#define _SDT_HAS_SEMAPHORES 1 // NOLINT
+#include <sys/sdt.h>
+
+// NOLINTBEGIN
+#define LAMA_PROBE_SEMAPHORE(name) lama_##name##_semaphore
+#define LAMA_PROBE_ENABLED(name)   __builtin_expect(LAMA_PROBE_SEMAPHORE(name) != 0, 0)
+
+#define LAMA_PROBE1(name, a)          STAP_PROBE1(lama, name, a)
+#define LAMA_PROBE2(name, a, b)       STAP_PROBE2(lama, name, a, b)
+#define LAMA_PROBE3(name, a, b, c)    STAP_PROBE3(lama, name, a, b, c)
+// NOLINTEND
+
+// Every probe must have a semaphore, they are defined in `Probes.cpp`
+#define LAMA_PROBES_LIST(X) \
+    X(function__entry)      \
+    X(function__return)     \
+    X(alloc__string)        \
+    X(alloc__array)         \
+    X(alloc__sexp)          \
+    X(alloc__closure)       \
+    X(gc__resize)           \
+    X(gc__done)             \
+    X(fail)
+
+extern "C" {
+#define LAMA_DECLARE_SEMAPHORE(name) extern volatile unsigned short LAMA_PROBE_SEMAPHORE(name);
+LAMA_PROBES_LIST(LAMA_DECLARE_SEMAPHORE)
+#undef LAMA_DECLARE_SEMAPHORE
+}
+
+#else
+
+// Arguments are not evaluated, `sizeof` only marks them as used
+// NOLINTBEGIN
+#define LAMA_PROBE_ENABLED(name)   false
+#define LAMA_PROBE1(name, a)       static_cast<void>(sizeof(a))
+#define LAMA_PROBE2(name, a, b)    static_cast<void>(sizeof(a) + sizeof(b))
+#define LAMA_PROBE3(name, a, b, c) static_cast<void>(sizeof(a) + sizeof(b) + sizeof(c))
+// NOLINTEND
+
+#endif
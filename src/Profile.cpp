@@ -0,0 +1,123 @@
+#include "Profile.hpp"
+
+#include "Tier.hpp"
+#include "TypeFeedback.hpp"
+#include "Types.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <variant>
+#include <vector>
+
+namespace {
+
+constexpr u64 FNV_OFFSET = 14'695'981'039'346'656'037ULL;
+constexpr u64 FNV_PRIME  = 1'099'511'628'211ULL;
+
+} // namespace
+
+auto Profile::digestOf(std::span<const u8> code) noexcept -> u64 {
+    u64 digest = FNV_OFFSET;
+    for (u8 byte : code) {
+        digest ^= byte;
+        digest *= FNV_PRIME;
+    }
+    return digest;
+}
+
+auto Profile::load(const std::string& path, u64 codeDigest, usize functionCount)
+    -> std::variant<DiagnosticsBag, Profile> {
+    Profile       result {codeDigest};
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) { return result; } // the first run
+    auto size = static_cast<u64>(file.tellg());
+    file.seekg(0);
+
+    ProfileHeader header {};
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) // NOLINT
+        || header.magic != ProfileHeader::MAGIC) {
+        return DiagnosticsBag {path + " is not a profile"};
+    }
+    // Profile of another version is replaced at exit anyway
+    if (header.version != ProfileHeader::VERSION || header.codeDigest != codeDigest) { return result; }
+
+    // Counts are checked before anything is allocated for them. A run without the compiled tier leaves no heat
+    if (header.functionCount != 0 && header.functionCount != functionCount) {
+        return DiagnosticsBag {"profile " + path + " has got " + std::to_string(header.functionCount)
+                               + " functions, the code has got " + std::to_string(functionCount)};
+    }
+    if (size != sizeof(header) + u64 {header.functionCount} + u64 {header.siteCount} * sizeof(ProfileSite)) {
+        return DiagnosticsBag {"profile " + path + " is not of the size its header tells"};
+    }
+    result.functions.resize(header.functionCount);
+    result.sites.resize(header.siteCount);
+    if (!file.read(reinterpret_cast<char*>(result.functions.data()), header.functionCount) // NOLINT
+        || !file.read(reinterpret_cast<char*>(result.sites.data()),                       // NOLINT
+                      static_cast<std::streamsize>(result.sites.size() * sizeof(ProfileSite)))) {
+        return DiagnosticsBag {"profile " + path + " is truncated"};
+    }
+    for (auto heat : result.functions) {
+        if (heat > Tier::Heat::Disabled) { return DiagnosticsBag {"profile " + path + " is corrupted"}; }
+    }
+    return result;
+}
+
+void Profile::apply(Tier* tier, TypeFeedback* feedback) const {
+    if (tier) { tier->warmUp(functions); }
+    if (feedback) {
+        std::vector<TypeFeedback::Site> previous;
+        previous.reserve(sites.size());
+        for (auto& site : sites) {
+            TypeFeedback::Site seen {site.address, site.opcode, site.operands, 0};
+            seen.kinds        = site.kinds;
+            seen.count        = site.count;
+            seen.identity     = site.identity;
+            seen.identityKind = site.identityKind;
+            seen.polymorphic  = site.polymorphic != 0;
+            previous.push_back(seen);
+        }
+        feedback->merge(previous);
+    }
+}
+
+void Profile::update(const Tier* tier, const TypeFeedback* feedback) {
+    if (tier) { functions = tier->heat(); }
+    if (feedback) {
+        // Feedback has got the previous run merged, so it replaces the sites as a whole
+        sites.clear();
+        for (auto& site : feedback->sites()) {
+            if (site.count == 0) { continue; }
+            sites.push_back({
+                site.address,
+                site.count,
+                site.identity,
+                site.opcode,
+                site.operands,
+                site.identityKind,
+                static_cast<u8>(site.polymorphic),
+                site.kinds,
+                0,
+            });
+        }
+    }
+}
+
+auto Profile::save(const std::string& path) const -> DiagnosticsBag {
+    ProfileHeader header {
+        ProfileHeader::MAGIC,
+        ProfileHeader::VERSION,
+        static_cast<u32>(functions.size()),
+        static_cast<u32>(sites.size()),
+        codeDigest,
+    };
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));          // NOLINT
+    file.write(reinterpret_cast<const char*>(functions.data()),                   // NOLINT
+               static_cast<std::streamsize>(functions.size() * sizeof(Tier::Heat)));
+    file.write(reinterpret_cast<const char*>(sites.data()),                       // NOLINT
+               static_cast<std::streamsize>(sites.size() * sizeof(ProfileSite)));
+    if (!file.flush()) { return {"cannot write profile " + path + ": " + std::strerror(errno)}; }
+    return {};
+}
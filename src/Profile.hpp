@@ -0,0 +1,87 @@
+/**
+ * @file Profile.hpp
+ * @brief This file contains the profile that outlives the process: heat of the
+ * functions for the compiled tier and the type feedback. It is keyed by the
+ * digest of the code, so a profile of another program, or of another version of
+ * it, is not used and is replaced at exit
+ *
+ */
+#pragma once
+
+#include "Tier.hpp"
+#include "TypeFeedback.hpp"
+#include "Types.hpp"
+
+#include <array>
+#include <span>
+#include <string>
+#include <variant>
+#include <vector>
+
+/**
+ * @brief Layout of the profile file. Heat of every function (a byte each) and
+ * the sites follow the header
+ */
+struct ProfileHeader {
+    static constexpr u32 MAGIC   = 0x4652'504C; // "LPRF"
+    static constexpr u32 VERSION = 1;
+
+    u32 magic;
+    u32 version;
+    u32 functionCount;
+    u32 siteCount;
+    u64 codeDigest; // FNV-1a of the code as it is loaded
+};
+
+static_assert(sizeof(ProfileHeader) == 24);
+
+/**
+ * @brief `TypeFeedback::Site` as it is saved
+ */
+struct ProfileSite {
+    u32                                        address;
+    u32                                        count;
+    u32                                        identity;
+    u8                                         opcode;
+    u8                                         operands;
+    u8                                         identityKind;
+    u8                                         polymorphic;
+    std::array<u8, TypeFeedback::MAX_OPERANDS> kinds;
+    u8                                         reserved;
+};
+
+static_assert(sizeof(ProfileSite) == 20);
+
+class Profile {
+public:
+    /**
+     * @brief Digest of the code, it must be taken before anything patches it
+     */
+    static auto digestOf(std::span<const u8> code) noexcept -> u64;
+
+    /**
+     * @brief Reads the profile of the code with `codeDigest`. Missing file or
+     * a profile of other code gives an empty profile
+     *
+     * @param functionCount size of the function table of the code, the heat is of every function
+     */
+    static auto load(const std::string& path, u64 codeDigest, usize functionCount)
+        -> std::variant<DiagnosticsBag, Profile>;
+
+    /**
+     * @brief Gives the previous run to whatever is enabled in this one
+     */
+    void apply(Tier* tier, TypeFeedback* feedback) const;
+    /**
+     * @brief Takes what this run has learned, the parts that are not enabled are kept as they were
+     */
+    void update(const Tier* tier, const TypeFeedback* feedback);
+    auto save(const std::string& path) const -> DiagnosticsBag;
+
+private:
+    explicit Profile(u64 code) : codeDigest(code) {}
+
+    u64                      codeDigest;
+    std::vector<Tier::Heat>  functions;
+    std::vector<ProfileSite> sites;
+};
@@ -0,0 +1,103 @@
+#include "ProgramIo.hpp"
+
+#include "LamaRuntime.hpp"
+#include "Output.hpp"
+#include "Types.hpp"
+
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace {
+
+constexpr u64 FNV_PRIME = 1'099'511'628'211ULL;
+
+auto fnv1a(u64 digest, std::string_view text) noexcept -> u64 {
+    for (char c : text) {
+        digest ^= static_cast<u8>(c);
+        digest *= FNV_PRIME;
+    }
+    return digest;
+}
+
+} // namespace
+
+auto ProgramIo::record(std::string path) -> ProgramIo {
+    ProgramIo result {Mode::Record};
+    result.path = std::move(path);
+    return result;
+}
+
+auto ProgramIo::replay(const std::string& path) -> std::variant<DiagnosticsBag, ProgramIo> {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) { return DiagnosticsBag {"cannot open recording " + path + ": " + std::strerror(errno)}; }
+
+    ProgramIo result {Mode::Replay};
+    result.path = path;
+    if (!file.read(reinterpret_cast<char*>(&result.recorded), sizeof(result.recorded)) // NOLINT
+        || result.recorded.magic != RecordingHeader::MAGIC) {
+        return DiagnosticsBag {path + " is not a recording"};
+    }
+    if (result.recorded.version != RecordingHeader::VERSION) {
+        return DiagnosticsBag {"unsupported recording version " + std::to_string(result.recorded.version)};
+    }
+
+    result.inputs.resize(result.recorded.inputCount);
+    if (!file.read(reinterpret_cast<char*>(result.inputs.data()), // NOLINT
+                   static_cast<std::streamsize>(result.inputs.size() * sizeof(i32)))) {
+        return DiagnosticsBag {"recording " + path + " is truncated"};
+    }
+    return result;
+}
+
+auto ProgramIo::read() -> std::optional<i32> {
+    if (mode == Mode::Replay) {
+        if (nextInput == inputs.size()) { return std::nullopt; }
+        return inputs[nextInput++];
+    }
+
+    auto value = UNBOX(Lread());
+    inputs.push_back(value);
+    return value;
+}
+
+void ProgramIo::write(i32 value) {
+    std::array<char, 16> text {};
+    auto [end, ec] = std::to_chars(text.data(), text.data() + text.size() - 1, value);
+    *end++         = '\n';
+
+    std::string_view line {text.data(), static_cast<usize>(end - text.data())};
+    digest = fnv1a(digest, line);
+    ++writes;
+    if (mode == Mode::Record) { programOutput.text(line); }
+}
+
+auto ProgramIo::finish() -> DiagnosticsBag {
+    if (mode == Mode::Replay) {
+        if (writes == recorded.writeCount && digest == recorded.outputDigest) { return {}; }
+
+        std::stringstream ss;
+        ss << "output differs from the recording: " << writes << " writes with digest " << std::hex << digest
+           << " instead of " << std::dec << recorded.writeCount << " with digest " << std::hex
+           << recorded.outputDigest;
+        return {ss.str()};
+    }
+
+    RecordingHeader header {
+        RecordingHeader::MAGIC, RecordingHeader::VERSION, static_cast<u32>(inputs.size()), 0, writes, digest,
+    };
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header)); // NOLINT
+    file.write(reinterpret_cast<const char*>(inputs.data()),           // NOLINT
+               static_cast<std::streamsize>(inputs.size() * sizeof(i32)));
+    if (!file.flush()) { return {"cannot write recording " + path + ": " + std::strerror(errno)}; }
+    return {};
+}
@@ -0,0 +1,77 @@
+/**
+ * @file ProgramIo.hpp
+ * @brief This file contains record and replay of the program input and output.
+ * Recording keeps every number read by `Lread` and a digest of everything
+ * written by `Lwrite`. Replay feeds the numbers from memory and checks the
+ * digest, nothing is read or written for real
+ *
+ */
+#pragma once
+
+#include "Types.hpp"
+
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+
+/**
+ * @brief Layout of the recording file. Inputs follow the header
+ */
+struct RecordingHeader {
+    static constexpr u32 MAGIC   = 0x4345'524C; // "LREC"
+    static constexpr u32 VERSION = 1;
+
+    u32 magic;
+    u32 version;
+    u32 inputCount;
+    u32 reserved;
+    u64 writeCount;
+    u64 outputDigest; // FNV-1a of the text written by `Lwrite`
+};
+
+static_assert(sizeof(RecordingHeader) == 32);
+
+class ProgramIo {
+public:
+    /**
+     * @brief Real input and output, both are remembered till `finish`
+     */
+    static auto record(std::string path) -> ProgramIo;
+    /**
+     * @brief Loads the recording, input and output are done in memory from now on
+     */
+    static auto replay(const std::string& path) -> std::variant<DiagnosticsBag, ProgramIo>;
+
+    /**
+     * @brief Reads the next number, unboxed
+     *
+     * @return std::nullopt if the replay has run out of recorded input
+     */
+    auto read() -> std::optional<i32>;
+    void write(i32 value);
+
+    /**
+     * @brief Record saves the recording, replay compares the output with the recorded one
+     */
+    auto finish() -> DiagnosticsBag;
+
+private:
+    enum class Mode : u8 {
+        Record,
+        Replay,
+    };
+
+    static constexpr u64 FNV_OFFSET = 14'695'981'039'346'656'037ULL;
+
+    explicit ProgramIo(Mode ioMode) : mode(ioMode) {}
+
+    Mode             mode;
+    std::string      path;
+    std::vector<i32> inputs;
+    usize            nextInput = 0;
+    u64              writes    = 0;
+    u64              digest    = FNV_OFFSET;
+
+    RecordingHeader recorded {};
+};
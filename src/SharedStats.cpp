@@ -0,0 +1,125 @@
+#include "SharedStats.hpp"
+
+#include "GcHooks.hpp"
+#include "Interpreter.hpp"
+#include "Types.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace {
+
+// Lama runtime reports its failures with `exit`, which skips the destructor
+std::string segmentAtExit;
+
+void unlinkAtExit() {
+    if (!segmentAtExit.empty()) { shm_unlink(segmentAtExit.c_str()); }
+}
+
+} // namespace
+
+auto SharedStats::create(std::string name, Bytefile& bytefile) -> std::variant<DiagnosticsBag, SharedStats> {
+    SharedStats result;
+    for (auto& function : bytefile.functions) { result.functions.push_back(function.entry); }
+    result.size      = StatsSegment::sizeFor(static_cast<u32>(result.functions.size()));
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) { return DiagnosticsBag {"cannot create " + name + ": " + std::string(std::strerror(errno))}; }
+    result.name   = std::move(name);
+    segmentAtExit = result.name;
+    std::atexit(unlinkAtExit);
+
+    if (ftruncate(fd, static_cast<off_t>(result.size)) != 0) {
+        close(fd);
+        return DiagnosticsBag {"cannot resize " + result.name + ": " + std::string(std::strerror(errno))};
+    }
+    void* memory = mmap(nullptr, result.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return DiagnosticsBag {"cannot map " + result.name + ": " + std::string(std::strerror(errno))};
+    }
+
+    // Fresh segment is zeroed by `ftruncate`, so only the header is left
+    result.segment                = static_cast<StatsSegment*>(memory);
+    result.segment->pid           = static_cast<u32>(getpid());
+    result.segment->functionCount = static_cast<u32>(result.functions.size());
+    result.segment->currentFunction.store(StatsSegment::NO_FUNCTION, std::memory_order_relaxed);
+
+    std::unordered_map<u32, std::string_view> names;
+    for (usize i = 0; i + 1 < bytefile.publicSymbols.size(); i += 2) {
+        if (auto symbol = bytefile.getString(bytefile.publicSymbols[i])) {
+            names.emplace(bytefile.publicSymbols[i + 1], symbol.value());
+        }
+    }
+    for (usize i = 0; i < result.functions.size(); ++i) {
+        auto& function   = result.segment->functions()[i];
+        function.address = result.functions[i];
+        if (auto symbol = names.find(function.address); symbol != names.end()) {
+            auto length = std::min<usize>(symbol->second.size(), StatsSegment::NAME_LEN - 1);
+            std::memcpy(function.name, symbol->second.data(), length);
+        }
+    }
+
+    // Readers check magic last, after that the header is complete
+    result.segment->version = StatsSegment::VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    result.segment->magic = StatsSegment::MAGIC;
+
+    gcCounters.timed = true;
+    return result;
+}
+
+void SharedStats::publish(Bytefile& bytefile, const Interpreter& interpreter, u64 instructions, u64 calls) noexcept {
+    constexpr auto RELAXED = std::memory_order_relaxed;
+
+    segment->instructions.store(instructions, RELAXED);
+    segment->calls.store(calls, RELAXED);
+    segment->allocations.store(gcCounters.allocations, RELAXED);
+    segment->gcCount.store(gcCounters.collections, RELAXED);
+    segment->gcNanos.store(gcCounters.pauseNanos, RELAXED);
+    segment->stackDepth.store(static_cast<u32>(interpreter.stackDepth()), RELAXED);
+
+    // Current function is the closest `BEGIN` before ip, it's cheaper to find it here
+    // than to track it on every call and return
+    auto address  = static_cast<u32>(bytefile.address());
+    auto function = std::upper_bound(functions.begin(), functions.end(), address);
+    auto current  = function == functions.begin() ? StatsSegment::NO_FUNCTION
+                                                  : static_cast<u32>(function - functions.begin() - 1);
+    segment->currentFunction.store(current, RELAXED);
+}
+
+void SharedStats::finish() noexcept { segment->finished.store(1, std::memory_order_release); }
+
+SharedStats::SharedStats(SharedStats&& other) noexcept
+    : segment(std::exchange(other.segment, nullptr)),
+      size(std::exchange(other.size, 0)),
+      name(std::exchange(other.name, {})),
+      functions(std::move(other.functions)) {}
+
+auto SharedStats::operator=(SharedStats&& other) noexcept -> SharedStats& {
+    std::swap(segment, other.segment);
+    std::swap(size, other.size);
+    std::swap(name, other.name);
+    std::swap(functions, other.functions);
+    return *this;
+}
+
+SharedStats::~SharedStats() {
+    if (segment) { munmap(segment, size); }
+    // Readers that are attached already keep their mapping
+    if (!name.empty()) {
+        shm_unlink(name.c_str());
+        segmentAtExit.clear();
+    }
+}
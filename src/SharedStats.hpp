@@ -0,0 +1,92 @@
+/**
+ * @file SharedStats.hpp
+ * @brief This file contains live statistics of the interpreter, published into
+ * a POSIX shared memory segment. They are read from outside by `lama-top`
+ *
+ */
+#pragma once
+
+#include "Types.hpp"
+
+#include <atomic>
+#include <string>
+#include <variant>
+#include <vector>
+
+struct Bytefile;
+class Interpreter;
+
+/**
+ * @brief Layout of the segment, shared by the interpreter and `lama-top`.
+ * Counters are written with relaxed stores, so every counter is consistent by itself,
+ * but not with each other
+ */
+struct StatsSegment {
+    static constexpr u32 MAGIC    = 0x5453'4D4C; // "LMST"
+    static constexpr u32 VERSION  = 1;
+    static constexpr u32 NAME_LEN = 28;
+    static constexpr u32 NO_FUNCTION = ~0U;
+
+    struct Function {
+        u32  address;
+        char name[NAME_LEN]; // NOLINT(*-avoid-c-arrays): it's a layout of shared memory
+    };
+
+    u32 magic;
+    u32 version;
+    u32 pid;
+    u32 functionCount;
+
+    alignas(8) std::atomic<u64> instructions;
+    alignas(8) std::atomic<u64> calls;
+    alignas(8) std::atomic<u64> allocations;
+    alignas(8) std::atomic<u64> gcNanos;
+    std::atomic<u32> gcCount;
+    std::atomic<u32> stackDepth;      // words
+    std::atomic<u32> currentFunction; // index in `functions` or `NO_FUNCTION`
+    std::atomic<u32> finished;
+
+    // `functionCount` entries follow, sorted by address
+    auto functions() noexcept -> Function* { return reinterpret_cast<Function*>(this + 1); }
+
+    static constexpr auto sizeFor(u32 functionCount) noexcept -> usize {
+        return sizeof(StatsSegment) + sizeof(Function) * functionCount;
+    }
+};
+
+static_assert(std::atomic<u64>::is_always_lock_free && std::atomic<u32>::is_always_lock_free,
+              "counters must be lock-free to be shared between processes");
+
+/**
+ * @brief Default name of the segment for the given pid, `lama-top` uses it too
+ */
+inline auto defaultStatsName(u32 pid) -> std::string { return "/lama-" + std::to_string(pid); }
+
+/**
+ * @brief Writer side of the segment, owned by the interpreter
+ */
+class SharedStats {
+public:
+    static auto create(std::string name, Bytefile& bytefile) -> std::variant<DiagnosticsBag, SharedStats>;
+
+    /**
+     * @brief Copies current counters into the segment. Instructions and calls are
+     * counted by the loop of `--stats-shm`, so the other loops do not pay for them
+     */
+    void publish(Bytefile& bytefile, const Interpreter& interpreter, u64 instructions, u64 calls) noexcept;
+    void finish() noexcept;
+
+    SharedStats(const SharedStats&)                    = delete;
+    auto operator=(const SharedStats&) -> SharedStats& = delete;
+    SharedStats(SharedStats&& other) noexcept;
+    auto operator=(SharedStats&& other) noexcept -> SharedStats&;
+    ~SharedStats();
+
+private:
+    SharedStats() = default;
+
+    StatsSegment*    segment = nullptr;
+    usize            size    = 0;
+    std::string      name;
+    std::vector<u32> functions;
+};
@@ -0,0 +1,468 @@
+#include "Tier.hpp"
+
+#include "Analysis.hpp"
+#include "Interpreter.hpp"
+#include "Opcodes.hpp"
+#include "Types.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr usize WORD = sizeof(u32);
+
+constexpr usize MAX_INDEX = usize {1} << 24; // indices must fit into the reserved bytes of the opcode word
+
+auto readWord(std::span<const u8> code, usize offset) noexcept -> u32 {
+    u32 result;
+    copyValues(&result, code.data() + offset);
+    return result;
+}
+
+void patchOpcode(std::span<u8> code, usize offset, u8 opcode, usize index) noexcept {
+    auto word = opcode | static_cast<u32>(index) << 8;
+    std::memcpy(&code[offset], &word, WORD);
+}
+
+/**
+ * @brief Back edge that counts iterations instead of the jump, 0 if it is not a jump
+ */
+auto countedJump(u8 code) noexcept -> u8 {
+    switch (static_cast<Opcodes>(code)) {
+    case Opcodes::JMP:
+    case Opcodes::JMP_safe: return to_underlying(Opcodes::JMP_osr);
+    case Opcodes::CJMPz:
+    case Opcodes::CJMPz_safe: return to_underlying(Opcodes::CJMPz_osr);
+    case Opcodes::CJMPnz:
+    case Opcodes::CJMPnz_safe: return to_underlying(Opcodes::CJMPnz_osr);
+    default: return 0;
+    }
+}
+
+/**
+ * @brief Feedback of the instruction at `address`, nullptr if it has not been executed
+ */
+auto siteAt(std::span<const TypeFeedback::Site> sites, u32 address) -> const TypeFeedback::Site* {
+    auto site = std::lower_bound(sites.begin(), sites.end(), address,
+                                 [](const TypeFeedback::Site& lhs, u32 rhs) { return lhs.address < rhs; });
+    if (site == sites.end() || site->address != address || site->count == 0) { return nullptr; }
+    return &*site;
+}
+
+} // namespace
+
+Tier::Tier(Bytefile& file, Step stepOne, u32 callThreshold, bool inBackground)
+    : bytefile(file), step(stepOne), threshold(callThreshold), background(inBackground) {
+    std::span<u8> code = bytefile.bytecode;
+    for (usize i = 0; i < bytefile.functions.size() && i < MAX_INDEX; ++i) {
+        auto& entry = bytefile.functions[i];
+        functions.push_back({entry.entry, entry.end});
+
+        switch (static_cast<Opcodes>(code[entry.entry])) {
+        case Opcodes::BEGIN: patchOpcode(code, entry.entry, to_underlying(Opcodes::BEGIN_cnt), i); break;
+        case Opcodes::CBEGIN: patchOpcode(code, entry.entry, to_underlying(Opcodes::CBEGIN_cnt), i); break;
+        default: break;
+        }
+
+        // A jump back to the entry is a call anew, `BEGIN_cnt` counts it
+        for (usize offset = entry.entry; offset < entry.end;) {
+            auto length = instructionLength(code, offset);
+            if (!length.has_value()) { break; }
+
+            auto counted = countedJump(code[offset]);
+            if (counted && loops.size() < MAX_INDEX) {
+                auto header = readWord(code, offset + WORD);
+                if (header > entry.entry && header <= offset) {
+                    functions.back().loops.push_back(static_cast<u32>(loops.size()));
+                    loops.push_back({static_cast<u32>(i), static_cast<u32>(offset), code[offset]});
+                    patchOpcode(code, offset, counted, loops.size() - 1);
+                }
+            }
+            offset += length.value();
+        }
+    }
+
+    entries = std::make_unique<std::atomic<Code*>[]>(functions.size());
+    if (background) { compiler = std::thread([this] { compileQueued(); }); }
+}
+
+Tier::~Tier() {
+    if (compiler.joinable()) {
+        {
+            std::lock_guard guard(lock);
+            stopping = true;
+        }
+        wakeUp.notify_one();
+        compiler.join();
+    }
+    for (usize i = 0; i < functions.size(); ++i) { delete entries[i].load(std::memory_order_relaxed); }
+}
+
+auto Tier::onEntry(Interpreter& interpreter, u32 index) -> InterpretResult {
+    auto& function = functions[index];
+    if (!entries[index].load(std::memory_order_acquire) && !function.hot && ++function.calls < threshold) {
+        return InterpretResult::CONTINUE;
+    }
+    return enter(index, interpreter);
+}
+
+auto Tier::onBackEdge(Interpreter& interpreter, u32 index) -> InterpretResult {
+    auto& loop     = loops[index];
+    auto& function = functions[loop.function];
+    // A compiled function may still run in the interpreter, e.g. in a frame older than its code
+    if (!entries[loop.function].load(std::memory_order_acquire) && !function.hot && ++loop.iterations < threshold) {
+        return InterpretResult::CONTINUE;
+    }
+    // A queued function is entered when its code is published, the loop is still hot then
+    if (!background || entries[loop.function].load(std::memory_order_acquire)) { ++osrEntries; }
+    return enter(loop.function, interpreter);
+}
+
+auto Tier::onReturn(Interpreter& interpreter) -> InterpretResult {
+    if (running) { return InterpretResult::CONTINUE; }
+
+    auto address = static_cast<u32>(bytefile.address());
+    auto caller  = compiledCaller(address);
+    if (!caller) { return InterpretResult::CONTINUE; }
+    auto& code = *entries[*caller].load(std::memory_order_acquire);
+    return runFrom(*caller, code, code.opAt[(address - functions[*caller].entry) / WORD], interpreter);
+}
+
+auto Tier::compiledCaller(u32 address) const -> std::optional<u32> {
+    auto function = std::ranges::upper_bound(functions, address, {}, &Function::entry);
+    if (function == functions.begin()) { return std::nullopt; }
+    --function;
+    // The entry is a call, the callee starts in the interpreter that counts it
+    if (function->disabled || address <= function->entry || address >= function->end) { return std::nullopt; }
+
+    auto  index = static_cast<u32>(function - functions.begin());
+    auto* code  = entries[index].load(std::memory_order_acquire);
+    if (!code || code->opAt[(address - function->entry) / WORD] == NO_OP) { return std::nullopt; }
+    return index;
+}
+
+auto Tier::heat() const -> std::vector<Heat> {
+    std::vector<Heat> result;
+    for (usize i = 0; i < functions.size(); ++i) {
+        auto& function = functions[i];
+        if (function.disabled) {
+            result.push_back(Heat::Disabled);
+        } else {
+            bool hot = function.hot || function.queued || entries[i].load(std::memory_order_acquire);
+            result.push_back(hot ? Heat::Hot : Heat::Cold);
+        }
+    }
+    return result;
+}
+
+void Tier::warmUp(std::span<const Heat> previous) {
+    if (previous.size() != functions.size()) { return; }
+    for (usize i = 0; i < functions.size(); ++i) {
+        switch (previous[i]) {
+        case Heat::Cold: break;
+        case Heat::Hot: functions[i].hot = true; break;
+        case Heat::Disabled: disable(functions[i]); break;
+        }
+    }
+}
+
+auto Tier::enter(u32 index, Interpreter& interpreter) -> InterpretResult {
+    auto& function = functions[index];
+    auto* code     = entries[index].load(std::memory_order_acquire);
+    if (!code) {
+        if (background) {
+            schedule(index, interpreter);
+            return InterpretResult::CONTINUE;
+        }
+        code = compile(bytefile.bytecode.subspan(function.entry, function.end - function.entry), function.entry,
+                       sitesOf(function, interpreter))
+                   .release();
+        entries[index].store(code, std::memory_order_release);
+        ++compiled;
+    }
+    // A deoptimized function keeps its code: it may be on the native stack still, the tier frees it
+    auto address = static_cast<u32>(bytefile.address());
+    return runFrom(index, *code, code->opAt[(address - function.entry) / WORD], interpreter);
+}
+
+auto Tier::sitesOf(const Function& function, const Interpreter& interpreter) const
+    -> std::span<const TypeFeedback::Site> {
+    auto* feedback = interpreter.typeFeedback();
+    if (!feedback) { return {}; }
+    auto sites = feedback->sites();
+    auto less  = [](const TypeFeedback::Site& lhs, u32 rhs) { return lhs.address < rhs; };
+    auto begin = std::lower_bound(sites.begin(), sites.end(), function.entry, less);
+    auto end   = std::lower_bound(begin, sites.end(), function.end, less);
+    return {begin, end};
+}
+
+void Tier::schedule(u32 index, const Interpreter& interpreter) {
+    auto& function = functions[index];
+    if (function.queued || function.disabled) { return; }
+    function.queued = true;
+
+    std::span<const u8> code  = bytefile.bytecode;
+    auto                sites = sitesOf(function, interpreter);
+    Job                 job {index, {code.begin() + function.entry, code.begin() + function.end},
+                             {sites.begin(), sites.end()}};
+    {
+        std::lock_guard guard(lock);
+        jobs.push_back(std::move(job));
+    }
+    wakeUp.notify_one();
+}
+
+void Tier::compileQueued() {
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock guard(lock);
+            wakeUp.wait(guard, [this] { return stopping || !jobs.empty(); });
+            if (stopping) { return; }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        // The entry is written once by the constructor, the interpreter reads the code only after it is published
+        auto code = compile(job.code, functions[job.function].entry, job.sites);
+        entries[job.function].store(code.release(), std::memory_order_release);
+        ++compiled;
+    }
+}
+
+auto Tier::compile(std::span<const u8> code, u32 entry, std::span<const TypeFeedback::Site> sites)
+    -> std::unique_ptr<Code> {
+    auto result = std::make_unique<Code>();
+    auto end    = static_cast<u32>(entry + code.size());
+
+    result->opAt.assign(code.size() / WORD, NO_OP);
+    for (usize offset = 0; offset < code.size();) {
+        auto length = instructionLength(code, offset);
+        if (!length.has_value()) { break; } // the interpreter will report it, if it ever gets there
+
+        const auto& info = opcodeInfo(code[offset]);
+        Op          op {Kind::Generic, info.variant, info.has(OP_POLLS), static_cast<u32>(entry + offset), 0};
+        const auto* site = siteAt(sites, op.address);
+        switch (static_cast<Opcodes>(code[offset])) {
+        case Opcodes::CONST:
+            op.kind    = Kind::Const;
+            op.operand = readWord(code, offset + WORD);
+            break;
+        case Opcodes::LD_G:
+        case Opcodes::LD_L:
+        case Opcodes::LD_A:
+        case Opcodes::LD_C:
+            op.kind    = Kind::Load;
+            op.operand = readWord(code, offset + WORD);
+            break;
+        case Opcodes::ST_G:
+        case Opcodes::ST_L:
+        case Opcodes::ST_A:
+        case Opcodes::ST_C:
+            op.kind    = Kind::Store;
+            op.operand = readWord(code, offset + WORD);
+            break;
+        case Opcodes::DROP: op.kind = Kind::Drop; break;
+        case Opcodes::DUP: op.kind = Kind::Dup; break;
+        case Opcodes::SWAP: op.kind = Kind::Swap; break;
+        case Opcodes::ELEM:
+        case Opcodes::ELEM_arr:
+            op.site = readWord(code, offset) >> 8;
+            // Without the feedback it's the guess of `ELEM_arr`
+            if (!site || (site->kinds[0] == TypeFeedback::KIND_ARRAY && site->kinds[1] == TypeFeedback::KIND_INT)) {
+                op.kind = Kind::Elem;
+            }
+            break;
+        case Opcodes::BINOP_add:
+        case Opcodes::BINOP_sub:
+        case Opcodes::BINOP_mul:
+        case Opcodes::BINOP_div:
+        case Opcodes::BINOP_rem:
+        case Opcodes::BINOP_lt:
+        case Opcodes::BINOP_le:
+        case Opcodes::BINOP_gt:
+        case Opcodes::BINOP_ge:
+        case Opcodes::BINOP_eq:
+        case Opcodes::BINOP_ne:
+        case Opcodes::BINOP_and:
+        case Opcodes::BINOP_or:
+            op.site = readWord(code, offset) >> 8;
+            op.kind = site && site->kinds[0] == TypeFeedback::KIND_INT && site->kinds[1] == TypeFeedback::KIND_INT
+                        ? Kind::IntBinOp
+                        : Kind::BinOp;
+            break;
+        case Opcodes::CALLC:
+        case Opcodes::CALLC_safe:
+            if (site && site->identityKind == TypeFeedback::KIND_CLOSURE && !site->polymorphic) {
+                op.kind    = Kind::CallKnown;
+                op.operand = readWord(code, offset + WORD);
+                op.site    = readWord(code, offset) >> 8;
+                op.target  = site->identity;
+            }
+            break;
+        case Opcodes::JMP:
+        case Opcodes::JMP_safe:
+        case Opcodes::JMP_osr:
+            op.kind    = Kind::Jump;
+            op.operand = readWord(code, offset + WORD); // resolved below, when every operation is known
+            break;
+        case Opcodes::CJMPz:
+        case Opcodes::CJMPnz:
+        case Opcodes::CJMPz_safe:
+        case Opcodes::CJMPnz_safe:
+        case Opcodes::CJMPz_osr:
+        case Opcodes::CJMPnz_osr:
+            op.kind    = Kind::CondJump;
+            op.operand = readWord(code, offset + WORD);
+            break;
+        default: break;
+        }
+
+        result->opAt[offset / WORD] = static_cast<u32>(result->ops.size());
+        result->ops.push_back(op);
+        offset += length.value();
+    }
+
+    // Jumps out of the function are left to the interpreter
+    for (auto& op : result->ops) {
+        if (op.kind != Kind::Jump && op.kind != Kind::CondJump) { continue; }
+        if (op.operand <= entry || op.operand >= end || result->opAt[(op.operand - entry) / WORD] == NO_OP) {
+            op.kind = Kind::Generic;
+            continue;
+        }
+        op.operand = result->opAt[(op.operand - entry) / WORD];
+    }
+    return result;
+}
+
+auto Tier::runFrom(u32 function, const Code& code, u32 index, Interpreter& interpreter) -> InterpretResult {
+    // Returns are taken here, so a chain of compiled callers does not nest on the native stack
+    auto wasRunning = std::exchange(running, true);
+    auto result     = run(functions[function], code, index, interpreter);
+    while (result == InterpretResult::CONTINUE) {
+        auto address = static_cast<u32>(bytefile.address());
+        auto caller  = compiledCaller(address);
+        if (!caller) { break; }
+        auto& callerCode = *entries[*caller].load(std::memory_order_acquire);
+        result = run(functions[*caller], callerCode, callerCode.opAt[(address - functions[*caller].entry) / WORD],
+                     interpreter);
+    }
+    running = wasRunning;
+    return result;
+}
+
+auto Tier::run(Function& function, const Code& compiledCode, u32 index, Interpreter& interpreter)
+    -> InterpretResult {
+    auto* code     = bytefile.bytecode.data();
+    auto  result   = InterpretResult::CONTINUE;
+    auto* feedback = interpreter.typeFeedback();
+    // Before the instruction pops its operands, as `interpretOne` does
+    auto record = [&](const Op& op) {
+        if (feedback && op.site) { feedback->record(op.site, interpreter.stackValues()); }
+    };
+    while (index < compiledCode.ops.size()) {
+        const auto& op = compiledCode.ops[index];
+        bytefile.prevIP = code + op.address;
+        ++index;
+
+        switch (op.kind) {
+        case Kind::Const: result = interpreter.onConst(static_cast<i32>(op.operand)); break;
+        case Kind::Load: result = interpreter.onLoad(op.operand, static_cast<VariableType>(op.variant)); break;
+        case Kind::Store: result = interpreter.onStore(op.operand, static_cast<VariableType>(op.variant)); break;
+        case Kind::Drop: result = interpreter.onDrop(); break;
+        case Kind::Dup: result = interpreter.onDuplicate(); break;
+        case Kind::Swap: result = interpreter.onSwap(); break;
+        case Kind::BinOp:
+            record(op);
+            result = interpreter.onBinOp(static_cast<BinOp>(op.variant));
+            break;
+        case Kind::IntBinOp:
+            record(op);
+            if (interpreter.onBinOpInt(static_cast<BinOp>(op.variant))) { break; }
+            // The operands are recorded already, so the interpreter is not asked to do it again
+            deoptimize(function);
+            result = interpreter.onBinOp(static_cast<BinOp>(op.variant));
+            break;
+        case Kind::Elem:
+            record(op);
+            if (interpreter.onElemArray()) { break; }
+            deoptimize(function);
+            result = interpreter.onElem();
+            break;
+        case Kind::CallKnown: {
+            if (interpreter.closureCode(op.operand) != op.target) {
+                deoptimize(function);
+                index = fallBack(function, compiledCode, op.address, interpreter, result);
+                break;
+            }
+            if (op.polls && interpreter.onSafepoint() != InterpretResult::CONTINUE) {
+                return InterpretResult::INTERRUPTED;
+            }
+            record(op);
+            if (!interpreter.onCallClosure(code + op.address + 2 * WORD, op.operand)) { return InterpretResult::ERROR; }
+            // The code of a closure is a function, `CLOSURE` is verified at load. It may be compressed still
+            if (!bytefile.inflate(op.target)) { return InterpretResult::ERROR; }
+            bytefile.ip = code + op.target;
+            index       = NO_OP;
+            break;
+        }
+        case Kind::Jump:
+            if (op.polls && interpreter.onSafepoint() != InterpretResult::CONTINUE) {
+                return InterpretResult::INTERRUPTED;
+            }
+            index = op.operand;
+            break;
+        case Kind::CondJump: {
+            if (op.polls && interpreter.onSafepoint() != InterpretResult::CONTINUE) {
+                return InterpretResult::INTERRUPTED;
+            }
+            // The target is resolved already, so addresses only tell whether the jump is taken
+            auto jump = interpreter.onCondJump(op.variant != 0, op.address, op.address + 2 * WORD);
+            if (!jump.has_value()) { return InterpretResult::ERROR; }
+            if (jump.value() == op.address) { index = op.operand; }
+            break;
+        }
+        case Kind::Generic: index = fallBack(function, compiledCode, op.address, interpreter, result); break;
+        }
+        if (result != InterpretResult::CONTINUE) { return result; }
+    }
+    // Either the interpreter has taken over already, or the code has run past the function
+    if (index != NO_OP) { bytefile.ip = code + function.end; }
+    return InterpretResult::CONTINUE;
+}
+
+auto Tier::fallBack(Function& function, const Code& code, u32 address, Interpreter& interpreter,
+                    InterpretResult& result) -> u32 {
+    bytefile.ip = bytefile.bytecode.data() + address;
+    result      = step(bytefile, interpreter);
+    if (result != InterpretResult::CONTINUE || function.disabled) { return NO_OP; }
+
+    // Calls leave through the entry of the callee, a recursive call too: it starts anew from `BEGIN_cnt`.
+    // A recursive return stays in the function, the caller runs the same code
+    auto next = bytefile.address();
+    if (next <= function.entry || next >= function.end) { return NO_OP; }
+    return code.opAt[(next - function.entry) / WORD];
+}
+
+void Tier::deoptimize(Function& function) {
+    ++deoptimizations;
+    if (++function.failures < DEOPT_LIMIT) { return; }
+    disable(function);
+}
+
+void Tier::disable(Function& function) {
+    function.disabled  = true;
+    std::span<u8> code = bytefile.bytecode;
+    switch (static_cast<Opcodes>(code[function.entry])) {
+    case Opcodes::BEGIN_cnt: patchOpcode(code, function.entry, to_underlying(Opcodes::BEGIN), 0); break;
+    case Opcodes::CBEGIN_cnt: patchOpcode(code, function.entry, to_underlying(Opcodes::CBEGIN), 0); break;
+    default: break;
+    }
+    for (auto loop : function.loops) { patchOpcode(code, loops[loop].address, loops[loop].opcode, 0); }
+}
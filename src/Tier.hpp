@@ -0,0 +1,250 @@
+/**
+ * @file Tier.hpp
+ * @brief This file contains the compiled tier. A hot function is translated into
+ * an array of decoded operations: operands are read once, jumps point to operations
+ * and some instructions speculate on their operands behind guards
+ *
+ * Speculation follows the type feedback, if it is collected: `BINOP` that has seen
+ * only integers computes without the runtime, `CALLC` that has seen a single closure
+ * code jumps straight to it, and `ELEM` that has seen anything but arrays is not
+ * speculated on at all. Compiled code keeps recording the feedback
+ *
+ * Compiled code works on the interpreter `Stack` itself, so the interpreter frame
+ * is always exact and deoptimization needs nothing but the address of the failed
+ * instruction: `interpretOne` executes it generically and goes on from there.
+ * A function that deoptimizes too often is given back to the interpreter for good
+ *
+ * For the same reason calls leave compiled code: the callee starts in the interpreter
+ * at its `(C)BEGIN_cnt`, and when it returns, the caller goes on in its compiled
+ * code from the return address
+ *
+ * Loops are counted too, so a function that is called once and loops for long is
+ * compiled and entered at the loop header in the middle of its execution. The frame
+ * is the same for both tiers, so on-stack replacement transfers nothing
+ *
+ * Compilation may be done by a background thread: the hot function is queued with
+ * a snapshot of its code, and the interpreter goes on till the compiled code is
+ * published in the entry table, which `(C)BEGIN_cnt` and back edges check
+ *
+ */
+#pragma once
+
+#include "Interpreter.hpp"
+#include "TypeFeedback.hpp"
+#include "Types.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <vector>
+
+class Tier {
+public:
+    /**
+     * @brief Executes one instruction at ip, that's `interpretOne`
+     */
+    using Step = InterpretResult (*)(Bytefile& bytefile, Interpreter& interpreter);
+
+    /**
+     * @brief What a run has learned about a function, see `Profile`
+     */
+    enum class Heat : u8 {
+        Cold,
+        Hot,      // compiled at its first entry
+        Disabled, // deoptimized too often, never compiled
+    };
+
+    /**
+     * @brief Replaces `(C)BEGIN` of every function by `(C)BEGIN_cnt` and its back
+     * edges by `*_osr` jumps, the code must be decompressed already
+     *
+     * @param threshold calls or iterations of a loop after which the function is compiled
+     * @param background compile on a separate thread, the execution does not wait for it
+     */
+    Tier(Bytefile& bytefile, Step step, u32 threshold, bool background = false);
+
+    Tier(const Tier&)                    = delete;
+    auto operator=(const Tier&) -> Tier& = delete;
+    Tier(Tier&&)                         = delete;
+    auto operator=(Tier&&) -> Tier&      = delete;
+    ~Tier();
+
+    /**
+     * @brief Is called by `(C)BEGIN_cnt` after the prologue, ip is after it. Counts
+     * the call and runs compiled code if the function is hot
+     *
+     * @return as `interpretOne` does, ip is where the interpreter goes on
+     */
+    auto onEntry(Interpreter& interpreter, u32 function) -> InterpretResult;
+
+    /**
+     * @brief Is called by `*_osr` jumps when the jump is taken, ip is on the loop
+     * header. Counts the iteration and replaces the interpreter if the loop is hot
+     *
+     * @return as `interpretOne` does, ip is where the interpreter goes on
+     */
+    auto onBackEdge(Interpreter& interpreter, u32 loop) -> InterpretResult;
+
+    /**
+     * @brief Is called by `END` and `RET` when ip is on the return address. Goes on
+     * in compiled code if the caller is compiled
+     *
+     * @return as `interpretOne` does, ip is where the interpreter goes on
+     */
+    auto onReturn(Interpreter& interpreter) -> InterpretResult;
+
+    /**
+     * @brief Heat of every function, in the order of the function table
+     */
+    [[nodiscard]]
+    auto heat() const -> std::vector<Heat>;
+    /**
+     * @brief Takes the heat of a previous run, before anything is executed. It is
+     * ignored if the function table is different
+     */
+    void warmUp(std::span<const Heat> previous);
+
+    [[nodiscard]]
+    auto compiledCount() const noexcept -> usize {
+        return compiled;
+    }
+
+    [[nodiscard]]
+    auto osrEntryCount() const noexcept -> usize {
+        return osrEntries;
+    }
+
+    [[nodiscard]]
+    auto deoptimizationCount() const noexcept -> usize {
+        return deoptimizations;
+    }
+
+private:
+    static constexpr u32 NO_OP       = ~u32 {0};
+    static constexpr u32 DEOPT_LIMIT = 16; // failed guards after which the function is not compiled anymore
+
+    enum class Kind : u8 {
+        Generic, // executed by `step`
+        Const,
+        Load,
+        Store,
+        Drop,
+        Dup,
+        Swap,
+        BinOp,
+        IntBinOp,  // speculates on integers
+        Elem,      // speculates on an array
+        CallKnown, // speculates on the code of the closure
+        Jump,
+        CondJump,
+    };
+
+    struct Op {
+        Kind kind;
+        u8   variant; // of the opcode, see `LAMA_OPCODES`
+        bool polls;   // the instruction is a safepoint
+        u32  address;
+        u32  operand;    // index of the operation for jumps
+        u32  site   = 0; // of the type feedback, zero if there is none
+        u32  target = 0; // code address of the closure for `CallKnown`
+    };
+
+    struct Code {
+        std::vector<Op>  ops;
+        std::vector<u32> opAt; // operation of every word of the function, `NO_OP` inside of instructions
+    };
+
+    struct Function {
+        u32              entry;
+        u32              end;
+        u32              calls    = 0;
+        u32              failures = 0;
+        bool             disabled = false;
+        bool             hot      = false; // compiled at the first entry, the previous run has found it hot
+        bool             queued   = false; // for the background compilation
+        std::vector<u32> loops;            // indices in `Tier::loops`
+    };
+
+    struct Loop {
+        u32 function;
+        u32 address;    // of the back edge
+        u8  opcode;     // the back edge had before it was counted
+        u32 iterations = 0;
+    };
+
+    struct Job {
+        u32                             function;
+        std::vector<u8>                 code;  // snapshot, the interpreter patches the code while it is compiled
+        std::vector<TypeFeedback::Site> sites; // snapshot of the feedback on the function
+    };
+
+    /**
+     * @brief Runs the compiled function from ip. If it is not compiled yet, compiles
+     * it, or queues it and lets the interpreter go on
+     */
+    auto enter(u32 function, Interpreter& interpreter) -> InterpretResult;
+    /**
+     * @brief Feedback sites of the function, sorted by address, none if the feedback is off
+     */
+    auto sitesOf(const Function& function, const Interpreter& interpreter) const
+        -> std::span<const TypeFeedback::Site>;
+    /**
+     * @brief Compiles the code of a function that starts at `entry`, speculating on
+     * the feedback `sites` of it. It does not touch the tier, so it could be done by
+     * any thread
+     */
+    static auto compile(std::span<const u8> code, u32 entry, std::span<const TypeFeedback::Site> sites)
+        -> std::unique_ptr<Code>;
+    void schedule(u32 function, const Interpreter& interpreter);
+    /**
+     * @brief Compiled function that goes on from the return address `address`
+     */
+    auto compiledCaller(u32 address) const -> std::optional<u32>;
+    void compileQueued();
+    /**
+     * @brief Runs compiled code from operation `index`, and then compiled code of
+     * the callers it returns to, till the control is left to the interpreter
+     */
+    auto runFrom(u32 function, const Code& code, u32 index, Interpreter& interpreter) -> InterpretResult;
+    /**
+     * @brief Runs compiled code from operation `index` till the control leaves the function
+     */
+    auto run(Function& function, const Code& code, u32 index, Interpreter& interpreter) -> InterpretResult;
+    /**
+     * @brief Executes the instruction at `address` by the interpreter
+     *
+     * @return the operation to go on with, `NO_OP` if the control has left compiled code
+     */
+    auto fallBack(Function& function, const Code& code, u32 address, Interpreter& interpreter,
+                  InterpretResult& result) -> u32;
+    void deoptimize(Function& function);
+    /**
+     * @brief Gives the function back to the interpreter for good
+     */
+    void disable(Function& function);
+
+    Bytefile&             bytefile;
+    Step                  step;
+    u32                   threshold;
+    std::vector<Function> functions;
+    std::vector<Loop>     loops;
+    usize                 osrEntries      = 0;
+    usize                 deoptimizations = 0;
+    bool                  running         = false; // `runFrom` is on the native stack, it takes returns itself
+
+    // Compiled code of every function, it's published once and lives as long as the tier
+    std::unique_ptr<std::atomic<Code*>[]> entries;
+    std::atomic<usize>                    compiled {0};
+
+    bool                    background;
+    std::mutex              lock; // guards `jobs` and `stopping`
+    std::condition_variable wakeUp;
+    std::deque<Job>         jobs;
+    bool                    stopping = false;
+    std::thread             compiler;
+};
@@ -0,0 +1,188 @@
+#include "TypeFeedback.hpp"
+
+#include "Analysis.hpp"
+#include "Interpreter.hpp"
+#include "Opcodes.hpp"
+#include "Types.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <ostream>
+#include <string_view>
+
+#include "LamaRuntime.hpp"
+
+namespace {
+
+constexpr usize WORD = sizeof(u32);
+
+constexpr usize MAX_SITES = (usize {1} << 24) - 1; // indices must fit into the reserved bytes of the opcode word
+
+constexpr std::array<std::string_view, 6> KIND_NAMES {"int", "string", "array", "sexp", "closure", "ref"};
+
+auto kindsText(u8 kinds) -> std::string {
+    std::string result;
+    for (usize i = 0; i < KIND_NAMES.size(); ++i) {
+        if (!(kinds & 1U << i)) { continue; }
+        if (!result.empty()) { result += '|'; }
+        result += KIND_NAMES[i];
+    }
+    return result.empty() ? "-" : result;
+}
+
+} // namespace
+
+TypeFeedback::TypeFeedback(Bytefile& bytefile) {
+    for (auto& [name, hash] : bytefile.tags) {
+        if (auto text = bytefile.getString(name)) { constructors.emplace(UNBOX(hash), text.value()); }
+    }
+    for (usize i = 0; i + 1 < bytefile.publicSymbols.size(); i += 2) {
+        if (auto name = bytefile.getString(bytefile.publicSymbols[i])) {
+            functions.emplace(bytefile.publicSymbols[i + 1], name.value());
+        }
+    }
+
+    std::span<u8> code = bytefile.bytecode;
+    // Undecodable code is reported by the interpreter, if it ever gets there
+    forEachInstruction(code, [&](usize offset, usize) {
+        if (profiled.size() == MAX_SITES) { return; }
+
+        u32 depth = 0;
+        switch (static_cast<Opcodes>(code[offset])) {
+        case Opcodes::BINOP_add:
+        case Opcodes::BINOP_sub:
+        case Opcodes::BINOP_mul:
+        case Opcodes::BINOP_div:
+        case Opcodes::BINOP_rem:
+        case Opcodes::BINOP_lt:
+        case Opcodes::BINOP_le:
+        case Opcodes::BINOP_gt:
+        case Opcodes::BINOP_ge:
+        case Opcodes::BINOP_eq:
+        case Opcodes::BINOP_ne:
+        case Opcodes::BINOP_and:
+        case Opcodes::BINOP_or:
+        case Opcodes::ELEM:
+        case Opcodes::STA:
+        case Opcodes::TAG:
+        case Opcodes::ARRAY:
+        case Opcodes::PATT_str:
+        case Opcodes::PATT_string:
+        case Opcodes::PATT_array:
+        case Opcodes::PATT_sexp:
+        case Opcodes::PATT_ref:
+        case Opcodes::PATT_val:
+        case Opcodes::PATT_fun: break;
+        // Arguments are above the closure
+        case Opcodes::CALLC:
+        case Opcodes::CALLC_safe: copyValues(&depth, &code[offset + WORD]); break;
+        default: return;
+        }
+
+        const auto& info     = opcodeInfo(code[offset]);
+        u8          operands = info.pops == POPS_CLOSURE_CALL ? 1 : std::min<u8>(info.pops, MAX_OPERANDS);
+        profiled.push_back({static_cast<u32>(offset), code[offset], operands, depth});
+
+        u32 word = code[offset] | static_cast<u32>(profiled.size()) << 8;
+        std::memcpy(&code[offset], &word, WORD);
+    });
+}
+
+void TypeFeedback::record(u32 index, std::span<const usize> stack) noexcept {
+    auto& site = profiled[index - 1];
+    if (stack.size() < site.depth + site.operands) { return; } // the instruction reports it
+    site.count = satAdd(site.count, 1);
+
+    // `STA` to a variable gets references instead of the aggregate and the index
+    bool toVariable = site.opcode == to_underlying(Opcodes::STA) && !UNBOXED(stack[1]);
+    for (usize i = 0; i < site.operands; ++i) {
+        auto value = stack[site.depth + site.operands - 1 - i];
+        if (toVariable && i < 2) {
+            site.kinds[i] |= KIND_REFERENCE;
+            continue;
+        }
+        if (UNBOXED(value)) {
+            site.kinds[i] |= KIND_INT;
+            continue;
+        }
+
+        auto* header = TO_DATA(std::bit_cast<void*>(value));
+        u8    kind;
+        u32   identity;
+        switch (TAG(static_cast<u32>(header->data_header))) {
+        case STRING_TAG: site.kinds[i] |= KIND_STRING; continue;
+        case ARRAY_TAG: site.kinds[i] |= KIND_ARRAY; continue;
+        case SEXP_TAG:
+            kind     = KIND_SEXP;
+            identity = static_cast<u32>(reinterpret_cast<sexp*>(header)->tag); // NOLINT(*-reinterpret-cast)
+            break;
+        case CLOSURE_TAG:
+            kind = KIND_CLOSURE;
+            copyValues(&identity, header->contents);
+            break;
+        default: continue;
+        }
+        site.kinds[i] |= kind;
+        if (!site.identityKind) {
+            site.identity     = identity;
+            site.identityKind = kind;
+        } else if (site.identityKind != kind || site.identity != identity) {
+            site.polymorphic = true;
+        }
+    }
+}
+
+void TypeFeedback::merge(std::span<const Site> previous) noexcept {
+    for (auto& seen : previous) {
+        auto site = std::lower_bound(profiled.begin(), profiled.end(), seen.address,
+                                     [](const Site& lhs, u32 rhs) { return lhs.address < rhs; });
+        if (site == profiled.end() || site->address != seen.address || site->opcode != seen.opcode
+            || site->operands != seen.operands) {
+            continue;
+        }
+
+        site->count = satAdd(site->count, seen.count);
+        for (usize i = 0; i < site->operands; ++i) { site->kinds[i] |= seen.kinds[i]; }
+        site->polymorphic = site->polymorphic || seen.polymorphic;
+        if (!seen.identityKind) { continue; }
+        if (!site->identityKind) {
+            site->identity     = seen.identity;
+            site->identityKind = seen.identityKind;
+        } else if (site->identityKind != seen.identityKind || site->identity != seen.identity) {
+            site->polymorphic = true;
+        }
+    }
+}
+
+auto TypeFeedback::at(u32 address) const noexcept -> const Site* {
+    auto site = std::lower_bound(profiled.begin(), profiled.end(), address,
+                                 [](const Site& lhs, u32 rhs) { return lhs.address < rhs; });
+    if (site == profiled.end() || site->address != address) { return nullptr; }
+    return &*site;
+}
+
+void TypeFeedback::dump(std::ostream& out) const {
+    out << "# address instruction count operand-kinds... [identity]\n";
+    for (auto& site : profiled) {
+        if (site.count == 0) { continue; }
+
+        out << "0x" << std::hex << site.address << std::dec << ' ' << toString(static_cast<Opcodes>(site.opcode))
+            << ' ' << site.count;
+        for (usize i = 0; i < site.operands; ++i) { out << ' ' << kindsText(site.kinds[i]); }
+
+        if (site.polymorphic) {
+            out << " polymorphic";
+        } else if (site.identityKind) {
+            auto& names = site.identityKind == KIND_CLOSURE ? functions : constructors;
+            auto  name  = names.find(site.identity);
+            if (name != names.end()) {
+                out << ' ' << name->second;
+            } else {
+                out << " #" << std::hex << site.identity << std::dec;
+            }
+        }
+        out << '\n';
+    }
+}
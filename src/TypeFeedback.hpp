@@ -0,0 +1,87 @@
+/**
+ * @file TypeFeedback.hpp
+ * @brief This file contains type feedback: what kinds of values the instructions
+ * that depend on them (`BINOP`, `ELEM`, `STA`, `CALLC`, `TAG`, `ARRAY` and `PATT`)
+ * have seen. Every such instruction gets a site, its index is kept in the reserved
+ * bytes of the opcode word, so the interpreter finds the site without a lookup
+ *
+ * Code that the compiled tier runs records the feedback too, and the tier
+ * speculates on it when the function is compiled
+ *
+ */
+#pragma once
+
+#include "Interpreter.hpp"
+#include "Types.hpp"
+
+#include <array>
+#include <ostream>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class TypeFeedback {
+public:
+    // Kinds of values, a site keeps a set of them for every operand
+    static constexpr u8 KIND_INT       = 1U << 0;
+    static constexpr u8 KIND_STRING    = 1U << 1;
+    static constexpr u8 KIND_ARRAY     = 1U << 2;
+    static constexpr u8 KIND_SEXP      = 1U << 3;
+    static constexpr u8 KIND_CLOSURE   = 1U << 4;
+    static constexpr u8 KIND_REFERENCE = 1U << 5; // to a variable, `STA` stores through it
+
+    static constexpr usize MAX_OPERANDS = 3;
+
+    struct Site {
+        u32                          address;
+        u8                           opcode;
+        u8                           operands; // what `kinds` describe, in the order of pushes
+        u32                          depth;    // values on the stack above the operands
+        std::array<u8, MAX_OPERANDS> kinds {};
+        u32                          count        = 0; // executions, saturates
+        u32                          identity     = 0; // tag of the s-expression or address of the closure code
+        u8                           identityKind = 0; // `KIND_SEXP` or `KIND_CLOSURE`, zero if nothing is seen
+        bool                         polymorphic  = false; // more than one identity is seen
+    };
+
+    /**
+     * @brief Gives a site to every profiled instruction, the code must be
+     * decompressed already
+     */
+    explicit TypeFeedback(Bytefile& bytefile);
+
+    /**
+     * @brief Notes the operands of the site, `stack` goes from the top. Is
+     * called before the instruction pops them
+     */
+    void record(u32 site, std::span<const usize> stack) noexcept;
+
+    [[nodiscard]]
+    auto sites() const noexcept -> std::span<const Site> {
+        return profiled;
+    }
+
+    /**
+     * @brief Site of the instruction at `address`, nullptr if it is not profiled
+     */
+    [[nodiscard]]
+    auto at(u32 address) const noexcept -> const Site*;
+
+    /**
+     * @brief Adds what a previous run has seen. Sites are matched by their
+     * address and instruction, the ones that differ are skipped
+     */
+    void merge(std::span<const Site> previous) noexcept;
+
+    /**
+     * @brief Prints a line per executed site: address, instruction, count, kinds
+     * of the operands and the identity if there is a single one
+     */
+    void dump(std::ostream& out) const;
+
+private:
+    std::vector<Site>                    profiled; // site `i` is at `i - 1`, zero is no site
+    std::unordered_map<u32, std::string> constructors;
+    std::unordered_map<u32, std::string> functions;
+};
@@ -8,6 +8,8 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <string>
+#include <vector>
 
 using i8 = int8_t;
 using u8 = uint8_t;
@@ -19,3 +21,4 @@ using i64 = int64_t;
 using u64 = uint64_t;
 using usize = size_t;
 
+using DiagnosticsBag = std::vector<std::string>;